@@ -0,0 +1,109 @@
+/*
+arena.c:  Cache-line-aligned bump allocator on huge pages.
+
+The mapping is first requested with MAP_HUGETLB (needs pages reserved in /proc/sys/vm/nr_hugepages), if that fails a regular anonymous mapping aligned to 2 MB is used and marked with MADV_HUGEPAGE so that transparent huge pages can back it.
+Anonymous mappings are already zero filled by the kernel, so unlike calloc() nothing is zeroed twice, and a 2 MB frame buffer costs one page fault and one TLB entry instead of 512.
+*/
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+
+/**
+ * @brief Round up to a multiple of a power of two
+ */
+static size_t round_up(size_t value, size_t alignment)
+{
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+
+/**
+ * @brief Map a new arena
+ *
+ * @param arena [out] Arena to be initialized
+ * @param size [in] Minimum capacity in bytes (rounded up to ARENA_PAGE_SIZE)
+ * @return 0 on success, -1 if the memory could not be mapped
+ */
+int arena_create(ARENA *arena, size_t size)
+{
+	void *mapping;
+
+	arena->size = round_up(size ? size : 1, ARENA_PAGE_SIZE);
+	arena->used = 0;
+	arena->huge = 1;
+
+	mapping = mmap(NULL, arena->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if(mapping != MAP_FAILED)
+	{
+		arena->base = (unsigned char *)mapping;
+		return 0;
+	}
+
+	// No reserved huge pages: over-allocate by one page to align the start, then give back the slack
+	arena->huge = 0;
+	mapping = mmap(NULL, arena->size + ARENA_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mapping == MAP_FAILED)
+	{
+		arena->base = NULL;
+		arena->size = 0;
+		return -1;
+	}
+
+	uintptr_t start = (uintptr_t)mapping;
+	uintptr_t aligned = round_up(start, ARENA_PAGE_SIZE);
+	if(aligned > start)
+	{
+		munmap(mapping, aligned - start);
+	}
+	munmap((void *)(aligned + arena->size), ARENA_PAGE_SIZE - (aligned - start));
+
+	arena->base = (unsigned char *)aligned;
+	madvise(arena->base, arena->size, MADV_HUGEPAGE);	// Best effort, THP may be disabled
+	return 0;
+}
+
+
+/**
+ * @brief Take memory from the arena
+ *
+ * @param arena [in,out] Arena
+ * @param size [in] Requested size in bytes
+ * @return Zero-filled memory aligned to ARENA_ALIGNMENT, NULL if the arena is exhausted
+ */
+void *arena_alloc(ARENA *arena, size_t size)
+{
+	size_t start = round_up(arena->used, ARENA_ALIGNMENT);
+
+	if((start > arena->size) || (size > arena->size - start))
+	{
+		return NULL;
+	}
+
+	arena->used = start + size;
+	return arena->base + start;
+}
+
+
+/**
+ * @brief Zeroize the memory handed out and unmap the arena
+ *
+ * @param arena [in,out] Arena to be released
+ */
+void arena_destroy(ARENA *arena)
+{
+	if(arena->base == NULL)
+	{
+		return;
+	}
+
+	explicit_bzero(arena->base, arena->used);	// For security reasons overwrite memory before releasing it, not optimized away
+	munmap(arena->base, arena->size);
+
+	arena->base = NULL;
+	arena->size = 0;
+	arena->used = 0;
+}
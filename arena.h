@@ -0,0 +1,33 @@
+/*
+arena.h:  Header file for arena.c
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+
+#define ARENA_ALIGNMENT 64				//! Every allocation starts on its own cache line.
+#define ARENA_PAGE_SIZE (2UL << 20)		//! Huge page size, the arena is always a multiple of it.
+
+
+/**
+ * Bump allocator backed by 2 MB pages
+ *
+ * All the memory of a run (context and frame buffers) is taken from a single mapping, released (and zeroized) all at once with arena_destroy().
+ */
+typedef struct {
+  unsigned char *base;	//! Start of the mapping, aligned to ARENA_PAGE_SIZE.
+  size_t size;			//! Mapping size in bytes.
+  size_t used;			//! Bytes handed out so far.
+  int huge;				//! 1 if backed by MAP_HUGETLB pages, 0 if by transparent huge pages (when the kernel grants them).
+} ARENA;
+
+
+int arena_create(ARENA *arena, size_t size);
+void *arena_alloc(ARENA *arena, size_t size);
+void arena_destroy(ARENA *arena);
+
+
+#endif
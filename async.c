@@ -0,0 +1,195 @@
+/*
+async.c:  Non-blocking (en|de)cryption for event-loop servers.
+
+A request below the inline threshold is processed by the submitting thread with the batched kernel: for a few KB the handoff to a worker (queue, wake-up, completion signal) costs more than the work itself.
+A larger request is split in pieces, at most one per worker, queued on the pool; the last piece to finish appends the request to the completion queue and signals the eventfd.
+The event loop polls the eventfd with its sockets and, when it is readable, drains the completed requests with async_complete(). Nothing ever blocks the loop.
+The threshold depends on the machine (kernel speed, wake-up latency), the async cases of blowfish-benchmark measure both paths to tune it.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "async.h"
+
+
+/**
+ * @brief Run blocks of a request with the kernel of its engine, direction and mode
+ */
+static void crypt_blocks(ASYNC_REQUEST *request, long first, long blocks)
+{
+	uint64_t counter = request->counter + first;	// Ignored in ECB
+
+	Blowfish_SelectKernel(request->async->engine, request->direction, request->mode, KERNEL_WIDTH_DEFAULT)(request->ctx, request->in + first * 8, request->out + first * 8, blocks, &counter);
+}
+
+
+/**
+ * @brief Pool task: run a piece, the last piece done completes the request
+ */
+static void run_piece(POOL_TASK *task)
+{
+	ASYNC_PIECE *piece = (ASYNC_PIECE *)task;
+	ASYNC_REQUEST *request = piece->request;
+	ASYNC *async = request->async;
+	uint64_t one = 1;
+
+	crypt_blocks(request, piece->first, piece->blocks);
+
+	if(__sync_sub_and_fetch(&request->pending, 1) == 0)
+	{
+		request->next = NULL;
+		pthread_mutex_lock(&async->mutex);
+			if(async->tail == NULL)
+			{
+				async->head = request;
+			}
+			else
+			{
+				async->tail->next = request;
+			}
+			async->tail = request;
+		pthread_mutex_unlock(&async->mutex);
+
+		while((write(async->event_fd, &one, sizeof(one)) < 0) && (errno == EINTR));	// Queued before signaled, the loop never misses it
+	}
+}
+
+
+/**
+ * @brief Create a submission and completion queue
+ *
+ * @param async [out] Queue to be initialized
+ * @param pool [in] Pool running the large requests, shared with other users if needed
+ * @param engine [in] S-box lookup implementation
+ * @param inline_threshold [in] Requests below it (bytes) are processed by the submitting thread, ASYNC_INLINE_THRESHOLD_DEFAULT if not measured, at least 1
+ * @return 0 on success, -1 on error (EINVAL for a threshold below 1)
+ */
+int async_create(ASYNC *async, POOL *pool, BLOWFISH_ENGINE engine, long inline_threshold)
+{
+	if(inline_threshold < 1)
+	{
+		errno = EINVAL;	// It also sizes the pieces of a request
+		return -1;
+	}
+
+	async->pool = pool;
+	async->engine = engine;
+	async->inline_threshold = inline_threshold;
+	async->head = NULL;
+	async->tail = NULL;
+	async->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(async->event_fd < 0)
+	{
+		return -1;
+	}
+	pthread_mutex_init(&async->mutex, NULL);
+	return 0;
+}
+
+
+/**
+ * @brief Submit a request
+ *
+ * The caller fills ctx, in, out, blocks, direction, mode (and counter in CTR), the buffers must stay valid until the request completes.
+ *
+ * @param async [in] Queue
+ * @param request [in,out] Request
+ * @return 1 if the request was processed inline (already complete, it will not be returned by async_complete()), 0 if it was queued
+ */
+int async_submit(ASYNC *async, ASYNC_REQUEST *request)
+{
+	long bytes = request->blocks * 8;
+	int i = 0;
+
+	request->async = async;
+
+	if(bytes < async->inline_threshold)
+	{
+		crypt_blocks(request, 0, request->blocks);
+		return 1;
+	}
+
+	// One piece per worker, but no piece below the threshold
+	request->piece_count = bytes / async->inline_threshold;
+	if(request->piece_count > async->pool->thread_count)
+	{
+		request->piece_count = async->pool->thread_count;
+	}
+	if(request->piece_count > ASYNC_MAX_PIECES)
+	{
+		request->piece_count = ASYNC_MAX_PIECES;
+	}
+	if(request->piece_count < 1)
+	{
+		request->piece_count = 1;
+	}
+	request->pending = request->piece_count;
+
+	for(i = 0; i < request->piece_count; ++i)
+	{
+		ASYNC_PIECE *piece = &request->pieces[i];
+
+		piece->task.run = run_piece;
+		piece->request = request;
+		piece->first = request->blocks * i / request->piece_count;
+		piece->blocks = request->blocks * (i + 1) / request->piece_count - piece->first;
+		pool_submit(async->pool, &piece->task);
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Take a completed request, never blocks
+ *
+ * Call it until it returns NULL every time event_fd is readable.
+ *
+ * @return The request, NULL if none completed
+ */
+ASYNC_REQUEST *async_complete(ASYNC *async)
+{
+	ASYNC_REQUEST *request = NULL;
+	uint64_t count = 0;
+	int attempt = 0;
+
+	for(attempt = 0; (attempt < 2) && (request == NULL); ++attempt)
+	{
+		if(attempt == 1)
+		{
+			// Queue drained: reset the signal, then look again for a request queued in the meanwhile (its signal may just have been consumed)
+			if(read(async->event_fd, &count, sizeof(count)) < 0)
+			{
+				count = 0;
+			}
+		}
+
+		pthread_mutex_lock(&async->mutex);
+			request = async->head;
+			if(request != NULL)
+			{
+				async->head = request->next;
+				if(async->head == NULL)
+				{
+					async->tail = NULL;
+				}
+			}
+		pthread_mutex_unlock(&async->mutex);
+	}
+
+	return request;
+}
+
+
+/**
+ * @brief Release a queue, no request may be in flight
+ */
+void async_destroy(ASYNC *async)
+{
+	close(async->event_fd);
+	pthread_mutex_destroy(&async->mutex);
+	async->event_fd = -1;
+}
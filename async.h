@@ -0,0 +1,79 @@
+/*
+async.h:  Header file for async.c
+
+Non-blocking (en|de)cryption for event-loop servers: small buffers are
+processed inline by the batched kernel, large ones split across the worker
+pool; their completions are signaled on an eventfd that the loop polls with
+the rest of its descriptors.
+*/
+
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "blowfish.h"
+#include "kernel.h"
+#include "pool.h"
+
+
+#define ASYNC_INLINE_THRESHOLD_DEFAULT (64L << 10)	//! Buffers below it (bytes) are processed inline, see the async cases of blowfish-benchmark.
+#define ASYNC_MAX_PIECES 16							//! Maximum number of pool tasks a request is split into.
+
+
+struct ASYNC;
+struct ASYNC_REQUEST;
+
+
+/**
+ * Part of a request run by one pool task
+ */
+typedef struct {
+	POOL_TASK task;					//! First member, so the task is the piece.
+	struct ASYNC_REQUEST *request;	//! Request the piece belongs to.
+	long first;						//! First block of the piece.
+	long blocks;					//! Number of blocks of the piece.
+} ASYNC_PIECE;
+
+
+/**
+ * Request, owned by the caller until it completes (no allocation on submission)
+ */
+typedef struct ASYNC_REQUEST {
+	ASYNC_PIECE pieces[ASYNC_MAX_PIECES];	//! Pool tasks of a large request.
+	struct ASYNC *async;				//! Queue the request was submitted to.
+	const BLOWFISH_CTX *ctx;			//! Context of the key.
+	const unsigned char *in;			//! Input, blocks*8 bytes.
+	unsigned char *out;					//! Output, may be the same buffer of in.
+	long blocks;						//! Number of 8 bytes blocks.
+	char direction;						//! 'e' encrypt, 'd' decrypt.
+	BLOWFISH_MODE mode;					//! BLOWFISH_ECB or BLOWFISH_CTR (the pieces are independent in both).
+	uint64_t counter;					//! Counter of the first block in CTR.
+	void *user;							//! Free for the caller (e.g. the coroutine or connection waiting for the request).
+	int piece_count;					//! Number of pieces.
+	int pending;						//! Pieces not yet done.
+	struct ASYNC_REQUEST *next;			//! Completion queue link.
+} ASYNC_REQUEST;
+
+
+/**
+ * Submission and completion queue over a worker pool
+ */
+typedef struct ASYNC {
+	POOL *pool;						//! Workers of the large requests.
+	BLOWFISH_ENGINE engine;			//! S-box lookup implementation.
+	long inline_threshold;			//! Requests below it (bytes) are processed by the submitting thread.
+	int event_fd;					//! Readable when requests completed, to be polled by the event loop.
+	ASYNC_REQUEST *head;			//! First completed request.
+	ASYNC_REQUEST *tail;			//! Last completed request.
+	pthread_mutex_t mutex;			//! Protects the completion queue.
+} ASYNC;
+
+
+int async_create(ASYNC *async, POOL *pool, BLOWFISH_ENGINE engine, long inline_threshold);
+int async_submit(ASYNC *async, ASYNC_REQUEST *request);
+ASYNC_REQUEST *async_complete(ASYNC *async);
+void async_destroy(ASYNC *async);
+
+
+#endif
@@ -0,0 +1,120 @@
+/*
+async.hpp:  C++20 coroutine interface of async.h
+
+	int status = co_await encrypt_async(&async, &ctx, in, out);
+
+submits an ASYNC_REQUEST and evaluates to 0 once out holds the result, or to EINVAL (nothing processed) if in is not a whole number
+of 8 bytes blocks, out is shorter than in or the mode is not ECB or CTR.
+A request below the inline threshold is done within the co_await, the coroutine does not suspend. A larger one runs on the pool and
+the coroutine stays suspended until the event loop calls async_resume(), every time event_fd is readable: coroutines always continue
+on the loop thread, never on a worker.
+The awaitable holds the request, so a co_await allocates nothing; in and out must stay valid until it returns.
+*/
+
+#ifndef ASYNC_HPP
+#define ASYNC_HPP
+
+#include <cerrno>
+#include <coroutine>
+#include <cstdint>
+#include <span>
+
+extern "C" {
+#include "async.h"
+}
+
+
+/**
+ * Awaitable of one request, made by encrypt_async() and decrypt_async()
+ */
+class ASYNC_AWAITABLE {
+public:
+	ASYNC_AWAITABLE(ASYNC *async, const BLOWFISH_CTX *ctx, std::span<const unsigned char> in, std::span<unsigned char> out, char direction, BLOWFISH_MODE mode, uint64_t counter)
+		: async(async), status(0)
+	{
+		if((in.size() % 8 != 0) || (out.size() < in.size()) || ((mode != BLOWFISH_ECB) && (mode != BLOWFISH_CTR)))
+		{
+			status = EINVAL;	// CBC chains the blocks, the pieces of a request could not run in parallel
+		}
+		request.ctx = ctx;
+		request.in = in.data();
+		request.out = out.data();
+		request.blocks = (long)(in.size() / 8);
+		request.direction = direction;
+		request.mode = mode;
+		request.counter = counter;
+	}
+
+	// Submitted requests point to the awaitable, it never moves
+	ASYNC_AWAITABLE(const ASYNC_AWAITABLE &) = delete;
+	ASYNC_AWAITABLE &operator=(const ASYNC_AWAITABLE &) = delete;
+
+	/**
+	 * @brief A refused request is not submitted, the coroutine goes on with EINVAL
+	 */
+	bool await_ready() const noexcept
+	{
+		return status != 0;
+	}
+
+	/**
+	 * @brief Submit the request
+	 *
+	 * @return true if it went to the pool (the coroutine waits for async_resume()), false if it was processed inline (the coroutine goes on)
+	 */
+	bool await_suspend(std::coroutine_handle<> handle) noexcept
+	{
+		request.user = handle.address();
+		return async_submit(async, &request) == 0;
+	}
+
+	int await_resume() const noexcept
+	{
+		return status;
+	}
+
+private:
+	ASYNC_REQUEST request;		//! Request, submitted when the coroutine suspends.
+	ASYNC *async;				//! Queue of the request.
+	int status;					//! 0, or EINVAL for a refused request.
+};
+
+
+/**
+ * @brief Encrypt in to out (they may be the same memory), in ECB or in CTR from counter
+ */
+inline ASYNC_AWAITABLE encrypt_async(ASYNC *async, const BLOWFISH_CTX *ctx, std::span<const unsigned char> in, std::span<unsigned char> out, BLOWFISH_MODE mode = BLOWFISH_ECB, uint64_t counter = 0)
+{
+	return ASYNC_AWAITABLE(async, ctx, in, out, 'e', mode, counter);
+}
+
+
+/**
+ * @brief Decrypt in to out (they may be the same memory), in ECB or in CTR from counter
+ */
+inline ASYNC_AWAITABLE decrypt_async(ASYNC *async, const BLOWFISH_CTX *ctx, std::span<const unsigned char> in, std::span<unsigned char> out, BLOWFISH_MODE mode = BLOWFISH_ECB, uint64_t counter = 0)
+{
+	return ASYNC_AWAITABLE(async, ctx, in, out, 'd', mode, counter);
+}
+
+
+/**
+ * @brief Resume the coroutines whose requests completed, to be called by the event loop every time event_fd is readable
+ *
+ * @return Number of coroutines resumed
+ */
+inline int async_resume(ASYNC *async)
+{
+	ASYNC_REQUEST *request;
+	int resumed = 0;
+
+	while((request = async_complete(async)) != nullptr)
+	{
+		std::coroutine_handle<>::from_address(request->user).resume();
+		resumed++;
+	}
+	return resumed;
+}
+
+
+#endif
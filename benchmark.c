@@ -0,0 +1,335 @@
+/*
+benchmark.c:  In-memory throughput of the Blowfish engines.
+
+Usage: blowfish-benchmark [buffer_size_in_KB]
+
+Every case (en|de)crypts a RAM-resident buffer on a single thread, so the figures exclude disk I/O and thread scaling and can be compared directly between engines.
+The async cases then compare, for growing request sizes, the latency of a request processed inline with that of a request handed to the worker pool (async.c), and print the size from which the pool wins: the inline threshold to give to async_create().
+The buffer cases do the same for the synchronous buffer_crypt() (buffer.c), in GB/s, for the inline threshold of the library callers.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include "async.h"
+#include "blowfish.h"
+#include "buffer.h"
+#include "kernel.h"
+#include "cbc.h"
+#include "cpu.h"
+#include "pool.h"
+
+
+#define BENCHMARK_STREAMS 64	//! Number of independent streams of the multi-stream CBC case.
+#define BENCHMARK_ASYNC_MIN 1024L			//! Smallest request of the async cases in bytes.
+#define BENCHMARK_ASYNC_MAX (16L << 20)		//! Largest request of the async cases in bytes.
+#define BENCHMARK_ASYNC_BYTES (32L << 20)	//! Bytes processed for every size of the async cases (repeated requests).
+#define BENCHMARK_BUFFER_MIN 4096L			//! Smallest buffer of the buffer cases in bytes.
+#define BENCHMARK_BUFFER_BYTES (64L << 20)	//! Bytes processed for every size of the buffer cases (repeated calls).
+
+
+/**
+ * Benchmark case: either a function processing a whole buffer of 64 bits blocks one block at a time (reference), or a bulk kernel
+ */
+typedef struct {
+	const char *name;
+	void (*run)(BLOWFISH_CTX *ctx, uint64_t *buffer, long blocks);	//! Reference loop, NULL to use the kernel below.
+	BLOWFISH_ENGINE engine;		//! Kernel engine.
+	char direction;				//! Kernel direction.
+	BLOWFISH_MODE mode;			//! Kernel mode of operation.
+	int width;					//! Kernel interleave width.
+	long max_size;				//! Cap on the buffer size in bytes for slow cases (0 for none).
+} BENCHMARK_CASE;
+
+
+static void table_encrypt(BLOWFISH_CTX *ctx, uint64_t *buffer, long blocks)
+{
+	long i;
+	for(i = 0; i < blocks; ++i)
+	{
+		buffer[i] = BlowfishEncryption(ctx, buffer[i]);
+	}
+}
+
+static void table_decrypt(BLOWFISH_CTX *ctx, uint64_t *buffer, long blocks)
+{
+	long i;
+	for(i = 0; i < blocks; ++i)
+	{
+		buffer[i] = BlowfishDecryption(ctx, buffer[i]);
+	}
+}
+
+static void ct_encrypt(BLOWFISH_CTX *ctx, uint64_t *buffer, long blocks)
+{
+	long i;
+	for(i = 0; i < blocks; ++i)
+	{
+		buffer[i] = BlowfishEncryptionCT(ctx, buffer[i]);
+	}
+}
+
+static void ct_decrypt(BLOWFISH_CTX *ctx, uint64_t *buffer, long blocks)
+{
+	long i;
+	for(i = 0; i < blocks; ++i)
+	{
+		buffer[i] = BlowfishDecryptionCT(ctx, buffer[i]);
+	}
+}
+
+/**
+ * @brief CBC encryption of the buffer split in BENCHMARK_STREAMS independent streams, interleaved on the calling thread
+ */
+static void streams_cbc_encrypt(BLOWFISH_CTX *ctx, uint64_t *buffer, long blocks)
+{
+	BLOWFISH_STREAM streams[BENCHMARK_STREAMS];
+	long length = blocks / BENCHMARK_STREAMS;
+	int i;
+
+	for(i = 0; i < BENCHMARK_STREAMS; ++i)
+	{
+		streams[i].ctx = ctx;
+		streams[i].in = (unsigned char *)(buffer + i * length);
+		streams[i].out = (unsigned char *)(buffer + i * length);
+		streams[i].blocks = (i == BENCHMARK_STREAMS - 1) ? blocks - i * length : length;
+		streams[i].iv = i;
+	}
+	cbc_encrypt_streams(BLOWFISH_ENGINE_TABLE, streams, BENCHMARK_STREAMS, KERNEL_WIDTH_MAX, 1);
+}
+
+
+static const BENCHMARK_CASE cases[] = {
+	{"table encrypt", table_encrypt, 0, 0, 0, 0, 0},
+	{"table decrypt", table_decrypt, 0, 0, 0, 0, 0},
+	{"ct encrypt", ct_encrypt, 0, 0, 0, 0, 1L << 20},
+	{"ct decrypt", ct_decrypt, 0, 0, 0, 0, 1L << 20},
+	{"kernel table ecb encrypt x1", NULL, BLOWFISH_ENGINE_TABLE, 'e', BLOWFISH_ECB, 1, 0},
+	{"kernel table ecb encrypt x2", NULL, BLOWFISH_ENGINE_TABLE, 'e', BLOWFISH_ECB, 2, 0},
+	{"kernel table ecb encrypt x4", NULL, BLOWFISH_ENGINE_TABLE, 'e', BLOWFISH_ECB, 4, 0},
+	{"kernel table ecb encrypt x8", NULL, BLOWFISH_ENGINE_TABLE, 'e', BLOWFISH_ECB, 8, 0},
+	{"kernel table ecb decrypt x4", NULL, BLOWFISH_ENGINE_TABLE, 'd', BLOWFISH_ECB, 4, 0},
+	{"kernel table ctr x4", NULL, BLOWFISH_ENGINE_TABLE, 'e', BLOWFISH_CTR, 4, 0},
+	{"kernel table cbc encrypt x1", NULL, BLOWFISH_ENGINE_TABLE, 'e', BLOWFISH_CBC, 1, 0},
+	{"streams table cbc encrypt x8", streams_cbc_encrypt, 0, 0, 0, 0, 0},
+	{"kernel table cbc decrypt x4", NULL, BLOWFISH_ENGINE_TABLE, 'd', BLOWFISH_CBC, 4, 0},
+	{"kernel ct ecb encrypt x4", NULL, BLOWFISH_ENGINE_CONSTANT_TIME, 'e', BLOWFISH_ECB, 4, 1L << 20},
+};
+
+
+/**
+ * @brief Seconds elapsed between two time instants
+ */
+static double elapsed(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+/**
+ * @brief Average latency in microseconds of a request of the given size submitted to async
+ */
+static double async_latency(ASYNC *async, BLOWFISH_CTX *ctx, unsigned char *buffer, long request_size)
+{
+	ASYNC_REQUEST request;
+	struct pollfd event = {async->event_fd, POLLIN, 0};
+	struct timespec start, end;
+	long repeats = (BENCHMARK_ASYNC_BYTES / request_size > 1) ? BENCHMARK_ASYNC_BYTES / request_size : 1;
+	long i;
+
+	request.ctx = ctx;
+	request.in = buffer;
+	request.out = buffer;
+	request.blocks = request_size / 8;
+	request.direction = 'e';
+	request.mode = BLOWFISH_ECB;
+	request.counter = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < repeats; ++i)
+	{
+		if(async_submit(async, &request) == 0)
+		{
+			while(async_complete(async) == NULL)
+			{
+				poll(&event, 1, -1);	// As an event loop would, with its sockets
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return elapsed(&start, &end) * 1e6 / repeats;
+}
+
+
+/**
+ * @brief Inline against pool latency for growing request sizes, and the resulting inline threshold
+ */
+static void benchmark_async(BLOWFISH_CTX *ctx, unsigned char *buffer, long size)
+{
+	POOL pool;
+	ASYNC inline_async, pool_async;
+	long request_size;
+	long threshold = 0;	//! Size from which the pool always wins, 0 if none.
+	int threads = cpu_available();
+
+	if((pool_create(&pool, threads) != 0) || (async_create(&inline_async, &pool, BLOWFISH_ENGINE_TABLE, BENCHMARK_ASYNC_MAX + 1) != 0) || (async_create(&pool_async, &pool, BLOWFISH_ENGINE_TABLE, 8) != 0))
+	{
+		perror("Failed to create the pool, exiting");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("\n%-32s %12s %12s %12s\n", "async table ecb encrypt", "bytes", "inline us", "pool us");
+	for(request_size = BENCHMARK_ASYNC_MIN; (request_size <= BENCHMARK_ASYNC_MAX) && (request_size <= size); request_size *= 2)
+	{
+		double inline_us = async_latency(&inline_async, ctx, buffer, request_size);
+		double pool_us = async_latency(&pool_async, ctx, buffer, request_size);
+
+		printf("%-32s %12ld %12.1f %12.1f\n", "", request_size, inline_us, pool_us);
+		if(pool_us >= inline_us)
+		{
+			threshold = 0;	// The pool must win at every larger size too, not on a single noisy sample
+		}
+		else if(threshold == 0)
+		{
+			threshold = request_size;
+		}
+	}
+
+	if(threshold != 0)
+	{
+		printf("inline threshold with %d workers: %ld bytes\n", threads, threshold);
+	}
+	else
+	{
+		printf("inline threshold with %d workers: none, inline is faster up to %ld bytes\n", threads, request_size / 2);
+	}
+
+	async_destroy(&inline_async);
+	async_destroy(&pool_async);
+	pool_destroy(&pool);
+}
+
+
+/**
+ * @brief Throughput in GB/s of buffer_crypt() on buffers of the given size (output size, padding included)
+ *
+ * @param pool [in] Pool, NULL for the inline path
+ */
+static double buffer_throughput(BLOWFISH_CTX *ctx, unsigned char *buffer, long buffer_size, POOL *pool)
+{
+	struct timespec start, end;
+	long repeats = (BENCHMARK_BUFFER_BYTES / buffer_size > 1) ? BENCHMARK_BUFFER_BYTES / buffer_size : 1;
+	long i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < repeats; ++i)
+	{
+		buffer_crypt(ctx, BLOWFISH_ENGINE_TABLE, 'e', buffer, buffer, buffer_size - 8, pool, BENCHMARK_BUFFER_MIN);	// In place, the padding block fills the last 8 bytes
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (double)buffer_size * repeats / elapsed(&start, &end) / 1e9;
+}
+
+
+/**
+ * @brief Inline against pool throughput of buffer_crypt() for growing buffer sizes, and the resulting inline threshold
+ */
+static void benchmark_buffer(BLOWFISH_CTX *ctx, unsigned char *buffer, long size)
+{
+	POOL pool;
+	long buffer_size;
+	long threshold = 0;	//! Size from which the pool always wins, 0 if none.
+	int threads = cpu_available();
+
+	if(pool_create(&pool, threads) != 0)
+	{
+		perror("Failed to create the pool, exiting");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("\n%-32s %12s %12s %12s\n", "buffer table ecb encrypt", "bytes", "inline GB/s", "pool GB/s");
+	for(buffer_size = BENCHMARK_BUFFER_MIN; buffer_size <= size; buffer_size *= 2)
+	{
+		double inline_gbs = buffer_throughput(ctx, buffer, buffer_size, NULL);
+		double pool_gbs = buffer_throughput(ctx, buffer, buffer_size, &pool);
+
+		printf("%-32s %12ld %12.3f %12.3f\n", "", buffer_size, inline_gbs, pool_gbs);
+		if(pool_gbs <= inline_gbs)
+		{
+			threshold = 0;	// As in benchmark_async(), the pool must win at every larger size
+		}
+		else if(threshold == 0)
+		{
+			threshold = buffer_size;
+		}
+	}
+
+	if(threshold != 0)
+	{
+		printf("buffer inline threshold with %d workers: %ld bytes\n", threads, threshold);
+	}
+	else
+	{
+		printf("buffer inline threshold with %d workers: none, inline is faster up to %ld bytes\n", threads, buffer_size / 2);
+	}
+
+	pool_destroy(&pool);
+}
+
+
+int main(int argc, char **argv)
+{
+	long size = (argc > 1) ? atol(argv[1]) * 1024 : 64L << 20;	//! Buffer size in bytes.
+	unsigned char key[] = "benchmark-key";
+	BLOWFISH_CTX ctx;
+	unsigned int c;
+
+	size -= size % 8;
+	if(size <= 0)
+	{
+		perror("Usage: blowfish-benchmark [buffer_size_in_KB]\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t *buffer = (uint64_t *) malloc(size);
+	if(buffer == NULL)
+	{
+		perror("Failed to allocate buffer, exiting");
+		exit(EXIT_FAILURE);
+	}
+	memset(buffer, 0xA5, size);
+	Blowfish_Init(&ctx, key, sizeof(key) - 1);
+
+	printf("%-32s %12s %10s\n", "case", "bytes", "MB/s");
+	for(c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c)
+	{
+		long case_size = (cases[c].max_size && (cases[c].max_size < size)) ? cases[c].max_size : size;
+		struct timespec start, end;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if(cases[c].run != NULL)
+		{
+			cases[c].run(&ctx, buffer, case_size / 8);
+		}
+		else
+		{
+			uint64_t iv = 0;
+			Blowfish_SelectKernel(cases[c].engine, cases[c].direction, cases[c].mode, cases[c].width)(&ctx, (unsigned char *)buffer, (unsigned char *)buffer, case_size / 8, &iv);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		printf("%-32s %12ld %10.1f\n", cases[c].name, case_size, case_size / elapsed(&start, &end) / 1e6);
+	}
+
+	benchmark_async(&ctx, (unsigned char *)buffer, size);
+	benchmark_buffer(&ctx, (unsigned char *)buffer, size);
+
+	memset(&ctx, 0, sizeof(ctx));
+	free(buffer);
+	return 0;
+}
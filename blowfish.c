@@ -45,6 +45,7 @@ Modified by Alessandro Renzi (alessandro.renzi@about.me) for multithread impleme
 
 
 #include <stdint.h>
+#include <string.h>	// for memcpy()
 #include "blowfish.h"
 #include "debug.h"
 
@@ -347,6 +348,39 @@ static uint32_t F(BLOWFISH_CTX *ctx, uint32_t x) {
 }
 
 
+/**
+ * @brief Constant-time F function
+ * 
+ * Same result of F() without secret-dependent memory addresses: every S-box entry is loaded and the wanted one is selected with a mask, so the cache footprint and the timing do not depend on x.
+ * The loop has no data-dependent branches and is vectorized by the compiler, it is still roughly two orders of magnitude slower than the table lookup.
+ */
+static uint32_t F_ct(BLOWFISH_CTX *ctx, uint32_t x) {
+	uint32_t a = (x >> 24) & 0xFF;
+	uint32_t b = (x >> 16) & 0xFF;
+	uint32_t c = (x >> 8) & 0xFF;
+	uint32_t d = x & 0xFF;
+	uint32_t sa = 0, sb = 0, sc = 0, sd = 0;
+	uint32_t k;
+	
+	for (k = 0; k < 256; ++k)
+	{
+		// ((k ^ i) - 1) >> 31 is 1 only when k == i (both below 256), negated it becomes an all-ones mask
+		sa |= ctx->S[0][k] & (0 - (((k ^ a) - 1) >> 31));
+		sb |= ctx->S[1][k] & (0 - (((k ^ b) - 1) >> 31));
+		sc |= ctx->S[2][k] & (0 - (((k ^ c) - 1) >> 31));
+		sd |= ctx->S[3][k] & (0 - (((k ^ d) - 1) >> 31));
+	}
+	
+	uint32_t y = ((sa + sb) ^ sc) + sd;
+	
+	// Clean temp data for security reasons
+	a = b = c = d = 0;
+	sa = sb = sc = sd = 0;
+	
+	return y;
+}
+
+
 /**
  * @brief Blowfish encription
  * 
@@ -476,15 +510,82 @@ void Blowfish_Decrypt(BLOWFISH_CTX *ctx, uint32_t *xl, uint32_t *xr){
 
 
 /**
- * @brief Context initialization
+ * @brief Constant-time Blowfish encription
  * 
- * Must be run only once before encryption or decryption.
+ * @param ctx [in] Current context
+ * @param xl [in,out] Left half input (data is overwritten)
+ * @param xr [in,out] Right half input (data is overwritten)
+ * @see Blowfish_Encrypt()
+ */
+void Blowfish_EncryptCT(BLOWFISH_CTX *ctx, uint32_t *xl, uint32_t *xr){
+	uint32_t  Xl = *xl;
+	uint32_t  Xr = *xr;
+	uint32_t  temp;
+	int       i;
+
+	for (i = 0; i < N; ++i) 
+	{
+		Xl = Xl ^ ctx->P[i];
+		Xr = F_ct(ctx, Xl) ^ Xr;
+
+		temp = Xl;
+		Xl = Xr;
+		Xr = temp;
+	}
+
+	*xl = Xr ^ ctx->P[N + 1];	// Undo the last swap while applying the output whitening
+	*xr = Xl ^ ctx->P[N];
+	
+	// Clean temp data for security reasons
+	Xl = 0;
+	Xr = 0;
+	temp = 0;
+}
+
+
+/**
+ * @brief Constant-time Blowfish decription
+ * 
+ * @param ctx [in] Current context
+ * @param xl [in,out] Left half input (data is overwritten)
+ * @param xr [in,out] Right half input (data is overwritten)
+ * @see Blowfish_Decrypt()
+ */
+void Blowfish_DecryptCT(BLOWFISH_CTX *ctx, uint32_t *xl, uint32_t *xr){
+	uint32_t  Xl = *xl;
+	uint32_t  Xr = *xr;
+	uint32_t  temp;
+	int       i;
+
+	for (i = N + 1; i > 1; --i) 
+	{
+		Xl = Xl ^ ctx->P[i];
+		Xr = F_ct(ctx, Xl) ^ Xr;
+
+		temp = Xl;
+		Xl = Xr;
+		Xr = temp;
+	}
+
+	*xl = Xr ^ ctx->P[0];
+	*xr = Xl ^ ctx->P[1];
+	
+	// Clean temp data for security reasons
+	Xl = 0;
+	Xr = 0;
+	temp = 0;
+}
+
+
+/**
+ * @brief Key schedule shared by Blowfish_Init() and Blowfish_InitCT()
  * 
  * @param ctx [out] Pointer to context to be initialized
  * @param key [in] Key string
  * @param keyLen [in] Key string length
+ * @param encrypt [in] Block encryption used to generate the subkeys
  */
-void Blowfish_Init(BLOWFISH_CTX *ctx, unsigned char *key, int keyLen) {
+static void key_schedule(BLOWFISH_CTX *ctx, unsigned char *key, int keyLen, void (*encrypt)(BLOWFISH_CTX *, uint32_t *, uint32_t *)) {
 	int i, j, k;
 	uint32_t data, datal, datar;
 
@@ -522,7 +623,7 @@ void Blowfish_Init(BLOWFISH_CTX *ctx, unsigned char *key, int keyLen) {
 
 	for (i = 0; i < N + 2; i += 2) 
 	{
-		Blowfish_Encrypt(ctx, &datal, &datar);
+		encrypt(ctx, &datal, &datar);
 		ctx->P[i] = datal;
 		ctx->P[i + 1] = datar;
 #ifdef TRACE
@@ -538,7 +639,7 @@ void Blowfish_Init(BLOWFISH_CTX *ctx, unsigned char *key, int keyLen) {
 	for (i = 0; i < 4; ++i) 
 	{
 		for (j = 0; j < 256; j += 2) {
-		Blowfish_Encrypt(ctx, &datal, &datar);
+		encrypt(ctx, &datal, &datar);
 		ctx->S[i][j] = datal;
 		ctx->S[i][j + 1] = datar;
 #ifdef TRACE
@@ -562,6 +663,102 @@ void Blowfish_Init(BLOWFISH_CTX *ctx, unsigned char *key, int keyLen) {
 }
 
 
+/**
+ * @brief Context initialization
+ * 
+ * Must be run only once before encryption or decryption.
+ * 
+ * @param ctx [out] Pointer to context to be initialized
+ * @param key [in] Key string
+ * @param keyLen [in] Key string length
+ */
+void Blowfish_Init(BLOWFISH_CTX *ctx, unsigned char *key, int keyLen) {
+	key_schedule(ctx, key, keyLen, Blowfish_Encrypt);
+}
+
+
+/**
+ * @brief Batched context initialization
+ * 
+ * Same contexts of count calls to Blowfish_Init(), but the 521 chained encryptions of the key schedules run interleaved: each chain is serial, the chains are independent, so the S-box loads of one key overlap with those of the others.
+ * Meant for workloads that expand many keys (key search), a single key gains nothing.
+ * 
+ * @param ctx [out] Array of count contexts to be initialized
+ * @param keys [in] Array of count key strings
+ * @param keyLens [in] Array of count key lengths (1 to 56)
+ * @param count [in] Number of keys, at most BLOWFISH_BATCH_MAX
+ */
+void Blowfish_InitBatch(BLOWFISH_CTX *ctx, unsigned char **keys, int *keyLens, int count) {
+	uint32_t L[BLOWFISH_BATCH_MAX], R[BLOWFISH_BATCH_MAX];
+	uint32_t data, temp;
+	int c, i, j, k, r;
+
+	for (c = 0; c < count; ++c)
+	{
+		memcpy(ctx[c].S, ORIG_S, sizeof(ORIG_S));
+		j = 0;
+		for (i = 0; i < N + 2; ++i)
+		{
+			data = 0x00000000;
+			for (k = 0; k < 4; ++k)
+			{
+				data = (data << 8) | keys[c][j];
+				j = (j + 1 < keyLens[c]) ? j + 1 : 0;
+			}
+			ctx[c].P[i] = ORIG_P[i] ^ data;
+		}
+		L[c] = 0;
+		R[c] = 0;
+	}
+
+	// P-array then S-boxes, 2 words per encryption, on all the contexts at once
+	for (i = 0; i < (N + 2) + 4 * 256; i += 2)
+	{
+		for (r = 0; r < N; ++r)
+		{
+			for (c = 0; c < count; ++c)
+			{
+				L[c] ^= ctx[c].P[r];
+				R[c] ^= F(&ctx[c], L[c]);
+				temp = L[c];
+				L[c] = R[c];
+				R[c] = temp;
+			}
+		}
+		for (c = 0; c < count; ++c)
+		{
+			temp = L[c];
+			L[c] = R[c] ^ ctx[c].P[N + 1];
+			R[c] = temp ^ ctx[c].P[N];
+
+			uint32_t *target = (i < N + 2) ? &ctx[c].P[i] : &ctx[c].S[(i - (N + 2)) / 256][(i - (N + 2)) % 256];
+			target[0] = L[c];
+			target[1] = R[c];
+		}
+	}
+
+	// Clean temp data for security reasons
+	memset(L, 0, sizeof(L));
+	memset(R, 0, sizeof(R));
+	data = 0;
+	temp = 0;
+}
+
+
+/**
+ * @brief Constant-time context initialization
+ * 
+ * Same context of Blowfish_Init(), the 521 encryptions of the key schedule index the (key-dependent) S-boxes as well, so they are done with the constant-time engine too.
+ * 
+ * @param ctx [out] Pointer to context to be initialized
+ * @param key [in] Key string
+ * @param keyLen [in] Key string length
+ */
+void Blowfish_InitCT(BLOWFISH_CTX *ctx, unsigned char *key, int keyLen) {
+	key_schedule(ctx, key, keyLen, Blowfish_EncryptCT);
+}
+
+
 /**
  * @brief Blowfish encription
  * 
@@ -614,3 +811,42 @@ uint64_t BlowfishDecryption(BLOWFISH_CTX *ctx, uint64_t x)
 }
 
 
+/**
+ * @brief Constant-time Blowfish encription
+ * 
+ * @param ctx [in] Current context
+ * @param x [in] 64 bits block to be encrypted
+ * @return 64 bits encrypted block
+ * @see BlowfishEncryption()
+ */
+uint64_t BlowfishEncryptionCT(BLOWFISH_CTX *ctx, uint64_t x)
+{
+	uint32_t L = (x>>32);
+	uint32_t R = (uint32_t)(x & 0xFFFFFFFF);
+	
+	Blowfish_EncryptCT(ctx, &L, &R);
+	
+	return ((uint64_t)L<<32) | R;
+}
+
+
+/**
+ * @brief Constant-time Blowfish decription
+ * 
+ * @param ctx [in] Current context
+ * @param x [in] 64 bits block to be decrypted
+ * @return 64 bits decrypted block
+ * @see BlowfishDecryption()
+ */
+uint64_t BlowfishDecryptionCT(BLOWFISH_CTX *ctx, uint64_t x)
+{
+	uint32_t L = (x>>32);
+	uint32_t R = (uint32_t)(x & 0xFFFFFFFF);
+	
+	Blowfish_DecryptCT(ctx, &L, &R);
+	
+	return ((uint64_t)L<<32) | R;
+}
+
+
+
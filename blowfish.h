@@ -23,6 +23,25 @@ typedef struct {
 } BLOWFISH_CTX;
 
 
+/**
+ * Implementation of the S-box lookups in the F function
+ */
+typedef enum {
+  BLOWFISH_ENGINE_TABLE,			//! Direct S-box indexing with the data (fast, susceptible to cache-timing attacks).
+  BLOWFISH_ENGINE_CONSTANT_TIME		//! Full S-box scans with masking, memory access pattern independent of the data.
+} BLOWFISH_ENGINE;
+
+
+#ifdef BLOWFISH_CONSTANT_TIME
+#define BLOWFISH_ENGINE_DEFAULT BLOWFISH_ENGINE_CONSTANT_TIME
+#else
+#define BLOWFISH_ENGINE_DEFAULT BLOWFISH_ENGINE_TABLE
+#endif
+
+
+#define BLOWFISH_BATCH_MAX 8	//! Maximum number of keys expanded together by Blowfish_InitBatch().
+
+
 void Blowfish_Init(BLOWFISH_CTX *ctx, unsigned char *key, int keyLen);
 
 void Blowfish_Encrypt(BLOWFISH_CTX *ctx, uint32_t *xl, uint32_t *xr);
@@ -31,6 +50,16 @@ void Blowfish_Decrypt(BLOWFISH_CTX *ctx, uint32_t *xl, uint32_t *xr);
 uint64_t BlowfishEncryption(BLOWFISH_CTX *ctx, uint64_t x);
 uint64_t BlowfishDecryption(BLOWFISH_CTX *ctx, uint64_t x);
 
+void Blowfish_InitCT(BLOWFISH_CTX *ctx, unsigned char *key, int keyLen);
+
+void Blowfish_EncryptCT(BLOWFISH_CTX *ctx, uint32_t *xl, uint32_t *xr);
+void Blowfish_DecryptCT(BLOWFISH_CTX *ctx, uint32_t *xl, uint32_t *xr);
+
+uint64_t BlowfishEncryptionCT(BLOWFISH_CTX *ctx, uint64_t x);
+uint64_t BlowfishDecryptionCT(BLOWFISH_CTX *ctx, uint64_t x);
+
+void Blowfish_InitBatch(BLOWFISH_CTX *ctx, unsigned char **keys, int *keyLens, int count);
+
 
 #endif
 
@@ -0,0 +1,188 @@
+/*
+buffer.c:  Parallel (en|de)cryption of memory buffers, for data that never touches the filesystem (network buffers, database pages).
+
+The output is the same of blowfish-multithread e on a file with the same content, and the decryption applies the same padding rules: encryption always adds 1 to 8 padding bytes, decryption checks them on the last block before anything else is processed, so a wrong key is refused with out untouched.
+A buffer below the inline threshold is processed by the calling thread with the batched kernel. A larger one is split in pieces, one per pool worker plus one run by the calling thread, that waits for the others before returning: the call is synchronous, the pool can be shared with async.c and cryptfile.c.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "buffer.h"
+#include "kernel.h"
+
+
+/**
+ * Buffer being processed by the pool
+ */
+typedef struct {
+	BLOWFISH_KERNEL kernel;			//! ECB kernel of the engine and direction.
+	const BLOWFISH_CTX *ctx;		//! Context of the key.
+	const unsigned char *in;		//! Input blocks.
+	unsigned char *out;				//! Output blocks.
+	int pending;					//! Pieces not yet done.
+	pthread_mutex_t mutex;			//! Protects pending.
+	pthread_cond_t done;			//! Signaled when the last piece is done.
+} BUFFER_JOB;
+
+
+/**
+ * Part of a buffer run by one pool task
+ */
+typedef struct {
+	POOL_TASK task;					//! First member, so the task is the piece.
+	BUFFER_JOB *job;				//! Buffer the piece belongs to.
+	long first;						//! First block of the piece.
+	long blocks;					//! Number of blocks of the piece.
+} BUFFER_PIECE;
+
+
+/**
+ * @brief Pool task: run a piece, the last piece done wakes up the caller
+ */
+static void run_piece(POOL_TASK *task)
+{
+	BUFFER_PIECE *piece = (BUFFER_PIECE *)task;
+	BUFFER_JOB *job = piece->job;
+
+	job->kernel(job->ctx, job->in + piece->first * 8, job->out + piece->first * 8, piece->blocks, NULL);
+
+	pthread_mutex_lock(&job->mutex);
+		if(--job->pending == 0)
+		{
+			pthread_cond_signal(&job->done);
+		}
+	pthread_mutex_unlock(&job->mutex);
+}
+
+
+/**
+ * @brief Process whole blocks, inline or on the pool
+ */
+static void crypt_blocks(BLOWFISH_KERNEL kernel, const BLOWFISH_CTX *ctx, const unsigned char *in, unsigned char *out, long blocks, POOL *pool, long inline_threshold)
+{
+	BUFFER_PIECE pieces[BUFFER_MAX_PIECES];
+	BUFFER_JOB job;
+	long piece_count = 0;
+	long i = 0;
+
+	if(pool != NULL)
+	{
+		// One piece per worker and one for the caller, but no piece below the threshold
+		piece_count = (blocks * 8) / inline_threshold;
+		if(piece_count > pool->thread_count + 1)
+		{
+			piece_count = pool->thread_count + 1;
+		}
+		if(piece_count > BUFFER_MAX_PIECES)
+		{
+			piece_count = BUFFER_MAX_PIECES;
+		}
+	}
+	if(piece_count < 2)
+	{
+		kernel(ctx, in, out, blocks, NULL);
+		return;
+	}
+
+	job.kernel = kernel;
+	job.ctx = ctx;
+	job.in = in;
+	job.out = out;
+	job.pending = piece_count;
+	pthread_mutex_init(&job.mutex, NULL);
+	pthread_cond_init(&job.done, NULL);
+
+	for(i = 0; i < piece_count; ++i)
+	{
+		pieces[i].task.run = run_piece;
+		pieces[i].job = &job;
+		pieces[i].first = blocks * i / piece_count;
+		pieces[i].blocks = blocks * (i + 1) / piece_count - pieces[i].first;
+		if(i > 0)
+		{
+			pool_submit(pool, &pieces[i].task);
+		}
+	}
+	run_piece(&pieces[0].task);	// The caller works too instead of just waiting
+
+	pthread_mutex_lock(&job.mutex);
+		while(job.pending > 0)
+		{
+			pthread_cond_wait(&job.done, &job.mutex);
+		}
+	pthread_mutex_unlock(&job.mutex);
+
+	pthread_cond_destroy(&job.done);
+	pthread_mutex_destroy(&job.mutex);
+}
+
+
+/**
+ * @brief (En|de)crypt a memory buffer
+ *
+ * @param ctx [in] Context of the key, initialized for the engine
+ * @param engine [in] S-box lookup implementation
+ * @param direction [in] 'e' encrypt, 'd' decrypt
+ * @param in [in] Input: any length when encrypting, a multiple of 8 (at least 8) when decrypting
+ * @param out [out] Output, may be the same buffer of in: BUFFER_PADDED_LENGTH(length) bytes when encrypting, length bytes when decrypting
+ * @param length [in] Bytes of in
+ * @param pool [in] Pool running the pieces of a large buffer, NULL to process everything inline
+ * @param inline_threshold [in] Buffers below it (bytes) are processed by the calling thread, BUFFER_INLINE_THRESHOLD_DEFAULT if not measured, at least 1
+ * @return Output length, -1 if the length or the padding is wrong (wrong key or corrupted data), or with EINVAL for a threshold below 1
+ */
+long buffer_crypt(const BLOWFISH_CTX *ctx, BLOWFISH_ENGINE engine, char direction, const unsigned char *in, unsigned char *out, long length, POOL *pool, long inline_threshold)
+{
+	BLOWFISH_KERNEL kernel = Blowfish_SelectKernel(engine, direction, BLOWFISH_ECB, KERNEL_WIDTH_DEFAULT);
+	unsigned char last_block[8];	//! Padded last block.
+	long aligned = length - length%8;
+	int padding_size = 0;
+	int i = 0;
+
+	if(inline_threshold < 1)
+	{
+		errno = EINVAL;	// It also sizes the pieces of a large buffer
+		return -1;
+	}
+
+	if(direction == 'e')
+	{
+		padding_size = 8 - length%8;	// 1 to 8, a whole block of 8s if length is already a multiple of 8
+		memcpy(last_block, in + aligned, 8 - padding_size);	// Before out is written, in may be the same buffer
+		memset(last_block + (8 - padding_size), padding_size, padding_size);
+
+		crypt_blocks(kernel, ctx, in, out, aligned / 8, pool, inline_threshold);
+		kernel(ctx, last_block, out + aligned, 1, NULL);
+
+		memset(last_block, 0, sizeof(last_block));	// For security reasons overwrite memory before exiting
+		return aligned + 8;
+	}
+
+	if((length < 8) || (aligned != length))
+	{
+		return -1;
+	}
+
+	// Decrypt and check the last block first, as main.c does: nothing is written with a wrong key
+	kernel(ctx, in + length - 8, last_block, 1, NULL);
+	padding_size = last_block[7];
+	for(i = 8 - padding_size; (padding_size >= 1) && (padding_size <= 8) && (i < 8); ++i)
+	{
+		if(last_block[i] != padding_size)
+		{
+			padding_size = 0;
+		}
+	}
+	if((padding_size < 1) || (padding_size > 8))
+	{
+		memset(last_block, 0, sizeof(last_block));
+		return -1;
+	}
+
+	crypt_blocks(kernel, ctx, in, out, length / 8 - 1, pool, inline_threshold);
+	memcpy(out + length - 8, last_block, 8 - padding_size);
+
+	memset(last_block, 0, sizeof(last_block));	// For security reasons overwrite memory before exiting
+	return length - padding_size;
+}
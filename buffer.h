@@ -0,0 +1,24 @@
+/*
+buffer.h:  Header file for buffer.c
+
+(En|de)cryption of memory buffers in the format of blowfish-multithread e/d
+(ECB, padding always present): small buffers are processed inline by the
+batched kernel, large ones split across the worker pool.
+*/
+
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include "blowfish.h"
+#include "pool.h"
+
+
+#define BUFFER_INLINE_THRESHOLD_DEFAULT (64L << 10)	//! Buffers below it (bytes) are processed inline, see the buffer cases of blowfish-benchmark.
+#define BUFFER_MAX_PIECES 64						//! Maximum number of pieces a buffer is split into.
+#define BUFFER_PADDED_LENGTH(length) ((length) - (length)%8 + 8)	//! Encrypted length of length bytes, the room out must have when encrypting.
+
+
+long buffer_crypt(const BLOWFISH_CTX *ctx, BLOWFISH_ENGINE engine, char direction, const unsigned char *in, unsigned char *out, long length, POOL *pool, long inline_threshold);
+
+
+#endif
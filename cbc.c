@@ -0,0 +1,165 @@
+/*
+cbc.c:  CBC encryption of many independent streams.
+
+CBC encryption is serial inside a stream (every block needs the previous ciphertext), so a single stream cannot use the interleaved kernels nor be split among threads.
+Different streams are independent though: every thread keeps width streams in flight in the lanes of a lane kernel (one block of each per step, as the ECB kernels do with consecutive blocks), and whenever a stream ends its lane is refilled with the next stream not yet taken by any thread.
+With at least width streams per thread every core is kept as busy as on the ECB path.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "cbc.h"
+#include "kernel.h"
+
+
+/**
+ * Shared state of a multi-stream job
+ */
+typedef struct {
+	BLOWFISH_STREAM *streams;		//! Streams to be encrypted.
+	int count;						//! Number of streams.
+	int next;						//! First stream not yet taken by a thread (atomic).
+	int width;						//! Streams interleaved per thread.
+	BLOWFISH_LANE_KERNEL lanes[4];	//! Lane kernels of width 1, 2, 4, 8.
+} CBC_JOB;
+
+
+/**
+ * @brief Take the next stream with data, NULL when none is left
+ */
+static BLOWFISH_STREAM *take_stream(CBC_JOB *job)
+{
+	int i;
+
+	while((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+	{
+		if(job->streams[i].blocks > 0)
+		{
+			return &job->streams[i];
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * @brief Stream thread function
+ * Keeps up to width streams in its lanes and runs the widest lane kernel over the first active lanes for as many blocks as the shortest of them has left.
+ * Lanes hold their own copies of the pointers, so the streams are only written back (iv) when they end.
+ */
+static void *stream_thread(void *args)
+{
+	CBC_JOB *job = (CBC_JOB *)args;
+	BLOWFISH_STREAM *stream[KERNEL_WIDTH_MAX];
+	const BLOWFISH_CTX *ctx[KERNEL_WIDTH_MAX];
+	const unsigned char *in[KERNEL_WIDTH_MAX];
+	unsigned char *out[KERNEL_WIDTH_MAX];
+	uint64_t chain[KERNEL_WIDTH_MAX];
+	long left[KERNEL_WIDTH_MAX];
+	int active = 0;
+	int w;
+
+	for(;;)
+	{
+		// Refill the free lanes
+		while(active < job->width && (stream[active] = take_stream(job)) != NULL)
+		{
+			ctx[active] = stream[active]->ctx;
+			in[active] = stream[active]->in;
+			out[active] = stream[active]->out;
+			chain[active] = stream[active]->iv;
+			left[active] = stream[active]->blocks;
+			active++;
+		}
+		if(active == 0)
+		{
+			break;
+		}
+
+		int width = (active >= 8) ? 8 : (active >= 4) ? 4 : (active >= 2) ? 2 : 1;	//! Lanes run by this step (the others wait at the tail of the job).
+		long blocks = left[0];
+		for(w = 1; w < width; ++w)
+		{
+			if(left[w] < blocks)
+			{
+				blocks = left[w];
+			}
+		}
+
+		job->lanes[(width >= 8) ? 3 : (width >= 4) ? 2 : (width >= 2) ? 1 : 0](ctx, in, out, chain, blocks);
+
+		for(w = width - 1; w >= 0; --w)
+		{
+			in[w] += 8*blocks;
+			out[w] += 8*blocks;
+			left[w] -= blocks;
+			if(left[w] == 0)
+			{
+				// Stream done: save its chaining value and move the last active lane in its place
+				stream[w]->iv = chain[w];
+				active--;
+				stream[w] = stream[active];
+				ctx[w] = ctx[active];
+				in[w] = in[active];
+				out[w] = out[active];
+				chain[w] = chain[active];
+				left[w] = left[active];
+			}
+		}
+	}
+
+	return NULL;
+}
+
+
+/**
+ * @brief CBC encryption of independent streams
+ *
+ * @param engine [in] S-box lookup implementation
+ * @param streams [in,out] Streams, their iv is updated to the last ciphertext block
+ * @param count [in] Number of streams
+ * @param width [in] Streams interleaved per thread, rounded down to 1, 2, 4 or 8
+ * @param max_threads [in] Thread number to be used (no more than the streams are needed)
+ */
+void cbc_encrypt_streams(BLOWFISH_ENGINE engine, BLOWFISH_STREAM *streams, int count, int width, int max_threads)
+{
+	CBC_JOB job;
+	pthread_t *thread_pool = NULL;
+	int threads, i;
+
+	job.streams = streams;
+	job.count = count;
+	job.next = 0;
+	job.width = (width >= 8) ? 8 : (width >= 4) ? 4 : (width >= 2) ? 2 : 1;
+	for(i = 0; i < 4; ++i)
+	{
+		job.lanes[i] = Blowfish_SelectLaneKernel(engine, 1 << i);
+	}
+
+	threads = (count + job.width - 1) / job.width;
+	if(threads > max_threads)
+	{
+		threads = max_threads;
+	}
+	if(threads > 1)
+	{
+		thread_pool = (pthread_t *) malloc((threads - 1) * sizeof(pthread_t));
+	}
+
+	// The calling thread works too, streams are handed out dynamically so the job completes even if fewer threads could be started
+	for(i = 0; (thread_pool != NULL) && (i < threads - 1); ++i)
+	{
+		if(pthread_create(&thread_pool[i], NULL, stream_thread, &job) != 0)
+		{
+			break;
+		}
+	}
+	stream_thread(&job);
+	while(i-- > 0)
+	{
+		pthread_join(thread_pool[i], NULL);
+	}
+
+	free(thread_pool);
+}
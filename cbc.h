@@ -0,0 +1,27 @@
+/*
+cbc.h:  Header file for cbc.c
+*/
+
+#ifndef CBC_H
+#define CBC_H
+
+#include <stdint.h>
+#include "blowfish.h"
+
+
+/**
+ * Independent CBC stream (one file or tenant)
+ */
+typedef struct {
+  const BLOWFISH_CTX *ctx;		//! Key of the stream.
+  const unsigned char *in;		//! Plaintext.
+  unsigned char *out;			//! Ciphertext, may be the same buffer as in.
+  long blocks;					//! Length in 8 bytes blocks.
+  uint64_t iv;					//! Chaining value, updated to the last ciphertext block so that the stream can be continued.
+} BLOWFISH_STREAM;
+
+
+void cbc_encrypt_streams(BLOWFISH_ENGINE engine, BLOWFISH_STREAM *streams, int count, int width, int max_threads);
+
+
+#endif
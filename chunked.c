@@ -0,0 +1,662 @@
+/*
+chunked.c:  Incremental encryption on a chunked layout.
+
+The plaintext is split in chunks of chunk_size bytes, every chunk is encrypted in counter mode (CTR) starting from its own counter, derived from the per-file nonce, the chunk index and the run (generation) in which the chunk was last written.
+The counter is structured, nonce + (generation<<40 | index<<17 | block): within a file two chunk writes never share a counter, up to CHUNK_GENERATION_MAX generations, CHUNK_COUNT_MAX chunks and CHUNK_SIZE_MAX bytes per chunk.
+Across files the random nonces only shift these ranges, so as for any 64 bits block cipher in CTR the keystreams of two files collide with probability about blocks_a*blocks_b/2^64: keep the data under one key well below 2^32 blocks (32 GB).
+Chunks are therefore independent: on every run the plaintext of each chunk is digested and compared with the manifest of the previous run, and only the chunks whose digest changed are encrypted and written again, with a new generation so that no counter is ever reused.
+The ciphertext has the same length of the plaintext (CTR does not need padding), nonce, generations and digests are stored in the manifest beside it.
+
+Chunks are rewritten in place, so the manifest is the journal of the rewrite: the new generations are recorded first, together with the previous ones, in a manifest marked pending,
+then the chunks are written and made durable, and finally the manifest is stored again without the pending mark. After a crash every chunk holds either version,
+and chunk_open() tells which from the digests (a torn chunk matches neither and is reported): a ciphertext is never decrypted to garbage silently.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include "chunked.h"
+#include "kernel.h"
+#include "debug.h"
+
+
+static const char manifest_magic[8] = {'B','F','C','H','U','N','K','2'};	//! Manifest file signature (version 1 derived overlapping counters, its files are refused).
+
+
+/**
+ * Shared state of a chunked run, read-only for the threads apart from the new manifest entries (each thread writes only its own chunks) and the rewritten counter.
+ */
+static struct {
+	BLOWFISH_CTX *ctx;					//! Blowfish context.
+	BLOWFISH_ENGINE engine;				//! S-box lookup implementation.
+	int encrypt;						//! 1 to encrypt only the changed chunks, 0 to decrypt all of them.
+	int max_threads;					//! Thread number to be used.
+	int input_fd;						//! Input file descriptor.
+	int output_fd;						//! Output file descriptor.
+	const CHUNK_MANIFEST *previous;		//! Manifest of the previous run (encryption only, zero chunks if none).
+	CHUNK_MANIFEST *current;			//! Manifest of this run.
+	int writing;						//! Encryption: 0 while the changed chunks are being found, 1 while they are written.
+	long rewritten;						//! Number of chunks written out.
+	long recovered;						//! Decryption: chunks found in their previous generation (interrupted update).
+} job;
+
+
+/**
+ * @brief Block encryption of the selected engine
+ */
+static uint64_t encrypt_block(BLOWFISH_ENGINE engine, BLOWFISH_CTX *ctx, uint64_t x)
+{
+	return (engine == BLOWFISH_ENGINE_CONSTANT_TIME) ? BlowfishEncryptionCT(ctx, x) : BlowfishEncryption(ctx, x);
+}
+
+
+/**
+ * @brief Read exactly length bytes at offset, retrying on short reads
+ *
+ * @return 0 on success, -1 on error or premature end of file
+ */
+static int read_full(int fd, unsigned char *buffer, long length, long offset)
+{
+	while(length > 0)
+	{
+		ssize_t result = pread(fd, buffer, length, offset);
+		if(result <= 0)
+		{
+			return -1;
+		}
+		buffer += result;
+		offset += result;
+		length -= result;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Write exactly length bytes at offset, retrying on short writes
+ *
+ * @return 0 on success, -1 on error
+ */
+static int write_full(int fd, const unsigned char *buffer, long length, long offset)
+{
+	while(length > 0)
+	{
+		ssize_t result = pwrite(fd, buffer, length, offset);
+		if(result <= 0)
+		{
+			return -1;
+		}
+		buffer += result;
+		offset += result;
+		length -= result;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Keyed digest of a chunk plaintext
+ *
+ * FNV-1a over the chunk bytes and length, encrypted with the session key so that the manifest does not reveal whether two files share a chunk.
+ *
+ * @param ctx [in] Current context
+ * @param engine [in] S-box lookup implementation
+ * @param data [in] Chunk plaintext
+ * @param length [in] Chunk length in bytes
+ * @return 64 bits digest
+ */
+uint64_t chunk_digest(BLOWFISH_CTX *ctx, BLOWFISH_ENGINE engine, const unsigned char *data, long length)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;	// FNV offset basis
+	long i = 0;
+
+	for(i = 0; i < length; ++i)
+	{
+		hash ^= data[i];
+		hash *= 0x100000001B3ULL;	// FNV prime
+	}
+	hash ^= (uint64_t)length;
+	hash *= 0x100000001B3ULL;
+
+	return encrypt_block(engine, ctx, hash);
+}
+
+
+/**
+ * @brief Initial counter of a chunk
+ *
+ * The chunk uses the counters from the returned one to the returned one + chunk_size/8 - 1, a range disjoint from the one of every other (generation, chunk) pair of the file.
+ *
+ * @param manifest [in] Manifest holding the nonce
+ * @param chunk_index [in] Chunk number, below CHUNK_COUNT_MAX
+ * @param generation [in] Generation in which the chunk was written, at most CHUNK_GENERATION_MAX
+ * @return Counter of the first Blowfish's block of the chunk
+ */
+uint64_t chunk_counter(const CHUNK_MANIFEST *manifest, uint64_t chunk_index, uint64_t generation)
+{
+	return manifest->nonce + ((generation << 40) | (chunk_index << 17));
+}
+
+
+/**
+ * @brief Counter mode encryption/decryption of a chunk (the two are the same operation)
+ *
+ * @param ctx [in] Current context
+ * @param engine [in] S-box lookup implementation
+ * @param counter [in] Counter of the first Blowfish's block
+ * @param data [in,out] Chunk data (overwritten), the length does not need to be a multiple of 8
+ * @param length [in] Data length in bytes
+ */
+void chunk_crypt(BLOWFISH_CTX *ctx, BLOWFISH_ENGINE engine, uint64_t counter, unsigned char *data, long length)
+{
+	BLOWFISH_KERNEL kernel = Blowfish_SelectKernel(engine, 'e', BLOWFISH_CTR, KERNEL_WIDTH_DEFAULT);
+	long aligned = length - (length%8);
+	unsigned char block[8] = {0};
+
+	kernel(ctx, data, data, aligned/8, &counter);
+
+	if(aligned < length)
+	{
+		// Last partial block: only the needed keystream bytes are used, no padding
+		memcpy(block, data+aligned, length-aligned);
+		kernel(ctx, block, block, 1, &counter);
+		memcpy(data+aligned, block, length-aligned);
+	}
+
+	memset(block, 0, sizeof(block));
+}
+
+
+/**
+ * @brief Decrypt a chunk and check it against the manifest
+ *
+ * If the manifest is pending and the chunk does not match its new generation, the previous one is tried: the update was interrupted before the chunk was rewritten.
+ *
+ * @param ctx [in] Current context
+ * @param engine [in] S-box lookup implementation
+ * @param manifest [in] Manifest of the ciphertext
+ * @param chunk_index [in] Chunk number
+ * @param data [in,out] Chunk ciphertext, overwritten with the plaintext
+ * @param length [in] Chunk length in bytes
+ * @return 0 if the chunk holds its generation, 1 if it holds the previous one (data is then its plaintext), -1 if it matches neither (corrupted or torn, data is garbage)
+ */
+int chunk_open(BLOWFISH_CTX *ctx, BLOWFISH_ENGINE engine, const CHUNK_MANIFEST *manifest, uint64_t chunk_index, unsigned char *data, long length)
+{
+	const CHUNK_ENTRY *entry = &manifest->chunks[chunk_index];
+
+	chunk_crypt(ctx, engine, chunk_counter(manifest, chunk_index, entry->generation), data, length);
+	if(chunk_digest(ctx, engine, data, length) == entry->digest)
+	{
+		return 0;
+	}
+	if(!manifest->pending || (entry->previous_generation == 0))
+	{
+		return -1;
+	}
+
+	chunk_crypt(ctx, engine, chunk_counter(manifest, chunk_index, entry->generation), data, length);	// Back to the ciphertext (CTR)
+	chunk_crypt(ctx, engine, chunk_counter(manifest, chunk_index, entry->previous_generation), data, length);
+	return (chunk_digest(ctx, engine, data, length) == entry->previous_digest) ? 1 : -1;
+}
+
+
+/**
+ * @brief Load a manifest
+ *
+ * @param filename [in] Manifest file name
+ * @param manifest [out] Loaded manifest, to be released with manifest_free()
+ * @return 0 on success, -1 if the manifest is missing or malformed (manifest is then left empty)
+ */
+int manifest_load(const char *filename, CHUNK_MANIFEST *manifest)
+{
+	char magic[8];
+	uint64_t header[6];
+
+	memset(manifest, 0, sizeof(CHUNK_MANIFEST));
+
+	FILE *file = fopen(filename, "r");
+	if(file == NULL)
+	{
+		return -1;
+	}
+
+	if((fread(magic, sizeof(magic), 1, file) != 1) || (memcmp(magic, manifest_magic, sizeof(magic)) != 0) || (fread(header, sizeof(header), 1, file) != 1))
+	{
+		fclose(file);
+		return -1;
+	}
+
+	manifest->nonce = header[0];
+	manifest->generation = header[1];
+	manifest->file_length = header[2];
+	manifest->chunk_size = header[3];
+	manifest->chunk_count = header[4];
+	manifest->pending = header[5];
+
+	if((manifest->chunk_size == 0) || (manifest->chunk_size%8 != 0) || (manifest->chunk_size > CHUNK_SIZE_MAX) || (manifest->chunk_count > CHUNK_COUNT_MAX) || (manifest->generation > CHUNK_GENERATION_MAX) || (manifest->pending > 1) || (manifest->chunk_count != (manifest->file_length + manifest->chunk_size - 1) / manifest->chunk_size))
+	{
+		fclose(file);
+		memset(manifest, 0, sizeof(CHUNK_MANIFEST));
+		return -1;
+	}
+
+	manifest->chunks = (CHUNK_ENTRY *) calloc(manifest->chunk_count + 1, sizeof(CHUNK_ENTRY));
+	if(manifest->chunks == NULL)
+	{
+		perror("Failed to allocate manifest, exiting");
+		exit(EXIT_FAILURE);
+	}
+
+	if(fread(manifest->chunks, sizeof(CHUNK_ENTRY), manifest->chunk_count, file) != manifest->chunk_count)
+	{
+		fclose(file);
+		manifest_free(manifest);
+		return -1;
+	}
+
+	fclose(file);
+	return 0;
+}
+
+
+/**
+ * @brief Store a manifest
+ *
+ * The manifest is written beside the destination and then renamed over it, so that a crash never leaves a truncated manifest.
+ *
+ * @param filename [in] Manifest file name
+ * @param manifest [in] Manifest to be stored
+ * @return 0 on success, -1 on error
+ */
+int manifest_store(const char *filename, const CHUNK_MANIFEST *manifest)
+{
+	uint64_t header[6] = {manifest->nonce, manifest->generation, manifest->file_length, manifest->chunk_size, manifest->chunk_count, manifest->pending};
+	char *temp_filename = (char *) malloc(strlen(filename) + 5);
+	if(temp_filename == NULL)
+	{
+		return -1;
+	}
+	sprintf(temp_filename, "%s.tmp", filename);
+
+	FILE *file = fopen(temp_filename, "w");
+	if(file == NULL)
+	{
+		free(temp_filename);
+		return -1;
+	}
+
+	fwrite(manifest_magic, sizeof(manifest_magic), 1, file);
+	fwrite(header, sizeof(header), 1, file);
+	fwrite(manifest->chunks, sizeof(CHUNK_ENTRY), manifest->chunk_count, file);
+	fflush(file);
+
+	if(ferror(file) || (fsync(fileno(file)) != 0))
+	{
+		fclose(file);
+		unlink(temp_filename);
+		free(temp_filename);
+		return -1;
+	}
+	fclose(file);
+
+	int result = rename(temp_filename, filename);
+	free(temp_filename);
+	return result;
+}
+
+
+/**
+ * @brief Release the memory held by a manifest
+ */
+void manifest_free(CHUNK_MANIFEST *manifest)
+{
+	if(manifest->chunks != NULL)
+	{
+		manifest->chunks = (CHUNK_ENTRY *) memset(manifest->chunks, 0, manifest->chunk_count * sizeof(CHUNK_ENTRY));
+		free(manifest->chunks);
+	}
+	memset(manifest, 0, sizeof(CHUNK_MANIFEST));
+}
+
+
+/**
+ * @brief Chunk thread function
+ * Thread n works on chunks n, n+max_threads, n+2*max_threads... Each chunk is read and:
+ * on encryption, first digested and compared with the previous manifest (the new entry records the previous generation of a changed chunk), then once the pending manifest is stored encrypted and written out at the same position if changed;
+ * on decryption, decrypted, checked against the manifest and written out.
+ *
+ * @param args Thread number.
+ */
+static void *chunk_thread(void *args)
+{
+	int thread_number = *((int *)args);	//! First chunk on which the thread will work.
+	CHUNK_MANIFEST *current = job.current;
+	const CHUNK_MANIFEST *previous = job.previous;
+	uint64_t i = 0;
+
+	unsigned char *buffer = (unsigned char *) malloc(current->chunk_size);	//! Buffer to temporary store the chunk.
+	if(buffer == NULL)
+	{
+		perror("Failed to allocate buffer, exiting");
+		exit(EXIT_FAILURE);
+	}
+
+	for(i = thread_number; i < current->chunk_count; i += job.max_threads)
+	{
+		long offset = i * current->chunk_size;
+		long length = current->file_length - offset;
+		if(length > (long)current->chunk_size)
+		{
+			length = current->chunk_size;
+		}
+
+		if(read_full(job.input_fd, buffer, length, offset) != 0)
+		{
+			if(job.encrypt || !current->pending)
+			{
+				perror("Reading error\n");
+				exit(EXIT_FAILURE);
+			}
+			memset(buffer, 0, length);	// Interrupted update, the file was not grown yet: the chunk was never written and chunk_open() reports it
+		}
+
+		if(job.encrypt && !job.writing)
+		{
+			uint64_t digest = chunk_digest(job.ctx, job.engine, buffer, length);
+			if((i < previous->chunk_count) && (previous->chunks[i].digest == digest) && (previous->chunks[i].generation != 0))
+			{
+				current->chunks[i].generation = previous->chunks[i].generation;	// Unchanged: the ciphertext already on disk is still valid
+				current->chunks[i].digest = digest;
+				continue;
+			}
+			current->chunks[i].digest = digest;
+			current->chunks[i].generation = current->generation;
+			if((i < previous->chunk_count) && (previous->chunks[i].generation != 0) && !previous->pending)
+			{
+				current->chunks[i].previous_generation = previous->chunks[i].generation;	// On disk until this chunk is rewritten
+				current->chunks[i].previous_digest = previous->chunks[i].digest;
+			}
+			continue;
+		}
+		if(job.encrypt)
+		{
+			if(current->chunks[i].generation != current->generation)
+			{
+				continue;
+			}
+			if(chunk_digest(job.ctx, job.engine, buffer, length) != current->chunks[i].digest)
+			{
+				perror("The input changed during the encryption\n");
+				exit(EXIT_FAILURE);
+			}
+			chunk_crypt(job.ctx, job.engine, chunk_counter(current, i, current->generation), buffer, length);
+		}
+		else
+		{
+			int result = chunk_open(job.ctx, job.engine, current, i, buffer, length);
+			if(result < 0)
+			{
+				fprintf(stderr, "Chunk %llu does not match its manifest: the ciphertext is corrupted\n", (unsigned long long)i);
+				exit(EXIT_FAILURE);
+			}
+			if(result > 0)
+			{
+				__sync_fetch_and_add(&job.recovered, 1);
+			}
+		}
+
+		if(write_full(job.output_fd, buffer, length, offset) != 0)
+		{
+			perror("Writing error\n");
+			exit(EXIT_FAILURE);
+		}
+		__sync_fetch_and_add(&job.rewritten, 1);
+	}
+
+	buffer = (unsigned char *) memset(buffer, 0, current->chunk_size);	// For security reasons overwrite memory before exiting
+	free(buffer);
+	pthread_exit(NULL);
+}
+
+
+/**
+ * @brief Spawn the chunk threads and wait for them
+ */
+static void run_chunk_threads(void)
+{
+	pthread_t *thread_pool = (pthread_t *) malloc(job.max_threads * sizeof(pthread_t));
+	int *thread_args = (int *) malloc(job.max_threads * sizeof(int));
+	int i = 0;
+
+	if((thread_pool == NULL) || (thread_args == NULL))
+	{
+		perror("Failed to allocate threads, exiting");
+		exit(EXIT_FAILURE);
+	}
+
+	for(i = 0; i < job.max_threads; ++i)
+	{
+		thread_args[i] = i;
+		if(pthread_create(&thread_pool[i], NULL, chunk_thread, (void *)(&thread_args[i])) != 0)
+		{
+			perror("Thread creation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for(i = 0; i < job.max_threads; ++i)
+	{
+		pthread_join(thread_pool[i], NULL);
+	}
+
+	free(thread_pool);
+	free(thread_args);
+}
+
+
+/**
+ * @brief Build the name of the manifest of a ciphertext
+ */
+static char *manifest_filename(const char *filename)
+{
+	char *result = (char *) malloc(strlen(filename) + sizeof(MANIFEST_SUFFIX));
+	if(result == NULL)
+	{
+		perror("Failed to allocate manifest name, exiting");
+		exit(EXIT_FAILURE);
+	}
+	sprintf(result, "%s%s", filename, MANIFEST_SUFFIX);
+	return result;
+}
+
+
+/**
+ * @brief Incremental encryption
+ *
+ * Compare the input with the manifest of the previous run (<output_filename>.manifest) and rewrite only the ciphertext chunks whose plaintext changed.
+ * If there is no valid manifest, or the ciphertext does not match it, or the previous update was interrupted, the whole file is encrypted under a fresh nonce.
+ * The new manifest is stored as pending before the first chunk is overwritten, see chunk_open().
+ *
+ * @param ctx [in] Current context
+ * @param engine [in] S-box lookup implementation
+ * @param input_filename [in] Plaintext file name
+ * @param output_filename [in] Ciphertext file name, updated in place
+ * @param max_threads [in] Thread number to be used
+ * @return Number of chunks written out
+ */
+long chunked_encrypt(BLOWFISH_CTX *ctx, BLOWFISH_ENGINE engine, const char *input_filename, const char *output_filename, int max_threads)
+{
+	CHUNK_MANIFEST previous, current;
+	struct stat input_stat, output_stat;
+	char *manifest_name = manifest_filename(output_filename);
+	uint64_t i = 0;
+
+	job.input_fd = open(input_filename, O_RDONLY);
+	if((job.input_fd < 0) || (fstat(job.input_fd, &input_stat) != 0))
+	{
+		perror("Problem opening the input file\n");
+		exit(EXIT_FAILURE);
+	}
+
+	job.output_fd = open(output_filename, O_RDWR | O_CREAT, 0644);	// Do not truncate, unchanged chunks are kept
+	if((job.output_fd < 0) || (fstat(job.output_fd, &output_stat) != 0))
+	{
+		perror("Problem opening the output file\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if((manifest_load(manifest_name, &previous) != 0) || (previous.file_length != (uint64_t)output_stat.st_size) || previous.pending || (previous.generation == CHUNK_GENERATION_MAX))
+	{
+		// No usable previous run (or an interrupted one, whose chunks may hold either version), or no generation left: start over with a new nonce and rewrite everything
+		manifest_free(&previous);
+		if(getrandom(&previous.nonce, sizeof(previous.nonce), 0) != sizeof(previous.nonce))
+		{
+			perror("Failed to generate the nonce\n");
+			exit(EXIT_FAILURE);
+		}
+		previous.chunk_size = CHUNK_SIZE_DEFAULT;
+	}
+
+	memset(&current, 0, sizeof(CHUNK_MANIFEST));
+	current.nonce = previous.nonce;
+	current.generation = previous.generation + 1;
+	current.file_length = input_stat.st_size;
+	current.chunk_size = previous.chunk_size;
+	current.chunk_count = (current.file_length + current.chunk_size - 1) / current.chunk_size;
+	if(current.chunk_count > CHUNK_COUNT_MAX)
+	{
+		perror("Input too large for the chunked layout\n");
+		exit(EXIT_FAILURE);
+	}
+	current.chunks = (CHUNK_ENTRY *) calloc(current.chunk_count + 1, sizeof(CHUNK_ENTRY));
+	if(current.chunks == NULL)
+	{
+		perror("Failed to allocate manifest, exiting");
+		exit(EXIT_FAILURE);
+	}
+
+	job.ctx = ctx;
+	job.engine = engine;
+	job.encrypt = 1;
+	job.max_threads = max_threads;
+	job.previous = &previous;
+	job.current = &current;
+	job.rewritten = 0;
+
+	// Find the changed chunks
+	job.writing = 0;
+	run_chunk_threads();
+
+	// Journal: the new generations (and the previous ones) are durable before any chunk is overwritten
+	current.pending = 1;
+	if(manifest_store(manifest_name, &current) != 0)
+	{
+		perror("Problem writing the manifest\n");
+		exit(EXIT_FAILURE);
+	}
+	if(ftruncate(job.output_fd, current.file_length) != 0)
+	{
+		perror("Writing error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Rewrite them (the input is read again, from the page cache for small changes)
+	job.writing = 1;
+	run_chunk_threads();
+
+	// The data must be on disk before the manifest drops the previous generations
+	if(fsync(job.output_fd) != 0)
+	{
+		perror("Writing error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	current.pending = 0;
+	for(i = 0; i < current.chunk_count; ++i)
+	{
+		current.chunks[i].previous_generation = 0;
+		current.chunks[i].previous_digest = 0;
+	}
+	if(manifest_store(manifest_name, &current) != 0)
+	{
+		perror("Problem writing the manifest\n");
+		exit(EXIT_FAILURE);
+	}
+
+	close(job.input_fd);
+	close(job.output_fd);
+	manifest_free(&previous);
+	manifest_free(&current);
+	free(manifest_name);
+
+	return job.rewritten;
+}
+
+
+/**
+ * @brief Decryption of a chunked ciphertext
+ *
+ * Every chunk is checked against the digest in the manifest: the decryption fails on a corrupted chunk instead of writing garbage.
+ *
+ * @param ctx [in] Current context
+ * @param engine [in] S-box lookup implementation
+ * @param input_filename [in] Ciphertext file name, its manifest is <input_filename>.manifest
+ * @param output_filename [in] Plaintext file name
+ * @param max_threads [in] Thread number to be used
+ * @return Number of chunks written out
+ */
+long chunked_decrypt(BLOWFISH_CTX *ctx, BLOWFISH_ENGINE engine, const char *input_filename, const char *output_filename, int max_threads)
+{
+	CHUNK_MANIFEST current;
+	struct stat input_stat;
+	char *manifest_name = manifest_filename(input_filename);
+
+	job.input_fd = open(input_filename, O_RDONLY);
+	if((job.input_fd < 0) || (fstat(job.input_fd, &input_stat) != 0))
+	{
+		perror("Problem opening the input file\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if((manifest_load(manifest_name, &current) != 0) || ((current.file_length != (uint64_t)input_stat.st_size) && !current.pending))	// An interrupted update may not have resized the file
+	{
+		fprintf(stderr, "Missing or mismatching manifest %s\n", manifest_name);
+		exit(EXIT_FAILURE);
+	}
+
+	job.output_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(job.output_fd < 0)
+	{
+		perror("Problem creating the output file\n");
+		exit(EXIT_FAILURE);
+	}
+
+	job.ctx = ctx;
+	job.engine = engine;
+	job.encrypt = 0;
+	job.max_threads = max_threads;
+	job.previous = NULL;
+	job.current = &current;
+	job.rewritten = 0;
+	job.recovered = 0;
+
+	run_chunk_threads();
+
+	if(job.recovered > 0)
+	{
+		fprintf(stderr, "Warning: the last update of %s was interrupted, %ld chunks are in their previous version\n", input_filename, job.recovered);
+	}
+
+	close(job.input_fd);
+	close(job.output_fd);
+	manifest_free(&current);
+	free(manifest_name);
+
+	return job.rewritten;
+}
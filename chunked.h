@@ -0,0 +1,63 @@
+/*
+chunked.h:  Header file for chunked.c
+
+Incremental encryption on a chunked layout: the file is split in fixed-size
+chunks, each one encrypted in counter mode with its own counter, so that a
+chunk can be rewritten without touching the others.
+*/
+
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include <stdint.h>
+#include "blowfish.h"
+
+
+#define CHUNK_SIZE_DEFAULT (1L << 20)	//! Default chunk size in bytes (1 MiB), always a multiple of 8.
+#define CHUNK_SIZE_MAX (1L << 20)		//! Largest chunk: 2^17 blocks, the low 17 bits of the counter.
+#define CHUNK_COUNT_MAX (1ULL << 23)	//! Most chunks of a file (8 TiB with 1 MiB chunks), the next 23 bits of the counter.
+#define CHUNK_GENERATION_MAX ((1ULL << 24) - 1)	//! Last usable generation, the top 24 bits of the counter.
+#define MANIFEST_SUFFIX ".manifest"		//! The manifest is stored beside the ciphertext: <output_filename>.manifest
+
+
+/**
+ * Per-chunk manifest entry
+ */
+typedef struct {
+  uint64_t generation;			//! Run in which the chunk was last written, part of the chunk counter.
+  uint64_t digest;				//! Keyed digest of the chunk plaintext, checked on every decryption.
+  uint64_t previous_generation;	//! While the manifest is pending: generation the chunk had before being rewritten, 0 if none.
+  uint64_t previous_digest;		//! While the manifest is pending: digest the chunk had before being rewritten.
+} CHUNK_ENTRY;
+
+
+/**
+ * Manifest of a chunked ciphertext
+ *
+ * Holds what is needed to decrypt the ciphertext (nonce and per-chunk generation) and to detect which chunks changed since the last run (per-chunk digest).
+ */
+typedef struct {
+  uint64_t nonce;			//! Random per-file nonce, offset of all the chunk counters of the file.
+  uint64_t generation;		//! Number of the last run, incremented every time the file is updated.
+  uint64_t file_length;		//! Plaintext (and ciphertext) length in bytes.
+  uint64_t chunk_size;		//! Chunk size in bytes.
+  uint64_t chunk_count;		//! Number of chunks, the last one may be shorter than chunk_size.
+  uint64_t pending;			//! 1 while chunks are rewritten in place: each of them holds either its new or its previous generation.
+  CHUNK_ENTRY *chunks;		//! One entry per chunk.
+} CHUNK_MANIFEST;
+
+
+uint64_t chunk_digest(BLOWFISH_CTX *ctx, BLOWFISH_ENGINE engine, const unsigned char *data, long length);
+uint64_t chunk_counter(const CHUNK_MANIFEST *manifest, uint64_t chunk_index, uint64_t generation);
+void chunk_crypt(BLOWFISH_CTX *ctx, BLOWFISH_ENGINE engine, uint64_t counter, unsigned char *data, long length);
+int chunk_open(BLOWFISH_CTX *ctx, BLOWFISH_ENGINE engine, const CHUNK_MANIFEST *manifest, uint64_t chunk_index, unsigned char *data, long length);
+
+int manifest_load(const char *filename, CHUNK_MANIFEST *manifest);
+int manifest_store(const char *filename, const CHUNK_MANIFEST *manifest);
+void manifest_free(CHUNK_MANIFEST *manifest);
+
+long chunked_encrypt(BLOWFISH_CTX *ctx, BLOWFISH_ENGINE engine, const char *input_filename, const char *output_filename, int max_threads);
+long chunked_decrypt(BLOWFISH_CTX *ctx, BLOWFISH_ENGINE engine, const char *input_filename, const char *output_filename, int max_threads);
+
+
+#endif
@@ -0,0 +1,206 @@
+/*
+client.c:  Client library of blowfish-daemon.
+
+Typical use:
+   [1] client_connect() creates the shared ring and hands it to the daemon.
+   [2] Write the payload in client_slot(client, n) and call client_submit() for that slot.
+   [3] client_wait() returns the completions (in completion order, not submission order), the slot then holds the result and can be reused.
+*/
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "client.h"
+
+
+/**
+ * @brief Read or write exactly length bytes on the socket
+ *
+ * @return 0 on success, -1 on error or closed connection
+ */
+static int socket_full(int fd, void *buffer, size_t length, int writing)
+{
+	unsigned char *cursor = (unsigned char *)buffer;
+
+	while(length > 0)
+	{
+		ssize_t result = writing ? send(fd, cursor, length, MSG_NOSIGNAL) : recv(fd, cursor, length, 0);
+		if(result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(result <= 0)
+		{
+			return -1;
+		}
+		cursor += result;
+		length -= result;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Connect to the daemon and share a ring of slots with it
+ *
+ * @param client [out] Connection
+ * @param socket_path [in] Daemon socket
+ * @param slots [in] Number of slots, i.e. maximum number of requests in flight
+ * @param slot_size [in] Slot size in bytes (multiple of 8), i.e. maximum payload size
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int client_connect(CLIENT *client, const char *socket_path, uint32_t slots, uint32_t slot_size)
+{
+	DAEMON_HELLO hello = {DAEMON_MAGIC, slots, slot_size, 0};
+	DAEMON_COMPLETION answer;
+	struct sockaddr_un address;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {&hello, sizeof(hello)};
+	struct msghdr message;
+	struct cmsghdr *cmsg;
+	size_t ring_size = (size_t)slots * slot_size;
+
+	memset(client, 0, sizeof(CLIENT));
+	client->socket_fd = -1;
+	client->slots = slots;
+	client->slot_size = slot_size;
+
+	if(strlen(socket_path) >= sizeof(address.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	int memory_fd = memfd_create("blowfish-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if((memory_fd < 0) || (ftruncate(memory_fd, ring_size) != 0) || (fcntl(memory_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) != 0))	// The daemon refuses a ring that could shrink under its workers
+	{
+		goto error;
+	}
+
+	client->ring = (unsigned char *) mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+	if(client->ring == MAP_FAILED)
+	{
+		client->ring = NULL;
+		goto error;
+	}
+
+	client->socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path);
+	if((client->socket_fd < 0) || (connect(client->socket_fd, (struct sockaddr *)&address, sizeof(address)) != 0))
+	{
+		goto error;
+	}
+
+	// Hello with the ring descriptor attached
+	memset(&message, 0, sizeof(message));
+	memset(control, 0, sizeof(control));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&message);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &memory_fd, sizeof(int));
+
+	if((sendmsg(client->socket_fd, &message, MSG_NOSIGNAL) != sizeof(hello)) || (socket_full(client->socket_fd, &answer, sizeof(answer), 0) != 0))
+	{
+		goto error;
+	}
+	if(answer.status != 0)
+	{
+		errno = answer.status;
+		goto error;
+	}
+
+	close(memory_fd);
+	return 0;
+
+error:
+	{
+		int saved_errno = errno;
+		if(memory_fd >= 0)
+		{
+			close(memory_fd);
+		}
+		client_close(client);
+		errno = saved_errno;
+	}
+	return -1;
+}
+
+
+/**
+ * @brief Address of a ring slot
+ */
+unsigned char *client_slot(CLIENT *client, uint32_t slot)
+{
+	return client->ring + (size_t)slot * client->slot_size;
+}
+
+
+/**
+ * @brief Ask the daemon to (en|de)crypt in place the first length bytes of a slot
+ *
+ * The slot must not be touched until the completion with the same id is received.
+ *
+ * @param client [in] Connection
+ * @param id [in] Identifier echoed in the completion
+ * @param slot [in] Slot holding the payload
+ * @param length [in] Payload length, multiple of 8
+ * @param direction [in] 'e' or 'd'
+ * @return 0 on success, -1 on error
+ */
+int client_submit(CLIENT *client, uint32_t id, uint32_t slot, uint32_t length, char direction)
+{
+	DAEMON_REQUEST request;
+
+	memset(&request, 0, sizeof(request));
+	request.id = id;
+	request.slot = slot;
+	request.length = length;
+	request.direction = direction;
+
+	return socket_full(client->socket_fd, &request, sizeof(request), 1);
+}
+
+
+/**
+ * @brief Wait for the next completion
+ *
+ * @param client [in] Connection
+ * @param completion [out] Identifier and status of the completed request
+ * @return 0 on success, -1 if the connection was lost
+ */
+int client_wait(CLIENT *client, DAEMON_COMPLETION *completion)
+{
+	return socket_full(client->socket_fd, completion, sizeof(DAEMON_COMPLETION), 0);
+}
+
+
+/**
+ * @brief Disconnect and release the ring
+ */
+void client_close(CLIENT *client)
+{
+	if(client->socket_fd >= 0)
+	{
+		close(client->socket_fd);
+	}
+	if(client->ring != NULL)
+	{
+		explicit_bzero(client->ring, (size_t)client->slots * client->slot_size);	// For security reasons overwrite memory before releasing it
+		munmap(client->ring, (size_t)client->slots * client->slot_size);
+	}
+	client->socket_fd = -1;
+	client->ring = NULL;
+}
@@ -0,0 +1,30 @@
+/*
+client.h:  Header file for client.c
+*/
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdint.h>
+#include "daemon.h"
+
+
+/**
+ * Connection to blowfish-daemon
+ */
+typedef struct {
+  int socket_fd;			//! Connected socket, readable when a completion is pending (usable with poll/epoll).
+  unsigned char *ring;		//! Shared memory ring, slots*slot_size bytes.
+  uint32_t slots;			//! Number of ring slots.
+  uint32_t slot_size;		//! Slot size in bytes.
+} CLIENT;
+
+
+int client_connect(CLIENT *client, const char *socket_path, uint32_t slots, uint32_t slot_size);
+unsigned char *client_slot(CLIENT *client, uint32_t slot);
+int client_submit(CLIENT *client, uint32_t id, uint32_t slot, uint32_t length, char direction);
+int client_wait(CLIENT *client, DAEMON_COMPLETION *completion);
+void client_close(CLIENT *client);
+
+
+#endif
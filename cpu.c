@@ -0,0 +1,266 @@
+/*
+cpu.c:  Thread count selection.
+
+The CPUs a run can really use are the ones in its affinity mask (taskset, cpuset) further limited by the CPU bandwidth quota of its cgroup (docker --cpus, Kubernetes limits), which sysconf() and nproc do not account for: a container limited to 2 CPUs on a 64 CPUs host would otherwise start 64 threads, which the scheduler throttles in turn.
+In auto mode the thread count is also capped so that every thread has at least CPU_MIN_THREAD_SECONDS of work, given the throughput of one thread measured with a short calibration run of the engine kernel: small files are not split in tiny blocks.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "kernel.h"
+
+
+#define CPU_CALIBRATION_BYTES (16L << 10)	//! Buffer encrypted by the calibration run.
+#define CPU_CALIBRATION_SECONDS 0.002		//! Minimum duration of the calibration run.
+
+
+/**
+ * @brief CPU bandwidth quota set in one cgroup directory
+ *
+ * @param directory [in] cgroup directory
+ * @param v2 [in] 1 for the unified hierarchy (cpu.max), 0 for the v1 cpu controller (cpu.cfs_quota_us, cpu.cfs_period_us)
+ * @return Quota in CPUs, 0 if there is none (or it cannot be read)
+ */
+static double cgroup_quota(const char *directory, int v2)
+{
+	char path[PATH_MAX];
+	char quota[32] = "";
+	long period = 0;
+	FILE *file;
+
+	if((size_t)snprintf(path, sizeof(path), "%s/%s", directory, v2 ? "cpu.max" : "cpu.cfs_quota_us") >= sizeof(path))
+	{
+		return 0;	// Longer than any path the kernel could open
+	}
+	file = fopen(path, "r");
+	if(file == NULL)
+	{
+		return 0;
+	}
+	if(fscanf(file, "%31s %ld", quota, &period) < 1)
+	{
+		period = 0;
+	}
+	fclose(file);
+
+	if(!v2)
+	{
+		file = ((size_t)snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", directory) < sizeof(path)) ? fopen(path, "r") : NULL;
+		if((file == NULL) || (fscanf(file, "%ld", &period) != 1))
+		{
+			period = 0;
+		}
+		if(file != NULL)
+		{
+			fclose(file);
+		}
+	}
+
+	if((period <= 0) || (strcmp(quota, "max") == 0) || (atol(quota) <= 0))	// "max" (v2) or -1 (v1): no limit
+	{
+		return 0;
+	}
+	return (double)atol(quota) / period;
+}
+
+
+/**
+ * @brief Whether a comma-separated list of v1 controllers ("cpu,cpuacct") holds the cpu controller
+ */
+static int has_cpu_controller(const char *controllers)
+{
+	size_t length;
+
+	while(*controllers != '\0')
+	{
+		length = strcspn(controllers, ",");
+		if((length == 3) && (strncmp(controllers, "cpu", 3) == 0))
+		{
+			return 1;
+		}
+		controllers += length + (controllers[length] == ',');
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Tightest CPU quota on the cgroup of the process and its ancestors
+ *
+ * @return Quota in CPUs, 0 if there is none
+ */
+static double cgroup_cpus(void)
+{
+	char line[4096];
+	char directory[PATH_MAX];
+	double cpus = 0;
+	FILE *file = fopen("/proc/self/cgroup", "r");
+
+	if(file == NULL)
+	{
+		return 0;
+	}
+
+	while(fgets(line, sizeof(line), file) != NULL)
+	{
+		char *controllers = strchr(line, ':');
+		char *path = controllers ? strchr(controllers + 1, ':') : NULL;
+		int v2;
+
+		if(path == NULL)
+		{
+			continue;
+		}
+		*path++ = '\0';
+		controllers++;
+		path[strcspn(path, "\n")] = '\0';
+
+		// "0::/path" is the unified hierarchy, "N:cpu,cpuacct:/path" the v1 cpu controller
+		v2 = (controllers[0] == '\0');
+		if(!v2 && !has_cpu_controller(controllers))
+		{
+			continue;
+		}
+
+		// The quota of every ancestor applies too, walk up to the root of the (namespaced) hierarchy
+		for(;;)
+		{
+			double quota;
+
+			if((size_t)snprintf(directory, sizeof(directory), "/sys/fs/cgroup%s%s%s", v2 ? "" : "/", v2 ? "" : controllers, path) >= sizeof(directory))
+			{
+				break;
+			}
+			quota = cgroup_quota(directory, v2);
+			if((quota > 0) && ((cpus == 0) || (quota < cpus)))
+			{
+				cpus = quota;
+			}
+
+			char *slash = strrchr(path, '/');
+			if((slash == NULL) || (path[1] == '\0'))
+			{
+				break;
+			}
+			if(slash == path)
+			{
+				path[1] = '\0';	// "/a" -> "/"
+			}
+			else
+			{
+				*slash = '\0';	// "/a/b" -> "/a"
+			}
+		}
+	}
+
+	fclose(file);
+	return cpus;
+}
+
+
+/**
+ * @brief Number of CPUs the process can use
+ *
+ * @return CPUs of the affinity mask, reduced to the cgroup quota (rounded up) if there is one, at least 1
+ */
+int cpu_available(void)
+{
+	cpu_set_t mask;
+	int cpus = 0;
+	double quota = cgroup_cpus();
+
+	if(sched_getaffinity(0, sizeof(mask), &mask) == 0)
+	{
+		cpus = CPU_COUNT(&mask);
+	}
+	if(cpus < 1)
+	{
+		cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if((quota > 0) && (quota < cpus))
+	{
+		cpus = (int)quota + (quota > (int)quota);	// A 1.5 CPUs quota still lets 2 threads run, each for part of the time
+	}
+	return (cpus < 1) ? 1 : cpus;
+}
+
+
+/**
+ * @brief Measure the (en|de)cryption throughput of one thread
+ *
+ * @param engine [in] S-box lookup implementation
+ * @return Bytes per second
+ */
+double cpu_throughput(BLOWFISH_ENGINE engine)
+{
+	BLOWFISH_CTX *ctx = (BLOWFISH_CTX *) malloc(sizeof(BLOWFISH_CTX));
+	unsigned char *buffer = (unsigned char *) calloc(CPU_CALIBRATION_BYTES, 1);
+	unsigned char key[] = "calibration";
+	BLOWFISH_KERNEL kernel = Blowfish_SelectKernel(engine, 'e', BLOWFISH_ECB, KERNEL_WIDTH_DEFAULT);
+	struct timespec start, end;
+	double seconds = 0;
+	long bytes = 0;
+
+	if((ctx == NULL) || (buffer == NULL))
+	{
+		free(ctx);
+		free(buffer);
+		return 0;
+	}
+
+	Blowfish_Init(ctx, key, sizeof(key) - 1);	// Speed does not depend on the key, the real one is not needed
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do
+	{
+		kernel(ctx, buffer, buffer, CPU_CALIBRATION_BYTES / 8, NULL);
+		bytes += CPU_CALIBRATION_BYTES;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	} while(seconds < CPU_CALIBRATION_SECONDS);
+
+	memset(ctx, 0, sizeof(BLOWFISH_CTX));
+	free(ctx);
+	free(buffer);
+	return bytes / seconds;
+}
+
+
+/**
+ * @brief Thread count for a job in auto mode
+ *
+ * @param length [in] Input length in bytes
+ * @param engine [in] S-box lookup implementation
+ * @return One thread per available CPU, fewer if the threads would get less than CPU_MIN_THREAD_SECONDS of work or less than CPU_MIN_THREAD_BYTES each
+ */
+int cpu_auto_threads(long length, BLOWFISH_ENGINE engine)
+{
+	int threads = cpu_available();
+	double throughput;
+	long limit;
+
+	limit = length / CPU_MIN_THREAD_BYTES;
+	if(limit < threads)
+	{
+		threads = (limit < 1) ? 1 : (int)limit;
+	}
+	if(threads == 1)
+	{
+		return 1;	// No need to calibrate
+	}
+
+	throughput = cpu_throughput(engine);
+	limit = (long)(length / (throughput * CPU_MIN_THREAD_SECONDS));
+	if(limit < threads)
+	{
+		threads = (limit < 1) ? 1 : (int)limit;
+	}
+	return threads;
+}
@@ -0,0 +1,20 @@
+/*
+cpu.h:  Header file for cpu.c
+*/
+
+#ifndef CPU_H
+#define CPU_H
+
+#include "blowfish.h"
+
+
+#define CPU_MIN_THREAD_SECONDS 0.005	//! Minimum work of a thread in auto mode, below that creating it costs more than it saves.
+#define CPU_MIN_THREAD_BYTES 4096		//! Minimum block of a thread (WRITER_ALIGNMENT), a smaller one would be empty.
+
+
+int cpu_available(void);
+double cpu_throughput(BLOWFISH_ENGINE engine);
+int cpu_auto_threads(long length, BLOWFISH_ENGINE engine);
+
+
+#endif
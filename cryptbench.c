@@ -0,0 +1,149 @@
+/*
+cryptbench.c:  Throughput and latency of the random access to a chunked ciphertext.
+
+Usage: blowfish-cryptbench chunked_file key max_threads [cache_chunks]
+
+Reads the plaintext of chunked_file (an output of blowfish-multithread i) through cryptfile.c, as blowfish-mount does for every request of the kernel:
+sequentially in 128 KB requests (the FUSE default) with and without readahead on a pool of max_threads workers, then in 4 KB requests at random offsets.
+For each pass prints the throughput and the request latency percentiles, to be compared with the elapsed time of blowfish-multithread x on the same file.
+The file is only read.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cryptfile.h"
+#include "kernel.h"
+#include "pool.h"
+
+
+#define SEQUENTIAL_REQUEST (128L << 10)	//! Sequential request size in bytes.
+#define RANDOM_REQUEST 4096L			//! Random request size in bytes.
+#define RANDOM_REQUESTS 20000			//! Number of random requests.
+
+
+/**
+ * @brief Current monotonic time in nanoseconds
+ */
+static int64_t now(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+
+static int compare_latency(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+
+/**
+ * @brief Read the file with requests of the given size and print the figures
+ *
+ * @param requests [in] Number of requests at random offsets, 0 to read the whole file sequentially
+ */
+static void run_pass(const char *name, BLOWFISH_CTX *ctx, const char *filename, POOL *pool, int cache_chunks, long request, long requests)
+{
+	CRYPTFILE file;
+	unsigned char *buffer = (unsigned char *) malloc(request);
+	int64_t *latencies;
+	uint64_t seed = 0x9E3779B97F4A7C15ULL;
+	long bytes = 0;
+	long i = 0;
+	int random_offsets = (requests != 0);	//! 1 for random offsets.
+
+	if((buffer == NULL) || (cryptfile_open(&file, ctx, BLOWFISH_ENGINE_DEFAULT, filename, 0, pool, cache_chunks, CRYPTFILE_READAHEAD_DEFAULT) != 0))
+	{
+		perror("Problem opening the chunked file (is its manifest beside it?)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	long length = cryptfile_length(&file);
+	if(requests == 0)
+	{
+		requests = (length + request - 1) / request;	// Sequential: the whole file
+	}
+	latencies = (int64_t *) malloc((requests + 1) * sizeof(int64_t));
+	if((latencies == NULL) || (length < request))
+	{
+		perror("Failed to allocate memory, or file shorter than a request\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int64_t start = now();
+	for(i = 0; i < requests; ++i)
+	{
+		long offset = i * request;
+		if(random_offsets)
+		{
+			seed ^= seed >> 12;
+			seed ^= seed << 25;
+			seed ^= seed >> 27;
+			offset = (long)((seed * 0x2545F4914F6CDD1DULL) % (uint64_t)(length - request + 1));
+		}
+
+		int64_t request_start = now();
+		long result = cryptfile_read(&file, buffer, request, offset);
+		latencies[i] = now() - request_start;
+		if(result < 0)
+		{
+			perror("Reading error\n");
+			exit(EXIT_FAILURE);
+		}
+		bytes += result;
+	}
+	double seconds = (now() - start) / 1e9;
+
+	qsort(latencies, requests, sizeof(int64_t), compare_latency);
+	printf("%-24s %8ld requests %8.1f MB/s  p50=%.1fus p99=%.1fus max=%.1fus\n", name, requests, bytes / seconds / 1e6, latencies[requests / 2] / 1e3, latencies[(requests * 99) / 100] / 1e3, latencies[requests - 1] / 1e3);
+
+	cryptfile_close(&file);
+	free(latencies);
+	buffer = (unsigned char *) memset(buffer, 0, request);	// For security reasons overwrite memory before exiting
+	free(buffer);
+}
+
+
+int main(int argc, char **argv)
+{
+	BLOWFISH_CTX ctx;
+	POOL pool;
+
+	if(argc < 4)
+	{
+		perror("Usage: blowfish-cryptbench chunked_file key max_threads [cache_chunks]\n");
+		exit(EXIT_FAILURE);
+	}
+
+	char *key = argv[2];
+	int key_length = strlen(key);
+	int max_threads = atoi(argv[3]);
+	int cache_chunks = (argc > 4) ? atoi(argv[4]) : CRYPTFILE_CACHE_DEFAULT;
+
+	if((key_length<4) || (key_length>56) || (max_threads < 1))
+	{
+		perror("Wrong arguments\n");
+		exit(EXIT_FAILURE);
+	}
+
+	(BLOWFISH_ENGINE_DEFAULT == BLOWFISH_ENGINE_CONSTANT_TIME ? Blowfish_InitCT : Blowfish_Init)(&ctx, (unsigned char *)key, key_length);
+	if(pool_create(&pool, max_threads) != 0)
+	{
+		perror("Thread creation error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	run_pass("sequential readahead", &ctx, argv[1], &pool, cache_chunks, SEQUENTIAL_REQUEST, 0);
+	run_pass("sequential", &ctx, argv[1], NULL, cache_chunks, SEQUENTIAL_REQUEST, 0);
+	run_pass("random 4 KB", &ctx, argv[1], NULL, cache_chunks, RANDOM_REQUEST, RANDOM_REQUESTS);
+
+	pool_destroy(&pool);
+	memset(&ctx, 0, sizeof(BLOWFISH_CTX));
+	return 0;
+}
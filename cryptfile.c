@@ -0,0 +1,902 @@
+/*
+cryptfile.c:  Random access to a chunked ciphertext.
+
+The ciphertext and its manifest are those of chunked.c, so a file written here can be decrypted by blowfish-multithread x and updated by i, and vice versa.
+Every chunk is encrypted in counter mode with its own counter, so a read only decrypts the chunks it touches and a write only re-encrypts them.
+Decrypted chunks are kept in a small LRU cache: writes change the cached plaintext, which is encrypted and written back when the entry is evicted or the file flushed, every time under a new generation so that no counter is ever reused.
+As in chunked_encrypt() a chunk is overwritten only once the manifest recording its new and previous generations is stored as pending, and every chunk is checked against its digest when loaded;
+a file opened after an interrupted write-back is settled on the version of each chunk found on disk.
+After a read the following chunks are decrypted ahead by tasks on the worker pool, a sequential reader then finds them in the cache.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include "cryptfile.h"
+#include "debug.h"
+
+
+/**
+ * @brief Read up to length bytes at offset, the rest of the buffer is left as it is if the file is shorter
+ *
+ * @return 0 on success, -1 on error
+ */
+static int read_full(int fd, unsigned char *buffer, long length, long offset)
+{
+	while(length > 0)
+	{
+		ssize_t result = pread(fd, buffer, length, offset);
+		if(result < 0)
+		{
+			return -1;
+		}
+		if(result == 0)
+		{
+			break;
+		}
+		buffer += result;
+		offset += result;
+		length -= result;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Write exactly length bytes at offset, retrying on short writes
+ *
+ * @return 0 on success, -1 on error
+ */
+static int write_full(int fd, const unsigned char *buffer, long length, long offset)
+{
+	while(length > 0)
+	{
+		ssize_t result = pwrite(fd, buffer, length, offset);
+		if(result <= 0)
+		{
+			return -1;
+		}
+		buffer += result;
+		offset += result;
+		length -= result;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Plaintext length of a chunk, 0 if the chunk is past the end of the file
+ */
+static long chunk_length(const CRYPTFILE *file, uint64_t index)
+{
+	long offset = index * file->manifest.chunk_size;
+	long length = (long)file->manifest.file_length - offset;
+
+	if(length <= 0)
+	{
+		return 0;
+	}
+	return (length > (long)file->manifest.chunk_size) ? (long)file->manifest.chunk_size : length;
+}
+
+
+/**
+ * @brief Grow the manifest to chunk_count chunks, the new ones have generation 0 (never written, read as zeros)
+ *
+ * @return 0 on success, -1 on error
+ */
+static int resize_manifest(CRYPTFILE *file, uint64_t chunk_count)
+{
+	CHUNK_MANIFEST *manifest = &file->manifest;
+
+	if(chunk_count > manifest->chunk_count)
+	{
+		CHUNK_ENTRY *chunks = (CHUNK_ENTRY *) realloc(manifest->chunks, (chunk_count + 1) * sizeof(CHUNK_ENTRY));
+		if(chunks == NULL)
+		{
+			return -1;
+		}
+		memset(chunks + manifest->chunk_count, 0, (chunk_count + 1 - manifest->chunk_count) * sizeof(CHUNK_ENTRY));
+		manifest->chunks = chunks;
+	}
+	else
+	{
+		memset(manifest->chunks + chunk_count, 0, (manifest->chunk_count - chunk_count) * sizeof(CHUNK_ENTRY));	// Dropped chunks are zeros if the file grows again
+	}
+	manifest->chunk_count = chunk_count;
+	return 0;
+}
+
+
+/**
+ * @brief Cache entry holding a chunk, NULL if not cached
+ */
+static CRYPTFILE_BLOCK *find_block(CRYPTFILE *file, uint64_t index)
+{
+	int i = 0;
+
+	for(i = 0; i < file->block_count; ++i)
+	{
+		if((file->blocks[i].state != CRYPTFILE_EMPTY) && (file->blocks[i].index == index))
+		{
+			return &file->blocks[i];
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * @brief Least recently used entry, empty entries first
+ *
+ * @param clean [in] 1 to skip the dirty entries (readahead does not write back)
+ * @return The entry to be reused, NULL if every entry is being loaded (or dirty)
+ */
+static CRYPTFILE_BLOCK *victim_block(CRYPTFILE *file, int clean)
+{
+	CRYPTFILE_BLOCK *victim = NULL;
+	int i = 0;
+
+	for(i = 0; i < file->block_count; ++i)
+	{
+		CRYPTFILE_BLOCK *block = &file->blocks[i];
+
+		if(block->state == CRYPTFILE_EMPTY)
+		{
+			return block;
+		}
+		if((block->state == CRYPTFILE_LOADING) || (clean && (block->state == CRYPTFILE_DIRTY)))
+		{
+			continue;
+		}
+		if((victim == NULL) || (block->last_use < victim->last_use))
+		{
+			victim = block;
+		}
+	}
+	return victim;
+}
+
+
+/**
+ * @brief Give a chunk a new generation in the manifest, keeping the one on disk as the previous generation
+ *
+ * @param data [in] Chunk plaintext, chunk_length() bytes
+ * @return 0 on success, -1 on error
+ */
+static int journal_chunk(CRYPTFILE *file, uint64_t index, const unsigned char *data)
+{
+	CHUNK_MANIFEST *manifest = &file->manifest;
+	CHUNK_ENTRY *entry = &manifest->chunks[index];
+	long length = chunk_length(file, index);
+
+	if(length == 0)
+	{
+		return 0;	// Truncated away
+	}
+
+	if(manifest->generation == CHUNK_GENERATION_MAX)
+	{
+		errno = EOVERFLOW;	// No counter left for this nonce: the file must be rewritten by blowfish-multithread i
+		return -1;
+	}
+	entry->previous_generation = entry->generation;
+	entry->previous_digest = entry->digest;
+	entry->digest = chunk_digest(file->ctx, file->engine, data, length);
+	entry->generation = ++manifest->generation;	// Every write-back gets a counter never used before
+	file->modified = 1;
+	return 0;
+}
+
+
+/**
+ * @brief Store the manifest as pending, before the chunks given a new generation are overwritten
+ *
+ * The chunks written so far are made durable first: the manifest records them as previous generations.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int journal_store(CRYPTFILE *file)
+{
+	file->manifest.pending = 1;
+	if((fdatasync(file->fd) != 0) || ((file->manifest_name != NULL) && (manifest_store(file->manifest_name, &file->manifest) != 0)))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Encrypt a chunk plaintext under the generation given by journal_chunk() and write it at its position
+ *
+ * @param data [in] Chunk plaintext, chunk_length() bytes
+ * @return 0 on success, -1 on error
+ */
+static int write_chunk(CRYPTFILE *file, uint64_t index, const unsigned char *data)
+{
+	CHUNK_MANIFEST *manifest = &file->manifest;
+	long length = chunk_length(file, index);
+	long offset = index * manifest->chunk_size;
+
+	memcpy(file->scratch, data, length);
+	chunk_crypt(file->ctx, file->engine, chunk_counter(manifest, index, manifest->chunks[index].generation), file->scratch, length);
+	if(write_full(file->fd, file->scratch, length, offset) != 0)
+	{
+		return -1;
+	}
+
+	if(offset + length > file->stored_length)
+	{
+		file->stored_length = offset + length;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Write back a single chunk (eviction of a dirty entry)
+ *
+ * @return 0 on success, -1 on error
+ */
+static int store_chunk(CRYPTFILE *file, uint64_t index, const unsigned char *data)
+{
+	if(chunk_length(file, index) == 0)
+	{
+		return 0;	// Truncated away
+	}
+	if((journal_chunk(file, index, data) != 0) || (journal_store(file) != 0))
+	{
+		return -1;
+	}
+	return write_chunk(file, index, data);
+}
+
+
+/**
+ * @brief Settle the chunks of an interrupted write-back (pending manifest) on the version found on disk
+ *
+ * A chunk matching neither version keeps its entry, and fails to load.
+ */
+static void recover(CRYPTFILE *file)
+{
+	CHUNK_MANIFEST *manifest = &file->manifest;
+	uint64_t index = 0;
+
+	for(index = 0; index < manifest->chunk_count; ++index)
+	{
+		CHUNK_ENTRY *entry = &manifest->chunks[index];
+		long length = chunk_length(file, index);
+		long stored = file->stored_length - (long)(index * manifest->chunk_size);
+
+		if(entry->previous_generation != 0)
+		{
+			memset(file->scratch, 0, manifest->chunk_size);
+			if((read_full(file->fd, file->scratch, (stored < length) ? stored : length, index * manifest->chunk_size) == 0) && (chunk_open(file->ctx, file->engine, manifest, index, file->scratch, length) == 1))
+			{
+				entry->generation = entry->previous_generation;	// Not rewritten before the interruption
+				entry->digest = entry->previous_digest;
+			}
+			entry->previous_generation = 0;
+			entry->previous_digest = 0;
+		}
+	}
+	manifest->pending = 0;
+	file->modified = 1;
+}
+
+
+/**
+ * @brief Assign an entry to a chunk to be loaded, taking under the lock what the load needs
+ */
+static void prepare_load(CRYPTFILE *file, CRYPTFILE_BLOCK *block, uint64_t index)
+{
+	long offset = index * file->manifest.chunk_size;
+	long stored = file->stored_length - offset;
+
+	if(stored > chunk_length(file, index))
+	{
+		stored = chunk_length(file, index);	// Bytes past a truncation are stale
+	}
+	if((stored < 0) || (index >= file->manifest.chunk_count) || (file->manifest.chunks[index].generation == 0))
+	{
+		stored = 0;	// Never written: zeros
+	}
+
+	block->index = index;
+	block->state = CRYPTFILE_LOADING;
+	block->stored = stored;
+	block->counter = (stored > 0) ? chunk_counter(&file->manifest, index, file->manifest.chunks[index].generation) : 0;
+	block->digest = (stored > 0) ? file->manifest.chunks[index].digest : 0;
+}
+
+
+/**
+ * @brief Read and decrypt the chunk of a CRYPTFILE_LOADING entry, called without the lock
+ *
+ * @return 0 on success, -1 on error (EIO if the chunk does not match its digest)
+ */
+static int load_block(CRYPTFILE *file, CRYPTFILE_BLOCK *block)
+{
+	memset(block->data, 0, file->manifest.chunk_size);
+	if(read_full(file->fd, block->data, block->stored, block->index * file->manifest.chunk_size) != 0)
+	{
+		return -1;
+	}
+	chunk_crypt(file->ctx, file->engine, block->counter, block->data, block->stored);
+	if((block->stored > 0) && (chunk_digest(file->ctx, file->engine, block->data, block->stored) != block->digest))
+	{
+		errno = EIO;	// Corrupted, or torn by an interrupted write-back
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Publish the result of load_block(), called with the lock
+ */
+static void finish_load(CRYPTFILE *file, CRYPTFILE_BLOCK *block, int result)
+{
+	block->state = (result == 0) ? CRYPTFILE_CLEAN : CRYPTFILE_EMPTY;
+	block->last_use = ++file->clock;
+	pthread_cond_broadcast(&file->loaded);
+}
+
+
+/**
+ * @brief Cache entry of a chunk, loaded if needed, called with the lock
+ *
+ * The lock is released while the chunk is decrypted, so other chunks can be served in the meanwhile.
+ *
+ * @param load [in] 0 if the caller overwrites the whole chunk, which then is not read
+ * @return The entry, NULL on error
+ */
+static CRYPTFILE_BLOCK *get_block(CRYPTFILE *file, uint64_t index, int load)
+{
+	CRYPTFILE_BLOCK *block;
+	int result = 0;
+
+	for(;;)
+	{
+		block = find_block(file, index);
+		if((block != NULL) && (block->state != CRYPTFILE_LOADING))
+		{
+			block->last_use = ++file->clock;
+			return block;
+		}
+		if(block == NULL)
+		{
+			block = victim_block(file, 0);
+			if(block != NULL)
+			{
+				break;
+			}
+		}
+		pthread_cond_wait(&file->loaded, &file->mutex);	// Loaded by someone else, or every entry busy
+	}
+
+	if((block->state == CRYPTFILE_DIRTY) && (store_chunk(file, block->index, block->data) != 0))
+	{
+		return NULL;
+	}
+
+	prepare_load(file, block, index);
+	if(load)
+	{
+		pthread_mutex_unlock(&file->mutex);
+		result = load_block(file, block);
+		pthread_mutex_lock(&file->mutex);
+	}
+	else
+	{
+		memset(block->data, 0, file->manifest.chunk_size);
+	}
+	finish_load(file, block, result);
+
+	return (result == 0) ? block : NULL;
+}
+
+
+/**
+ * @brief Pool task: decrypt a chunk ahead of the reader
+ */
+static void readahead_task(POOL_TASK *task)
+{
+	CRYPTFILE_BLOCK *block = (CRYPTFILE_BLOCK *)task;
+	CRYPTFILE *file = block->file;
+	int result = load_block(file, block);
+
+	pthread_mutex_lock(&file->mutex);
+		finish_load(file, block, result);
+		file->loading--;
+	pthread_mutex_unlock(&file->mutex);
+}
+
+
+/**
+ * @brief Queue the chunks following index on the pool, called with the lock
+ */
+static void readahead(CRYPTFILE *file, uint64_t index)
+{
+	uint64_t next = 0;
+
+	for(next = index + 1; (next <= index + file->readahead) && (chunk_length(file, next) > 0); ++next)
+	{
+		if(find_block(file, next) != NULL)
+		{
+			continue;
+		}
+
+		CRYPTFILE_BLOCK *block = victim_block(file, 1);
+		if(block == NULL)
+		{
+			return;
+		}
+		prepare_load(file, block, next);
+		file->loading++;
+		pool_submit(file->pool, &block->task);
+	}
+}
+
+
+/**
+ * @brief Open a chunked ciphertext
+ *
+ * @param file [out] Open file, to be released with cryptfile_close()
+ * @param ctx [in] Context of the file key, must outlive the file
+ * @param engine [in] S-box lookup implementation
+ * @param filename [in] Ciphertext file name, its manifest is <filename>.manifest
+ * @param create [in] 1 to create an empty file (under a fresh nonce) if there is no ciphertext
+ * @param pool [in] Pool running the readahead, NULL for none
+ * @param cache_blocks [in] Number of cached chunks (at least 2)
+ * @param readahead [in] Chunks decrypted ahead of every read, limited to cache_blocks - 2
+ * @return 0 on success, -1 on error (missing or mismatching manifest)
+ */
+int cryptfile_open(CRYPTFILE *file, BLOWFISH_CTX *ctx, BLOWFISH_ENGINE engine, const char *filename, int create, POOL *pool, int cache_blocks, int readahead)
+{
+	struct stat status;
+	int i = 0;
+
+	memset(file, 0, sizeof(CRYPTFILE));
+	file->ctx = ctx;
+	file->engine = engine;
+	file->pool = pool;
+	file->block_count = (cache_blocks < 2) ? 2 : cache_blocks;
+	file->readahead = (pool == NULL) ? 0 : ((readahead < file->block_count - 2) ? readahead : file->block_count - 2);
+
+	file->fd = open(filename, O_RDWR | (create ? O_CREAT : 0), 0644);
+	if((file->fd < 0) || (fstat(file->fd, &status) != 0))
+	{
+		return -1;
+	}
+
+	file->manifest_name = (char *) malloc(strlen(filename) + sizeof(MANIFEST_SUFFIX));
+	if(file->manifest_name == NULL)
+	{
+		close(file->fd);
+		return -1;
+	}
+	sprintf(file->manifest_name, "%s%s", filename, MANIFEST_SUFFIX);
+
+	if(manifest_load(file->manifest_name, &file->manifest) != 0)
+	{
+		if(!create || (status.st_size != 0) || (getrandom(&file->manifest.nonce, sizeof(file->manifest.nonce), 0) != sizeof(file->manifest.nonce)))
+		{
+			close(file->fd);
+			free(file->manifest_name);
+			return -1;
+		}
+		file->manifest.chunk_size = CHUNK_SIZE_DEFAULT;
+		file->manifest.chunks = (CHUNK_ENTRY *) calloc(1, sizeof(CHUNK_ENTRY));
+		file->modified = 1;	// Store the manifest of the new file
+	}
+	if((file->manifest.chunks == NULL) || ((file->manifest.file_length != (uint64_t)status.st_size) && !file->manifest.pending))	// An interrupted write-back may not have resized the file
+	{
+		close(file->fd);
+		free(file->manifest_name);
+		manifest_free(&file->manifest);
+		return -1;
+	}
+	file->stored_length = status.st_size;
+
+	file->blocks = (CRYPTFILE_BLOCK *) calloc(file->block_count, sizeof(CRYPTFILE_BLOCK));
+	file->scratch = (unsigned char *) malloc(file->manifest.chunk_size);
+	if((file->blocks == NULL) || (file->scratch == NULL))
+	{
+		perror("Failed to allocate the cache, exiting");
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < file->block_count; ++i)
+	{
+		file->blocks[i].task.run = readahead_task;
+		file->blocks[i].file = file;
+		file->blocks[i].data = (unsigned char *) malloc(file->manifest.chunk_size);
+		if(file->blocks[i].data == NULL)
+		{
+			perror("Failed to allocate the cache, exiting");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(file->manifest.pending)
+	{
+		recover(file);
+	}
+
+	pthread_mutex_init(&file->mutex, NULL);
+	pthread_cond_init(&file->loaded, NULL);
+	return 0;
+}
+
+
+/**
+ * @brief Read plaintext
+ *
+ * @param buffer [out] Plaintext
+ * @param length [in] Bytes to be read
+ * @param offset [in] Plaintext offset
+ * @return Bytes read (less than length only at the end of the file), -1 on error
+ */
+long cryptfile_read(CRYPTFILE *file, unsigned char *buffer, long length, long offset)
+{
+	long chunk_size = file->manifest.chunk_size;
+	long done = 0;
+
+	pthread_mutex_lock(&file->mutex);
+		if(offset + length > (long)file->manifest.file_length)
+		{
+			length = (offset < (long)file->manifest.file_length) ? (long)file->manifest.file_length - offset : 0;
+		}
+
+		while(done < length)
+		{
+			long within = (offset + done) % chunk_size;
+			long count = (length - done < chunk_size - within) ? length - done : chunk_size - within;
+			CRYPTFILE_BLOCK *block = get_block(file, (offset + done) / chunk_size, 1);
+
+			if(block == NULL)
+			{
+				pthread_mutex_unlock(&file->mutex);
+				return -1;
+			}
+			memcpy(buffer + done, block->data + within, count);
+			done += count;
+		}
+
+		if((length > 0) && (file->readahead > 0))
+		{
+			readahead(file, (offset + length - 1) / chunk_size);
+		}
+	pthread_mutex_unlock(&file->mutex);
+
+	return done;
+}
+
+
+/**
+ * @brief Change the plaintext length, called with the lock
+ *
+ * @return 0 on success, -1 on error
+ */
+static int resize(CRYPTFILE *file, long length)
+{
+	long chunk_size = file->manifest.chunk_size;
+	long old_length = file->manifest.file_length;
+	CRYPTFILE_BLOCK *block;
+	int i = 0;
+
+	if((uint64_t)(length + chunk_size - 1) / chunk_size > CHUNK_COUNT_MAX)
+	{
+		errno = EFBIG;	// The chunk index would overflow its counter bits
+		return -1;
+	}
+
+	if((length > old_length) && (old_length%chunk_size != 0))
+	{
+		// The last chunk grows: its ciphertext on disk is too short, it must be written again
+		block = get_block(file, old_length / chunk_size, 1);
+		if(block == NULL)
+		{
+			return -1;
+		}
+		block->state = CRYPTFILE_DIRTY;
+	}
+
+	if(length < old_length)
+	{
+		for(i = 0; i < file->block_count; ++i)
+		{
+			while(file->blocks[i].state == CRYPTFILE_LOADING)
+			{
+				pthread_cond_wait(&file->loaded, &file->mutex);
+			}
+			if((file->blocks[i].state != CRYPTFILE_EMPTY) && ((long)file->blocks[i].index * chunk_size >= length))
+			{
+				file->blocks[i].state = CRYPTFILE_EMPTY;	// Dropped, dirty or not
+			}
+		}
+		if(length%chunk_size != 0)
+		{
+			// The new last chunk is cut, what follows must read as zeros if the file grows again
+			block = get_block(file, length / chunk_size, 1);
+			if(block == NULL)
+			{
+				return -1;
+			}
+			memset(block->data + length%chunk_size, 0, chunk_size - length%chunk_size);
+			block->state = CRYPTFILE_DIRTY;
+		}
+	}
+
+	if(resize_manifest(file, (length + chunk_size - 1) / chunk_size) != 0)
+	{
+		return -1;
+	}
+	file->manifest.file_length = length;
+	file->modified = 1;
+	return 0;
+}
+
+
+/**
+ * @brief Write plaintext, growing the file if needed
+ *
+ * The data is encrypted and written out when its chunk is evicted from the cache, or by cryptfile_flush().
+ *
+ * @param buffer [in] Plaintext
+ * @param length [in] Bytes to be written
+ * @param offset [in] Plaintext offset, a hole before it reads as zeros
+ * @return Bytes written, -1 on error
+ */
+long cryptfile_write(CRYPTFILE *file, const unsigned char *buffer, long length, long offset)
+{
+	long chunk_size = file->manifest.chunk_size;
+	long done = 0;
+
+	pthread_mutex_lock(&file->mutex);
+		if((offset + length > (long)file->manifest.file_length) && (resize(file, offset + length) != 0))
+		{
+			pthread_mutex_unlock(&file->mutex);
+			return -1;
+		}
+
+		while(done < length)
+		{
+			uint64_t index = (offset + done) / chunk_size;
+			long within = (offset + done) % chunk_size;
+			long count = (length - done < chunk_size - within) ? length - done : chunk_size - within;
+			CRYPTFILE_BLOCK *block = get_block(file, index, (within != 0) || (count < chunk_length(file, index)));
+
+			if(block == NULL)
+			{
+				pthread_mutex_unlock(&file->mutex);
+				return -1;
+			}
+			memcpy(block->data + within, buffer + done, count);
+			block->state = CRYPTFILE_DIRTY;
+			done += count;
+		}
+	pthread_mutex_unlock(&file->mutex);
+
+	return done;
+}
+
+
+/**
+ * @brief Change the plaintext length, the new bytes read as zeros
+ *
+ * @return 0 on success, -1 on error
+ */
+int cryptfile_truncate(CRYPTFILE *file, long length)
+{
+	int result = 0;
+
+	pthread_mutex_lock(&file->mutex);
+		if(length != (long)file->manifest.file_length)
+		{
+			result = resize(file, length);
+		}
+	pthread_mutex_unlock(&file->mutex);
+
+	return result;
+}
+
+
+/**
+ * @brief Plaintext length
+ */
+long cryptfile_length(CRYPTFILE *file)
+{
+	long length = 0;
+
+	pthread_mutex_lock(&file->mutex);
+		length = file->manifest.file_length;
+	pthread_mutex_unlock(&file->mutex);
+
+	return length;
+}
+
+
+/**
+ * @brief Write back every changed chunk and store the manifest
+ *
+ * Chunks never written (holes left by a growth) are written as encrypted zeros, so that the ciphertext can be decrypted by blowfish-multithread x.
+ * As in chunked_encrypt() every new generation is journaled in a pending manifest before the chunks are written, and the data is made durable before the manifest drops the previous generations.
+ *
+ * @return 0 on success, -1 on error
+ */
+int cryptfile_flush(CRYPTFILE *file)
+{
+	CHUNK_MANIFEST *manifest = &file->manifest;
+	uint64_t first = manifest->generation;	//! Chunks given a later generation are written by this flush.
+	unsigned char *zeros = (unsigned char *) calloc(1, manifest->chunk_size);
+	CRYPTFILE_BLOCK *block;
+	uint64_t index = 0;
+	int result = (zeros == NULL) ? -1 : 0;
+	int i = 0;
+
+	pthread_mutex_lock(&file->mutex);
+		for(i = 0; (i < file->block_count) && (result == 0); ++i)
+		{
+			if(file->blocks[i].state == CRYPTFILE_DIRTY)
+			{
+				result = journal_chunk(file, file->blocks[i].index, file->blocks[i].data);
+			}
+		}
+		for(index = 0; (index < manifest->chunk_count) && (result == 0); ++index)
+		{
+			if(manifest->chunks[index].generation == 0)
+			{
+				result = journal_chunk(file, index, zeros);
+			}
+		}
+
+		if((result == 0) && (manifest->generation != first))
+		{
+			result = journal_store(file);
+		}
+
+		for(index = 0; (index < manifest->chunk_count) && (result == 0); ++index)
+		{
+			if(manifest->chunks[index].generation > first)
+			{
+				block = find_block(file, index);
+				if((block != NULL) && (block->state == CRYPTFILE_DIRTY))
+				{
+					result = write_chunk(file, index, block->data);
+					block->state = CRYPTFILE_CLEAN;
+				}
+				else
+				{
+					result = write_chunk(file, index, zeros);
+				}
+			}
+		}
+		free(zeros);
+
+		if((result == 0) && file->modified)
+		{
+			if((ftruncate(file->fd, manifest->file_length) != 0) || (fsync(file->fd) != 0))
+			{
+				result = -1;
+			}
+			else
+			{
+				for(index = 0; index < manifest->chunk_count; ++index)
+				{
+					manifest->chunks[index].previous_generation = 0;
+					manifest->chunks[index].previous_digest = 0;
+				}
+				manifest->pending = 0;
+				result = (file->manifest_name != NULL) ? manifest_store(file->manifest_name, manifest) : 0;
+			}
+			if(result == 0)
+			{
+				file->stored_length = manifest->file_length;
+				file->modified = 0;
+			}
+		}
+	pthread_mutex_unlock(&file->mutex);
+
+	return result;
+}
+
+
+/**
+ * @brief Follow a rename or an unlink of the ciphertext, which is done by the caller
+ *
+ * The manifest is moved (or removed) under the lock, so that no write-back stores it under the old name in the meanwhile.
+ * A manifest not on disk yet (new file never flushed) or already moved (rename of a parent directory) is not an error.
+ *
+ * @param filename [in] New ciphertext file name, NULL if the ciphertext is being unlinked: the manifest is removed and never stored again
+ * @return 0 on success, -1 on error (errno set, the file is unchanged)
+ */
+int cryptfile_rename(CRYPTFILE *file, const char *filename)
+{
+	char *manifest_name = NULL;
+	int result = 0;
+
+	if(filename != NULL)
+	{
+		manifest_name = (char *) malloc(strlen(filename) + sizeof(MANIFEST_SUFFIX));
+		if(manifest_name == NULL)
+		{
+			return -1;
+		}
+		sprintf(manifest_name, "%s%s", filename, MANIFEST_SUFFIX);
+	}
+
+	pthread_mutex_lock(&file->mutex);
+		if(file->manifest_name != NULL)
+		{
+			result = (manifest_name != NULL) ? rename(file->manifest_name, manifest_name) : unlink(file->manifest_name);
+			if((result != 0) && (errno == ENOENT))
+			{
+				result = 0;
+			}
+		}
+		else
+		{
+			free(manifest_name);	// Unlinked already, it stays so
+			manifest_name = NULL;
+		}
+		if(result == 0)
+		{
+			free(file->manifest_name);
+			file->manifest_name = manifest_name;
+		}
+	pthread_mutex_unlock(&file->mutex);
+
+	if(result != 0)
+	{
+		free(manifest_name);
+	}
+	return result;
+}
+
+
+/**
+ * @brief Flush and close a file
+ *
+ * @return Result of the final cryptfile_flush()
+ */
+int cryptfile_close(CRYPTFILE *file)
+{
+	int result = 0;
+	int i = 0;
+
+	pthread_mutex_lock(&file->mutex);
+		while(file->loading > 0)
+		{
+			pthread_cond_wait(&file->loaded, &file->mutex);	// The readahead tasks use the entries
+		}
+	pthread_mutex_unlock(&file->mutex);
+
+	result = cryptfile_flush(file);
+
+	// For security reasons overwrite memory before exiting
+	for(i = 0; i < file->block_count; ++i)
+	{
+		file->blocks[i].data = (unsigned char *) memset(file->blocks[i].data, 0, file->manifest.chunk_size);
+		free(file->blocks[i].data);
+	}
+	file->scratch = (unsigned char *) memset(file->scratch, 0, file->manifest.chunk_size);
+	free(file->scratch);
+	free(file->blocks);
+	free(file->manifest_name);
+	manifest_free(&file->manifest);
+	close(file->fd);
+	pthread_mutex_destroy(&file->mutex);
+	pthread_cond_destroy(&file->loaded);
+	memset(file, 0, sizeof(CRYPTFILE));
+
+	return result;
+}
@@ -0,0 +1,87 @@
+/*
+cryptfile.h:  Header file for cryptfile.c
+
+Random access to a ciphertext of the chunked layout (see chunked.h): reads
+and writes are mapped to its independently encrypted chunks, a small LRU
+cache keeps the decrypted ones and the following chunks are decrypted ahead
+on a worker pool.
+*/
+
+#ifndef CRYPTFILE_H
+#define CRYPTFILE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "blowfish.h"
+#include "chunked.h"
+#include "pool.h"
+
+
+#define CRYPTFILE_CACHE_DEFAULT 16		//! Default number of cached chunks (16 MiB with the default chunk size).
+#define CRYPTFILE_READAHEAD_DEFAULT 2	//! Default number of chunks decrypted ahead of a read.
+
+
+/**
+ * State of a cache entry
+ */
+typedef enum {
+	CRYPTFILE_EMPTY,		//! No chunk.
+	CRYPTFILE_LOADING,		//! Being read and decrypted, outside the lock, by a reader or a readahead task.
+	CRYPTFILE_CLEAN,		//! Plaintext of the chunk, same as on disk.
+	CRYPTFILE_DIRTY			//! Plaintext of the chunk, changed since it was loaded.
+} CRYPTFILE_STATE;
+
+
+struct CRYPTFILE;
+
+
+/**
+ * Cache entry, holds the plaintext of one chunk
+ */
+typedef struct {
+	POOL_TASK task;				//! Readahead task, first member so the task is the entry.
+	struct CRYPTFILE *file;		//! File the entry belongs to.
+	CRYPTFILE_STATE state;		//! What data holds.
+	uint64_t index;				//! Chunk number.
+	uint64_t last_use;			//! Value of the file clock when the entry was last used (LRU).
+	uint64_t counter;			//! Counter of the chunk, taken under the lock before loading.
+	uint64_t digest;			//! Digest of the chunk plaintext, taken under the lock before loading.
+	long stored;				//! Ciphertext bytes of the chunk on disk, taken under the lock before loading.
+	unsigned char *data;		//! Chunk plaintext, chunk_size bytes.
+} CRYPTFILE_BLOCK;
+
+
+/**
+ * Open chunked ciphertext
+ */
+typedef struct CRYPTFILE {
+	BLOWFISH_CTX *ctx;			//! Context of the file key.
+	BLOWFISH_ENGINE engine;		//! S-box lookup implementation.
+	int fd;						//! Ciphertext file descriptor.
+	char *manifest_name;		//! <filename>.manifest, NULL once the file is unlinked (the manifest is never stored again).
+	CHUNK_MANIFEST manifest;	//! Manifest, file_length is the current plaintext length.
+	long stored_length;			//! Ciphertext length on disk.
+	int modified;				//! 1 if the manifest must be stored again.
+	CRYPTFILE_BLOCK *blocks;	//! Cache entries.
+	int block_count;			//! Number of cache entries.
+	uint64_t clock;				//! Incremented on every use of an entry.
+	unsigned char *scratch;		//! Ciphertext of the chunk being written back.
+	POOL *pool;					//! Pool running the readahead tasks, NULL for none.
+	int readahead;				//! Chunks decrypted ahead of a read.
+	int loading;				//! Readahead tasks still running.
+	pthread_mutex_t mutex;		//! Protects everything above but the data of the entries being loaded.
+	pthread_cond_t loaded;		//! Signaled when an entry leaves CRYPTFILE_LOADING.
+} CRYPTFILE;
+
+
+int cryptfile_open(CRYPTFILE *file, BLOWFISH_CTX *ctx, BLOWFISH_ENGINE engine, const char *filename, int create, POOL *pool, int cache_blocks, int readahead);
+long cryptfile_read(CRYPTFILE *file, unsigned char *buffer, long length, long offset);
+long cryptfile_write(CRYPTFILE *file, const unsigned char *buffer, long length, long offset);
+int cryptfile_truncate(CRYPTFILE *file, long length);
+long cryptfile_length(CRYPTFILE *file);
+int cryptfile_flush(CRYPTFILE *file);
+int cryptfile_rename(CRYPTFILE *file, const char *filename);
+int cryptfile_close(CRYPTFILE *file);
+
+
+#endif
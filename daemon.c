@@ -0,0 +1,540 @@
+/*
+daemon.c:  Resident encryption daemon.
+
+Usage: blowfish-daemon socket_path key max_threads [--engine=(table|ct)]
+
+The context is expanded once at startup and the worker pool stays resident, so a request costs a socket round trip and the kernel run instead of a process creation, a Blowfish_Init() and the thread spawning of blowfish-multithread.
+Every client connection is served by a thread that reads the requests and queues them to the pool, workers (en|de)crypt the payload in place in the client's shared memory and queue the completion back to the connection thread, which alone writes the socket: a client that does not read its completions stalls its own connection, never a pool worker.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "arena.h"
+#include "blowfish.h"
+#include "daemon.h"
+#include "kernel.h"
+#include "pool.h"
+
+
+/**
+ * Request being served, one per ring slot (a slot has at most one outstanding request)
+ */
+typedef struct {
+	POOL_TASK task;					//! Must be the first member.
+	struct CONNECTION *connection;	//! Owner connection.
+	DAEMON_REQUEST request;			//! Request to be served.
+	int busy;						//! 1 while queued or running.
+} DAEMON_JOB;
+
+
+/**
+ * Client connection
+ */
+typedef struct CONNECTION {
+	int socket_fd;					//! Connected socket.
+	unsigned char *ring;			//! Client shared memory, mapped.
+	size_t ring_size;				//! Shared memory size in bytes.
+	DAEMON_HELLO hello;				//! Ring geometry.
+	DAEMON_JOB *jobs;				//! One job per slot.
+	int outstanding;				//! Jobs queued or running.
+	DAEMON_COMPLETION *completions;	//! Completions not sent yet, a ring of hello.slots + 1 entries.
+	int *completion_slots;			//! Slot freed once each completion is sent, -1 for the refused requests.
+	unsigned int completion_head;	//! First completion not sent.
+	unsigned int completion_count;	//! Completions queued, completion_count + outstanding never exceeds the ring.
+	size_t completion_sent;			//! Bytes of the first completion already sent.
+	int wake_fd;					//! eventfd written by the workers when they queue a completion.
+	pthread_mutex_t mutex;			//! Protects outstanding, busy flags and the completion ring.
+	pthread_cond_t idle;			//! Signaled when outstanding drops to zero.
+} CONNECTION;
+
+
+static BLOWFISH_CTX *ctx;					//! Context expanded at startup, shared read-only by the workers.
+static BLOWFISH_KERNEL encrypt_kernel;		//! ECB encryption kernel.
+static BLOWFISH_KERNEL decrypt_kernel;		//! ECB decryption kernel.
+static POOL pool;							//! Resident worker pool.
+static const char *socket_path;				//! Listening socket path, removed on exit.
+
+
+/**
+ * @brief Read or write exactly length bytes on a socket
+ *
+ * @return 0 on success, -1 on error or closed connection
+ */
+static int socket_full(int fd, void *buffer, size_t length, int writing)
+{
+	unsigned char *cursor = (unsigned char *)buffer;
+
+	while(length > 0)
+	{
+		ssize_t result = writing ? send(fd, cursor, length, MSG_NOSIGNAL) : recv(fd, cursor, length, 0);
+		if(result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(result <= 0)
+		{
+			return -1;
+		}
+		cursor += result;
+		length -= result;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Queue a completion for the connection thread, called with the connection lock
+ *
+ * @param slot [in] Slot freed once the completion is sent, -1 if the request did not take one
+ */
+static void queue_completion(CONNECTION *connection, uint32_t id, int32_t status, int slot)
+{
+	unsigned int tail = (connection->completion_head + connection->completion_count) % (connection->hello.slots + 1);
+
+	connection->completions[tail].id = id;
+	connection->completions[tail].status = status;
+	connection->completion_slots[tail] = slot;
+	connection->completion_count++;
+}
+
+
+/**
+ * @brief Send the queued completions, from the connection thread
+ *
+ * A slot is freed when its completion is fully sent, before the next request is read: the client can only reuse it after that.
+ *
+ * @param blocking [in] 0 to stop when the socket is full, 1 to wait for the client (once no worker can queue more)
+ * @return 0 when the ring is empty or the socket is full, -1 if the client is gone
+ */
+static int send_completions(CONNECTION *connection, int blocking)
+{
+	DAEMON_COMPLETION *completion;
+	ssize_t result;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&connection->mutex);
+			completion = (connection->completion_count > 0) ? &connection->completions[connection->completion_head] : NULL;
+		pthread_mutex_unlock(&connection->mutex);	// The workers only append, the first entry stays
+		if(completion == NULL)
+		{
+			return 0;
+		}
+
+		result = send(connection->socket_fd, (unsigned char *)completion + connection->completion_sent, sizeof(DAEMON_COMPLETION) - connection->completion_sent, MSG_NOSIGNAL | (blocking ? 0 : MSG_DONTWAIT));
+		if((result < 0) && (errno == EINTR))
+		{
+			continue;
+		}
+		if(result < 0)
+		{
+			return (!blocking && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) ? 0 : -1;
+		}
+
+		connection->completion_sent += result;
+		if(connection->completion_sent == sizeof(DAEMON_COMPLETION))
+		{
+			pthread_mutex_lock(&connection->mutex);
+				if(connection->completion_slots[connection->completion_head] >= 0)
+				{
+					connection->jobs[connection->completion_slots[connection->completion_head]].busy = 0;
+				}
+				connection->completion_head = (connection->completion_head + 1) % (connection->hello.slots + 1);
+				connection->completion_count--;
+				connection->completion_sent = 0;
+			pthread_mutex_unlock(&connection->mutex);
+		}
+	}
+}
+
+
+/**
+ * @brief Worker side of a request: run the kernel in place on the slot and hand the completion to the connection thread
+ */
+static void job_run(POOL_TASK *task)
+{
+	DAEMON_JOB *job = (DAEMON_JOB *)task;
+	CONNECTION *connection = job->connection;
+	unsigned char *payload = connection->ring + (size_t)job->request.slot * connection->hello.slot_size;
+	uint64_t wake = 1;
+
+	(job->request.direction == 'd' ? decrypt_kernel : encrypt_kernel)(ctx, payload, payload, job->request.length/8, NULL);
+
+	pthread_mutex_lock(&connection->mutex);
+		queue_completion(connection, job->request.id, 0, job->request.slot);
+		while((write(connection->wake_fd, &wake, sizeof(wake)) < 0) && (errno == EINTR));	// Written under the lock: the connection is not freed before
+		if(--connection->outstanding == 0)
+		{
+			pthread_cond_signal(&connection->idle);	// Last use of the connection by this worker, it can be freed from now on
+		}
+	pthread_mutex_unlock(&connection->mutex);
+}
+
+
+/**
+ * @brief Receive the hello and the shared memory descriptor
+ *
+ * @return 0 on success, an errno value otherwise
+ */
+static int connection_handshake(CONNECTION *connection)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {&connection->hello, sizeof(DAEMON_HELLO)};
+	struct msghdr message;
+	struct cmsghdr *cmsg;
+	struct stat status;
+	int memory_fd = -1;
+	int seals = 0;
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	if(recvmsg(connection->socket_fd, &message, MSG_WAITALL) != sizeof(DAEMON_HELLO))
+	{
+		return EPROTO;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&message);
+	if((cmsg != NULL) && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+	{
+		memcpy(&memory_fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+
+	if((memory_fd < 0) || (connection->hello.magic != DAEMON_MAGIC) || (connection->hello.slots == 0) || (connection->hello.slots > DAEMON_MAX_SLOTS) || (connection->hello.slot_size == 0) || (connection->hello.slot_size > DAEMON_MAX_SLOT_SIZE) || (connection->hello.slot_size%8 != 0))
+	{
+		if(memory_fd >= 0)
+		{
+			close(memory_fd);
+		}
+		return EINVAL;
+	}
+
+	connection->ring_size = (size_t)connection->hello.slots * connection->hello.slot_size;
+
+	// The client must not be able to shrink the memory under the workers (SIGBUS would kill every connection): the whole ring must exist and be sealed against shrinking
+	seals = fcntl(memory_fd, F_GET_SEALS);
+	if((fstat(memory_fd, &status) != 0) || (status.st_size < (off_t)connection->ring_size) || (seals < 0) || ((seals & (F_SEAL_SHRINK | F_SEAL_SEAL)) != (F_SEAL_SHRINK | F_SEAL_SEAL)))
+	{
+		close(memory_fd);
+		return EINVAL;
+	}
+
+	connection->ring = (unsigned char *) mmap(NULL, connection->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+	close(memory_fd);	// The mapping keeps the memory alive
+	if(connection->ring == MAP_FAILED)
+	{
+		connection->ring = NULL;
+		return ENOMEM;
+	}
+
+	connection->jobs = (DAEMON_JOB *) calloc(connection->hello.slots, sizeof(DAEMON_JOB));
+	connection->completions = (DAEMON_COMPLETION *) calloc(connection->hello.slots + 1, sizeof(DAEMON_COMPLETION));
+	connection->completion_slots = (int *) calloc(connection->hello.slots + 1, sizeof(int));
+	return ((connection->jobs == NULL) || (connection->completions == NULL) || (connection->completion_slots == NULL)) ? ENOMEM : 0;
+}
+
+
+/**
+ * @brief Read one request and queue it to the pool, or queue its refusal
+ *
+ * @return 0 on success, -1 if the client is gone
+ */
+static int serve_request(CONNECTION *connection)
+{
+	DAEMON_REQUEST request;
+	DAEMON_JOB *job;
+	int busy;
+
+	if(socket_full(connection->socket_fd, &request, sizeof(request), 0) != 0)
+	{
+		return -1;
+	}
+
+	if((request.slot >= connection->hello.slots) || (request.length > connection->hello.slot_size) || (request.length%8 != 0) || ((request.direction != 'e') && (request.direction != 'd')))
+	{
+		pthread_mutex_lock(&connection->mutex);
+			queue_completion(connection, request.id, EINVAL, -1);
+		pthread_mutex_unlock(&connection->mutex);
+		return 0;
+	}
+
+	job = &connection->jobs[request.slot];
+
+	pthread_mutex_lock(&connection->mutex);
+		busy = job->busy;
+		if(busy)
+		{
+			queue_completion(connection, request.id, EBUSY, -1);
+		}
+		else
+		{
+			job->busy = 1;
+			connection->outstanding++;
+		}
+	pthread_mutex_unlock(&connection->mutex);
+
+	if(!busy)
+	{
+		job->task.run = job_run;
+		job->connection = connection;
+		job->request = request;
+		pool_submit(&pool, &job->task);
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Connection thread function
+ * Handshake, then read requests and queue them to the pool, and send the completions of the workers, until the client disconnects.
+ *
+ * @param args The connection.
+ */
+static void *connection_thread(void *args)
+{
+	CONNECTION *connection = (CONNECTION *)args;
+	int status = connection_handshake(connection);
+	DAEMON_COMPLETION answer = {0, status};
+	uint64_t wake;
+
+	connection->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if((status == 0) && (connection->wake_fd < 0))
+	{
+		answer.status = status = errno;
+	}
+	socket_full(connection->socket_fd, &answer, sizeof(answer), 1);	// No job yet, nothing else to send
+
+	while(status == 0)
+	{
+		struct pollfd fds[2] = {{connection->socket_fd, 0, 0}, {connection->wake_fd, POLLIN, 0}};
+
+		pthread_mutex_lock(&connection->mutex);
+			if(connection->completion_count > 0)
+			{
+				fds[0].events |= POLLOUT;
+			}
+			if(connection->completion_count + connection->outstanding < connection->hello.slots + 1)
+			{
+				fds[0].events |= POLLIN;	// Room for the completion of one more request, else the client must read first
+			}
+		pthread_mutex_unlock(&connection->mutex);
+
+		if(poll(fds, 2, -1) < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		if((fds[1].revents & POLLIN) && (read(connection->wake_fd, &wake, sizeof(wake)) < 0))
+		{
+			wake = 0;
+		}
+		if((fds[0].revents & (POLLOUT | POLLERR)) && (send_completions(connection, 0) != 0))
+		{
+			break;
+		}
+		if((fds[0].revents & (POLLIN | POLLHUP)) && (fds[0].events & POLLIN) && (serve_request(connection) != 0))
+		{
+			break;
+		}
+		if((fds[0].revents & (POLLHUP | POLLERR)) && !(fds[0].events & POLLIN))
+		{
+			break;	// Gone without reading its completions
+		}
+	}
+
+	// Client gone: wait for its jobs before unmapping the ring they work on
+	pthread_mutex_lock(&connection->mutex);
+		while(connection->outstanding > 0)
+		{
+			pthread_cond_wait(&connection->idle, &connection->mutex);
+		}
+	pthread_mutex_unlock(&connection->mutex);
+
+	if(status == 0)
+	{
+		send_completions(connection, 1);	// It may only have stopped sending: deliver what its jobs completed
+	}
+
+	if(connection->ring != NULL)
+	{
+		munmap(connection->ring, connection->ring_size);
+	}
+	if(connection->wake_fd >= 0)
+	{
+		close(connection->wake_fd);
+	}
+	close(connection->socket_fd);
+	free(connection->jobs);
+	free(connection->completions);
+	free(connection->completion_slots);
+	pthread_mutex_destroy(&connection->mutex);
+	pthread_cond_destroy(&connection->idle);
+	free(connection);
+	pthread_exit(NULL);
+}
+
+
+/**
+ * @brief Remove the socket file on termination
+ */
+static void terminate(int signal_number)
+{
+	(void)signal_number;
+	unlink(socket_path);
+	_exit(EXIT_SUCCESS);
+}
+
+
+int main(int argc, char **argv)
+{
+	BLOWFISH_ENGINE engine = BLOWFISH_ENGINE_DEFAULT;
+	struct sockaddr_un address;
+	ARENA arena;
+	int arg = 0;
+
+	if(argc < 4)
+	{
+		perror("Usage: blowfish-daemon socket_path key max_threads [--engine=(table|ct)]\n");
+		exit(EXIT_FAILURE);
+	}
+
+	socket_path = argv[1];
+	char *key = argv[2];
+	int max_threads = atoi(argv[3]);
+	int key_length = strlen(key);
+
+	for(arg = 4; arg < argc; ++arg)
+	{
+		if(strcmp(argv[arg], "--engine=table") == 0)
+		{
+			engine = BLOWFISH_ENGINE_TABLE;
+		}
+		else if(strcmp(argv[arg], "--engine=ct") == 0)
+		{
+			engine = BLOWFISH_ENGINE_CONSTANT_TIME;
+		}
+		else
+		{
+			printf("%s\n", argv[arg]);
+			perror("Unknown option\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if((key_length<4) || (key_length>56))
+	{
+		perror("Wrong key size (4-56 characters)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(max_threads < 1)
+	{
+		perror("The number of threads must be greater than zero\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(strlen(socket_path) >= sizeof(address.sun_path))
+	{
+		perror("Socket path too long\n");
+		exit(EXIT_FAILURE);
+	}
+
+
+	// Pre-expanded context and resident workers
+	if(arena_create(&arena, sizeof(BLOWFISH_CTX)) != 0)
+	{
+		perror("Failed to allocate memory, exiting");
+		exit(EXIT_FAILURE);
+	}
+	ctx = (BLOWFISH_CTX *) arena_alloc(&arena, sizeof(BLOWFISH_CTX));
+	(engine == BLOWFISH_ENGINE_CONSTANT_TIME ? Blowfish_InitCT : Blowfish_Init)(ctx, (unsigned char *)key, key_length);
+	memset(key, 0, key_length);	// Do not leave the key in the process arguments
+	encrypt_kernel = Blowfish_SelectKernel(engine, 'e', BLOWFISH_ECB, KERNEL_WIDTH_DEFAULT);
+	decrypt_kernel = Blowfish_SelectKernel(engine, 'd', BLOWFISH_ECB, KERNEL_WIDTH_DEFAULT);
+
+	if(pool_create(&pool, max_threads) != 0)
+	{
+		perror("Thread creation error\n");
+		exit(EXIT_FAILURE);
+	}
+
+
+	// Listening socket
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path);
+	unlink(socket_path);
+
+	if((listen_fd < 0) || (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0) || (listen(listen_fd, 64) != 0))
+	{
+		perror("Problem creating the socket\n");
+		exit(EXIT_FAILURE);
+	}
+
+	signal(SIGINT, terminate);
+	signal(SIGTERM, terminate);
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("Listening on %s with %d threads\n", socket_path, max_threads);
+	fflush(stdout);
+
+	for(;;)
+	{
+		int client_fd = accept(listen_fd, NULL, NULL);
+		if(client_fd < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			perror("Accept error\n");
+			break;
+		}
+
+		CONNECTION *connection = (CONNECTION *) calloc(1, sizeof(CONNECTION));
+		pthread_t thread;
+		if(connection == NULL)
+		{
+			close(client_fd);
+			continue;
+		}
+		connection->socket_fd = client_fd;
+		pthread_mutex_init(&connection->mutex, NULL);
+		pthread_cond_init(&connection->idle, NULL);
+
+		if(pthread_create(&thread, NULL, connection_thread, connection) != 0)
+		{
+			close(client_fd);
+			free(connection);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	close(listen_fd);
+	unlink(socket_path);
+	pool_destroy(&pool);
+	arena_destroy(&arena);
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,51 @@
+/*
+daemon.h:  Protocol between blowfish-daemon and its clients (see client.c)
+
+A client shares a memory region (memfd) split in ring slots, passing the descriptor over the Unix domain socket once at connection time.
+Payloads are written in place in the slots, the socket carries only fixed-size request and completion messages, so the data is never copied through the kernel.
+*/
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdint.h>
+
+
+#define DAEMON_MAGIC 0x42464431u				//! "BFD1", protocol signature and version.
+#define DAEMON_MAX_SLOTS 4096					//! Maximum number of ring slots per client.
+#define DAEMON_MAX_SLOT_SIZE (64u << 20)		//! Maximum slot size in bytes.
+
+
+/**
+ * First message of a client, sent together with the shared memory descriptor (SCM_RIGHTS)
+ */
+typedef struct {
+  uint32_t magic;		//! DAEMON_MAGIC.
+  uint32_t slots;		//! Number of ring slots.
+  uint32_t slot_size;	//! Slot size in bytes, multiple of 8; the shared region is slots*slot_size bytes.
+  uint32_t reserved;
+} DAEMON_HELLO;
+
+
+/**
+ * Request: (en|de)crypt in place the first length bytes of a slot
+ */
+typedef struct {
+  uint32_t id;			//! Client-chosen identifier, echoed in the completion.
+  uint32_t slot;		//! Ring slot holding the payload.
+  uint32_t length;		//! Payload length in bytes, multiple of 8 (ECB, no padding).
+  char direction;		//! 'e' or 'd'.
+  char reserved[3];
+} DAEMON_REQUEST;
+
+
+/**
+ * Completion notification, also sent (with id 0) as answer to the hello
+ */
+typedef struct {
+  uint32_t id;			//! Identifier of the completed request.
+  int32_t status;		//! 0 on success, an errno value otherwise.
+} DAEMON_COMPLETION;
+
+
+#endif
@@ -0,0 +1,77 @@
+/*
+digest.c:  Keyed plaintext checksum, computed in parallel.
+
+Every 8 bytes word of the plaintext is mixed with its position and the results are added: the sum does not depend on the order in which the words are seen, so every thread digests its own frames and the main thread adds the partial sums.
+The digest is then the same for any number of threads and frame size, and can be computed while encrypting (e) and checked while verifying (v).
+The final sum is encrypted with the key, as the chunk digests of chunked.c, so a stored digest reveals nothing about the plaintext to whoever does not have the key.
+It detects corruption and wrong keys, it is not a MAC: an attacker who knows the key can forge a plaintext with the same digest.
+*/
+
+#include <stdint.h>
+#include "digest.h"
+
+
+/**
+ * @brief 64 bits finalizer of MurmurHash3, every input bit affects every output bit
+ */
+static inline uint64_t mix(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDULL;
+	x ^= x >> 33;
+	x *= 0xC4CEB9FE1A85EC53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+
+/**
+ * @brief Add a piece of plaintext to a partial sum
+ *
+ * @param sum [in] Partial sum of the other pieces (0 to start)
+ * @param data [in] Plaintext
+ * @param length [in] Bytes of data, a multiple of 8 but for the last piece of the plaintext (zero extended)
+ * @param offset [in] Position of data in the plaintext, a multiple of 8
+ * @return The new partial sum
+ */
+uint64_t digest_update(uint64_t sum, const unsigned char *data, long length, long offset)
+{
+	uint64_t index = offset / 8;
+	long i = 0;
+	int b = 0;
+
+	for(i = 0; i + 8 <= length; i += 8, ++index)
+	{
+		uint64_t word = ((uint64_t)data[i] << 56) | ((uint64_t)data[i+1] << 48) | ((uint64_t)data[i+2] << 40) | ((uint64_t)data[i+3] << 32)
+		              | ((uint64_t)data[i+4] << 24) | ((uint64_t)data[i+5] << 16) | ((uint64_t)data[i+6] << 8) | (uint64_t)data[i+7];	// Big-endian, the same digest on every host
+		sum += mix(word ^ mix(index));
+	}
+
+	if(i < length)
+	{
+		uint64_t word = 0;
+		for(b = 0; i + b < length; ++b)
+		{
+			word |= (uint64_t)data[i + b] << (56 - 8*b);
+		}
+		sum += mix(word ^ mix(index));
+	}
+
+	return sum;
+}
+
+
+/**
+ * @brief Digest of the plaintext from the sum of all its pieces
+ *
+ * @param ctx [in] Context of the key
+ * @param engine [in] S-box lookup implementation
+ * @param sum [in] Sum of the partial sums of every piece
+ * @param length [in] Plaintext length in bytes (distinguishes trailing zeros)
+ * @return 64 bits digest
+ */
+uint64_t digest_final(const BLOWFISH_CTX *ctx, BLOWFISH_ENGINE engine, uint64_t sum, long length)
+{
+	uint64_t x = mix(sum ^ mix(~(uint64_t)length));
+	return (engine == BLOWFISH_ENGINE_CONSTANT_TIME) ? BlowfishEncryptionCT((BLOWFISH_CTX *)ctx, x) : BlowfishEncryption((BLOWFISH_CTX *)ctx, x);
+}
@@ -0,0 +1,16 @@
+/*
+digest.h:  Header file for digest.c
+*/
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stdint.h>
+#include "blowfish.h"
+
+
+uint64_t digest_update(uint64_t sum, const unsigned char *data, long length, long offset);
+uint64_t digest_final(const BLOWFISH_CTX *ctx, BLOWFISH_ENGINE engine, uint64_t sum, long length);
+
+
+#endif
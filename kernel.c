@@ -0,0 +1,359 @@
+/*
+kernel.c:  Specialized bulk kernels.
+
+Every combination of engine, direction, mode of operation and interleave width is instantiated from the same always-inline generic code with constant parameters, so that each kernel is compiled without any per-block test on the mode and with the rounds unrolled over width independent blocks (which hides the latency of the S-box loads), 16 / width rounds at a time so that the code size does not grow with the width.
+The kernel to be used is looked up once per job with Blowfish_SelectKernel().
+
+Kernels work on byte streams: each block is loaded as a big-endian 64 bits word (the byte order of the Blowfish specification and of the other implementations), on little-endian hosts the swap is a single bswap/movbe fused in the load and store, not a function call per block.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "kernel.h"
+
+#define N 16
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+
+/**
+ * @brief Load a big-endian 64 bits block
+ */
+ALWAYS_INLINE uint64_t load_be64(const unsigned char *p)
+{
+	uint64_t x;
+	memcpy(&x, p, 8);	// Unaligned safe, compiled to a plain load
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	x = __builtin_bswap64(x);
+#endif
+	return x;
+}
+
+
+/**
+ * @brief Store a 64 bits block in big-endian order
+ */
+ALWAYS_INLINE void store_be64(unsigned char *p, uint64_t x)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	x = __builtin_bswap64(x);
+#endif
+	memcpy(p, &x, 8);
+}
+
+
+/**
+ * @brief F function, table or constant-time lookups
+ * @see F() and F_ct() in blowfish.c
+ */
+ALWAYS_INLINE uint32_t kernel_F(const BLOWFISH_CTX *ctx, uint32_t x, int ct)
+{
+	if(!ct)
+	{
+		return ((ctx->S[0][x >> 24] + ctx->S[1][(x >> 16) & 0xFF]) ^ ctx->S[2][(x >> 8) & 0xFF]) + ctx->S[3][x & 0xFF];
+	}
+
+	uint32_t a = x >> 24, b = (x >> 16) & 0xFF, c = (x >> 8) & 0xFF, d = x & 0xFF;
+	uint32_t sa = 0, sb = 0, sc = 0, sd = 0;
+	uint32_t k;
+
+	for(k = 0; k < 256; ++k)
+	{
+		sa |= ctx->S[0][k] & (0 - (((k ^ a) - 1) >> 31));
+		sb |= ctx->S[1][k] & (0 - (((k ^ b) - 1) >> 31));
+		sc |= ctx->S[2][k] & (0 - (((k ^ c) - 1) >> 31));
+		sd |= ctx->S[3][k] & (0 - (((k ^ d) - 1) >> 31));
+	}
+	return ((sa + sb) ^ sc) + sd;
+}
+
+
+#define PRAGMA(x) _Pragma(#x)
+
+/**
+ * Round loop of kernel_rounds(), unrolled by rounds: 16 / width rounds give an unrolled body of 16 F evaluations at every width,
+ * enough independent S-box loads to hide their latency without the code size (and compile time) of 16 rounds times 8 blocks.
+ */
+#define KERNEL_ROUND_LOOP(rounds) \
+	PRAGMA(GCC unroll rounds) \
+	for(i = 0; i < N; ++i) \
+	{ \
+		PRAGMA(GCC unroll 8) \
+		for(w = 0; w < width; ++w) \
+		{ \
+			const BLOWFISH_CTX *c = ctx[shared ? 0 : w]; \
+			L[w] ^= c->P[decrypt ? (N + 1 - i) : i]; \
+			R[w] ^= kernel_F(c, L[w], ct); \
+			temp = L[w]; \
+			L[w] = R[w]; \
+			R[w] = temp; \
+		} \
+	}
+
+
+/**
+ * @brief Blowfish rounds on width interleaved blocks
+ *
+ * @param ctx [in] Context of each block, only ctx[0] is used when shared
+ * @param L [in,out] Left halves
+ * @param R [in,out] Right halves
+ * @param shared [in] 1 if all the blocks use ctx[0], 0 if every block has its own context (independent streams)
+ */
+ALWAYS_INLINE void kernel_rounds(const BLOWFISH_CTX *const *ctx, uint32_t *L, uint32_t *R, int width, int decrypt, int ct, int shared)
+{
+	uint32_t temp;
+	int i, w;
+
+	// width is a constant here, a single loop is compiled
+	if(width == 1)
+	{
+		KERNEL_ROUND_LOOP(16)
+	}
+	else if(width == 2)
+	{
+		KERNEL_ROUND_LOOP(8)
+	}
+	else if(width == 4)
+	{
+		KERNEL_ROUND_LOOP(4)
+	}
+	else
+	{
+		KERNEL_ROUND_LOOP(2)
+	}
+
+#pragma GCC unroll 8
+	for(w = 0; w < width; ++w)
+	{
+		const BLOWFISH_CTX *c = ctx[shared ? 0 : w];
+		temp = L[w];	// Undo the last swap while applying the output whitening
+		L[w] = R[w] ^ c->P[decrypt ? 0 : (N + 1)];
+		R[w] = temp ^ c->P[decrypt ? 1 : N];
+	}
+}
+
+
+/**
+ * @brief One step of the mode of operation over width consecutive blocks
+ *
+ * @param chain [in,out] CTR: counter of in[0]. CBC: ciphertext block preceding in[0].
+ */
+ALWAYS_INLINE void kernel_step(const BLOWFISH_CTX *ctx, const unsigned char *in, unsigned char *out, uint64_t *chain, int width, int decrypt, BLOWFISH_MODE mode, int ct)
+{
+	uint64_t C[KERNEL_WIDTH_MAX];	// Input blocks, saved because out may alias in
+	uint32_t L[KERNEL_WIDTH_MAX];
+	uint32_t R[KERNEL_WIDTH_MAX];
+	uint64_t x;
+	int w;
+
+#pragma GCC unroll 8
+	for(w = 0; w < width; ++w)
+	{
+		C[w] = load_be64(in + 8*w);
+		if(mode == BLOWFISH_CTR)
+		{
+			x = *chain + w;
+		}
+		else if((mode == BLOWFISH_CBC) && !decrypt)
+		{
+			x = C[w] ^ *chain;	// width is always 1 here
+		}
+		else
+		{
+			x = C[w];
+		}
+		L[w] = (uint32_t)(x >> 32);
+		R[w] = (uint32_t)x;
+	}
+
+	kernel_rounds(&ctx, L, R, width, decrypt && (mode != BLOWFISH_CTR), ct, 1);
+
+#pragma GCC unroll 8
+	for(w = 0; w < width; ++w)
+	{
+		x = ((uint64_t)L[w] << 32) | R[w];
+		if(mode == BLOWFISH_CTR)
+		{
+			x ^= C[w];
+		}
+		else if((mode == BLOWFISH_CBC) && decrypt)
+		{
+			x ^= (w ? C[w - 1] : *chain);
+		}
+		store_be64(out + 8*w, x);
+	}
+
+	if(mode == BLOWFISH_CTR)
+	{
+		*chain += width;
+	}
+	else if(mode == BLOWFISH_CBC)
+	{
+		*chain = decrypt ? C[width - 1] : x;
+	}
+}
+
+
+/**
+ * @brief Generic kernel, instantiated below with constant parameters
+ */
+ALWAYS_INLINE void kernel_generic(const BLOWFISH_CTX *ctx, const unsigned char *in, unsigned char *out, long blocks, uint64_t *iv, int width, int decrypt, BLOWFISH_MODE mode, int ct)
+{
+	uint64_t chain = (mode == BLOWFISH_ECB) ? 0 : *iv;
+	long n = 0;
+
+	for(n = 0; n + width <= blocks; n += width)
+	{
+		kernel_step(ctx, in + 8*n, out + 8*n, &chain, width, decrypt, mode, ct);
+	}
+
+	for(; n < blocks; ++n)
+	{
+		kernel_step(ctx, in + 8*n, out + 8*n, &chain, 1, decrypt, mode, ct);	// Tail shorter than width
+	}
+
+	if(mode != BLOWFISH_ECB)
+	{
+		*iv = chain;
+	}
+	chain = 0;
+}
+
+
+#define KERNEL(name, width, decrypt, mode, ct) \
+	static void name(const BLOWFISH_CTX *ctx, const unsigned char *in, unsigned char *out, long blocks, uint64_t *iv) \
+	{ \
+		kernel_generic(ctx, in, out, blocks, iv, width, decrypt, mode, ct); \
+	}
+
+#define KERNEL_WIDTHS(name, decrypt, mode, ct) \
+	KERNEL(name##_1, 1, decrypt, mode, ct) \
+	KERNEL(name##_2, 2, decrypt, mode, ct) \
+	KERNEL(name##_4, 4, decrypt, mode, ct) \
+	KERNEL(name##_8, 8, decrypt, mode, ct)
+
+#define KERNEL_TABLE_ROW(name) { name##_1, name##_2, name##_4, name##_8 }
+
+KERNEL_WIDTHS(table_enc_ecb, 0, BLOWFISH_ECB, 0)
+KERNEL_WIDTHS(table_dec_ecb, 1, BLOWFISH_ECB, 0)
+KERNEL_WIDTHS(table_ctr, 0, BLOWFISH_CTR, 0)
+KERNEL(table_enc_cbc_1, 1, 0, BLOWFISH_CBC, 0)
+KERNEL_WIDTHS(table_dec_cbc, 1, BLOWFISH_CBC, 0)
+
+KERNEL_WIDTHS(ct_enc_ecb, 0, BLOWFISH_ECB, 1)
+KERNEL_WIDTHS(ct_dec_ecb, 1, BLOWFISH_ECB, 1)
+KERNEL_WIDTHS(ct_ctr, 0, BLOWFISH_CTR, 1)
+KERNEL(ct_enc_cbc_1, 1, 0, BLOWFISH_CBC, 1)
+KERNEL_WIDTHS(ct_dec_cbc, 1, BLOWFISH_CBC, 1)
+
+
+/**
+ * @brief Generic lane kernel: CBC encryption of width independent streams, one block of each stream per step
+ *
+ * Every stream is serial, but the blocks of different streams are independent, so they fill the pipeline as the blocks of one stream do in ECB.
+ */
+ALWAYS_INLINE void lane_generic(const BLOWFISH_CTX *const *ctx, const unsigned char *const *in, unsigned char *const *out, uint64_t *chain, long blocks, int width, int ct)
+{
+	uint32_t L[KERNEL_WIDTH_MAX];
+	uint32_t R[KERNEL_WIDTH_MAX];
+	uint64_t x;
+	long n;
+	int w;
+
+	for(n = 0; n < blocks; ++n)
+	{
+#pragma GCC unroll 8
+		for(w = 0; w < width; ++w)
+		{
+			x = load_be64(in[w] + 8*n) ^ chain[w];
+			L[w] = (uint32_t)(x >> 32);
+			R[w] = (uint32_t)x;
+		}
+
+		kernel_rounds(ctx, L, R, width, 0, ct, 0);
+
+#pragma GCC unroll 8
+		for(w = 0; w < width; ++w)
+		{
+			chain[w] = ((uint64_t)L[w] << 32) | R[w];
+			store_be64(out[w] + 8*n, chain[w]);
+		}
+	}
+}
+
+
+#define LANE_KERNEL(name, width, ct) \
+	static void name(const BLOWFISH_CTX *const *ctx, const unsigned char *const *in, unsigned char *const *out, uint64_t *chain, long blocks) \
+	{ \
+		lane_generic(ctx, in, out, chain, blocks, width, ct); \
+	}
+
+LANE_KERNEL(table_lanes_1, 1, 0)
+LANE_KERNEL(table_lanes_2, 2, 0)
+LANE_KERNEL(table_lanes_4, 4, 0)
+LANE_KERNEL(table_lanes_8, 8, 0)
+LANE_KERNEL(ct_lanes_1, 1, 1)
+LANE_KERNEL(ct_lanes_2, 2, 1)
+LANE_KERNEL(ct_lanes_4, 4, 1)
+LANE_KERNEL(ct_lanes_8, 8, 1)
+
+
+/**
+ * Lane kernel table indexed by [engine][width]
+ */
+static const BLOWFISH_LANE_KERNEL lane_kernels[2][4] = {
+	{ table_lanes_1, table_lanes_2, table_lanes_4, table_lanes_8 },
+	{ ct_lanes_1, ct_lanes_2, ct_lanes_4, ct_lanes_8 }
+};
+
+
+/**
+ * Kernel table indexed by [engine][direction][mode][width]
+ * CBC encryption is serial (each block needs the previous ciphertext), so its row holds the width 1 kernel only.
+ */
+static const BLOWFISH_KERNEL kernels[2][2][3][4] = {
+	{
+		{ KERNEL_TABLE_ROW(table_enc_ecb), KERNEL_TABLE_ROW(table_ctr), { table_enc_cbc_1, table_enc_cbc_1, table_enc_cbc_1, table_enc_cbc_1 } },
+		{ KERNEL_TABLE_ROW(table_dec_ecb), KERNEL_TABLE_ROW(table_ctr), KERNEL_TABLE_ROW(table_dec_cbc) }
+	},
+	{
+		{ KERNEL_TABLE_ROW(ct_enc_ecb), KERNEL_TABLE_ROW(ct_ctr), { ct_enc_cbc_1, ct_enc_cbc_1, ct_enc_cbc_1, ct_enc_cbc_1 } },
+		{ KERNEL_TABLE_ROW(ct_dec_ecb), KERNEL_TABLE_ROW(ct_ctr), KERNEL_TABLE_ROW(ct_dec_cbc) }
+	}
+};
+
+
+/**
+ * @brief Index of a width in the kernel tables, rounded down to 1, 2, 4 or 8
+ */
+static int width_index(int width)
+{
+	return (width >= 8) ? 3 : (width >= 4) ? 2 : (width >= 2) ? 1 : 0;
+}
+
+
+/**
+ * @brief Pick the kernel for a job
+ *
+ * @param engine [in] S-box lookup implementation
+ * @param direction [in] 'e' to encrypt, 'd' to decrypt
+ * @param mode [in] Mode of operation
+ * @param width [in] Blocks interleaved per step, rounded down to 1, 2, 4 or 8
+ * @return Kernel function
+ */
+BLOWFISH_KERNEL Blowfish_SelectKernel(BLOWFISH_ENGINE engine, char direction, BLOWFISH_MODE mode, int width)
+{
+	return kernels[engine == BLOWFISH_ENGINE_CONSTANT_TIME][direction == 'd'][mode][width_index(width)];
+}
+
+
+/**
+ * @brief Pick the lane kernel for multi-stream CBC encryption
+ *
+ * @param engine [in] S-box lookup implementation
+ * @param width [in] Streams interleaved per step, must be 1, 2, 4 or 8
+ * @return Lane kernel function
+ */
+BLOWFISH_LANE_KERNEL Blowfish_SelectLaneKernel(BLOWFISH_ENGINE engine, int width)
+{
+	return lane_kernels[engine == BLOWFISH_ENGINE_CONSTANT_TIME][width_index(width)];
+}
@@ -0,0 +1,45 @@
+/*
+kernel.h:  Header file for kernel.c
+*/
+
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include <stdint.h>
+#include "blowfish.h"
+
+
+#define KERNEL_WIDTH_MAX 8		//! Maximum number of blocks interleaved in one kernel step.
+#define KERNEL_WIDTH_DEFAULT 4	//! Interleave width used when there is no reason to pick another one.
+
+
+/**
+ * Mode of operation
+ */
+typedef enum {
+  BLOWFISH_ECB,		//! Electronic codebook, every block on its own (the file format of e/d).
+  BLOWFISH_CTR,		//! Counter mode, the iv is the counter of the first block (encryption and decryption are the same).
+  BLOWFISH_CBC		//! Cipher block chaining, the iv is the previous ciphertext block.
+} BLOWFISH_MODE;
+
+
+/**
+ * Bulk kernel: processes blocks 8 bytes blocks from in to out (they may be the same buffer, no alignment required).
+ * Bytes are taken in big-endian order as in the Blowfish specification, so the ciphertext is the same on every host and interoperable with other implementations.
+ * iv is ignored in ECB, in CTR and CBC it is read as the chaining value (a 64 bits number) and updated, so that consecutive calls continue the same stream.
+ */
+typedef void (*BLOWFISH_KERNEL)(const BLOWFISH_CTX *ctx, const unsigned char *in, unsigned char *out, long blocks, uint64_t *iv);
+
+
+/**
+ * Lane kernel: CBC encryption of width independent streams at once, blocks 8 bytes blocks of each.
+ * The stream of lane w goes from in[w] to out[w] with its own context ctx[w], chain[w] is its chaining value (previous ciphertext block) and is updated as in BLOWFISH_KERNEL.
+ */
+typedef void (*BLOWFISH_LANE_KERNEL)(const BLOWFISH_CTX *const *ctx, const unsigned char *const *in, unsigned char *const *out, uint64_t *chain, long blocks);
+
+
+BLOWFISH_KERNEL Blowfish_SelectKernel(BLOWFISH_ENGINE engine, char direction, BLOWFISH_MODE mode, int width);
+BLOWFISH_LANE_KERNEL Blowfish_SelectLaneKernel(BLOWFISH_ENGINE engine, int width);
+
+
+#endif
@@ -0,0 +1,506 @@
+/*
+keysearch.c:  Known-plaintext key search, for authorized audits of weak or legacy keys.
+
+Usage: blowfish-keysearch plaintext_hex ciphertext_hex max_threads (--wordlist=file | --mask=mask)
+
+plaintext_hex and ciphertext_hex are one or more known ECB blocks (16 hex digits each, big-endian as written by blowfish-multithread).
+Mask: ?l lowercase, ?u uppercase, ?d digit, ?s symbol, ?a any printable, ?? a literal '?', any other character is literal.
+
+Almost all the time goes in the key schedule (521 encryptions per key), so candidates are expanded BLOWFISH_BATCH_MAX at a time with Blowfish_InitBatch() and tested on the first block only; the remaining blocks are checked just for the (rare) candidates passing the first one.
+The candidate space is split in one range per thread, a thread that empties its range steals half of the largest remaining one, so uneven progress never leaves cores idle.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "blowfish.h"
+#include "kernel.h"
+
+
+#define KEY_MAX 56				//! Longest Blowfish key in bytes.
+#define MASK_MAX KEY_MAX		//! Longest mask in positions.
+
+
+/**
+ * Candidate range owned by a thread, [next, end)
+ */
+typedef struct {
+	uint64_t next;				//! Next candidate to be tested.
+	uint64_t end;				//! End of the range (excluded).
+	pthread_mutex_t mutex;		//! Protects the range against thieves.
+	char padding[64];			//! Keep the ranges on different cache lines.
+} WORK_RANGE;
+
+
+static unsigned char *plaintext;		//! Known plaintext blocks.
+static unsigned char *ciphertext;		//! Matching ciphertext blocks.
+static long blocks;						//! Number of known blocks.
+
+static const char *charsets[MASK_MAX];	//! Mask mode: characters allowed at each position.
+static int charset_sizes[MASK_MAX];		//! Mask mode: size of each charset.
+static int mask_length;					//! Mask mode: number of positions (0 in wordlist mode).
+
+static const char *words;				//! Wordlist mode: mapped file.
+static uint64_t *word_offsets;			//! Wordlist mode: start of each word.
+static int *word_lengths;				//! Wordlist mode: length of each word.
+
+static uint64_t candidates;				//! Size of the candidate space.
+static WORK_RANGE *ranges;				//! One range per thread.
+static int max_threads;					//! Thread number to be used.
+static volatile int found;				//! Set when the key is found, stops every thread.
+static char found_key[KEY_MAX + 1];		//! The key found, written only by the thread setting found (read after the join).
+static uint64_t tested;					//! Candidates tested (approximate while running).
+
+static const char lower[] = "abcdefghijklmnopqrstuvwxyz";
+static const char upper[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+static const char digits[] = "0123456789";
+static const char symbols[] = " !\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~";
+static const char printable[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 !\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~";
+static const char literal_question[] = "?";
+
+
+/**
+ * @brief Decode a hex string
+ *
+ * @return Number of bytes, -1 on malformed input (bytes is then NULL)
+ */
+static long parse_hex(const char *hex, unsigned char **bytes)
+{
+	long length = strlen(hex);
+	long i = 0;
+
+	*bytes = NULL;
+	if((length == 0) || (length%16 != 0))
+	{
+		return -1;
+	}
+	*bytes = (unsigned char *) malloc(length/2);
+	if(*bytes == NULL)
+	{
+		perror("Failed to allocate memory, exiting");
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < length/2; ++i)
+	{
+		unsigned int byte;
+		if(!isxdigit((unsigned char)hex[2*i]) || !isxdigit((unsigned char)hex[2*i + 1]) || (sscanf(hex + 2*i, "%2x", &byte) != 1))
+		{
+			free(*bytes);
+			*bytes = NULL;
+			return -1;
+		}
+		(*bytes)[i] = (unsigned char)byte;
+	}
+	return length/2;
+}
+
+
+/**
+ * @brief Parse the mask and compute the candidate space size
+ *
+ * @return 0 on success, -1 on malformed mask or candidate space above 2^64
+ */
+static int parse_mask(const char *mask)
+{
+	candidates = 1;
+	mask_length = 0;
+
+	while(*mask != '\0')
+	{
+		if(mask_length == MASK_MAX)
+		{
+			return -1;
+		}
+
+		const char *charset = NULL;
+		if(mask[0] == '?')
+		{
+			switch(mask[1])
+			{
+				case 'l': charset = lower; break;
+				case 'u': charset = upper; break;
+				case 'd': charset = digits; break;
+				case 's': charset = symbols; break;
+				case 'a': charset = printable; break;
+				case '?': charset = literal_question; break;
+				default: return -1;
+			}
+			mask += 2;
+		}
+		else
+		{
+			charset = mask;	// Literal: a charset of one character, the mask itself
+			mask += 1;
+		}
+
+		charsets[mask_length] = charset;
+		charset_sizes[mask_length] = (charset == mask - 1) ? 1 : (int)strlen(charset);
+		if(candidates > UINT64_MAX / charset_sizes[mask_length])
+		{
+			return -1;
+		}
+		candidates *= charset_sizes[mask_length];
+		mask_length++;
+	}
+
+	return (mask_length > 0) ? 0 : -1;
+}
+
+
+/**
+ * @brief Map the wordlist and index its lines
+ *
+ * @return 0 on success, -1 on error
+ */
+static int load_wordlist(const char *filename)
+{
+	struct stat file_stat;
+	uint64_t i = 0, start = 0, capacity = 1024;
+	int fd = open(filename, O_RDONLY);
+
+	if(fd < 0)
+	{
+		return -1;
+	}
+	if(fstat(fd, &file_stat) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	if(file_stat.st_size == 0)
+	{
+		close(fd);
+		candidates = 0;
+		return 0;
+	}
+
+	words = (const char *) mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(words == MAP_FAILED)
+	{
+		return -1;
+	}
+
+	word_offsets = (uint64_t *) malloc(capacity * sizeof(uint64_t));
+	word_lengths = (int *) malloc(capacity * sizeof(int));
+	candidates = 0;
+
+	for(i = 0; i <= (uint64_t)file_stat.st_size; ++i)
+	{
+		if((i < (uint64_t)file_stat.st_size) && (words[i] != '\n'))
+		{
+			continue;
+		}
+
+		uint64_t end = i;
+		if((end > start) && (words[end - 1] == '\r'))
+		{
+			end--;
+		}
+		if((end > start) && (end - start <= KEY_MAX))	// Blowfish keys are 1 to 56 bytes, longer lines cannot be keys
+		{
+			if(candidates == capacity)
+			{
+				capacity *= 2;
+				word_offsets = (uint64_t *) realloc(word_offsets, capacity * sizeof(uint64_t));
+				word_lengths = (int *) realloc(word_lengths, capacity * sizeof(int));
+			}
+			word_offsets[candidates] = start;
+			word_lengths[candidates] = end - start;
+			candidates++;
+		}
+		start = i + 1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Build candidate number index
+ *
+ * @param index [in] Candidate number, below candidates
+ * @param key [out] Key buffer, KEY_MAX bytes
+ * @return Key length
+ */
+static int candidate_key(uint64_t index, unsigned char *key)
+{
+	int position = 0;
+
+	if(mask_length == 0)
+	{
+		memcpy(key, words + word_offsets[index], word_lengths[index]);
+		return word_lengths[index];
+	}
+
+	for(position = mask_length - 1; position >= 0; --position)	// Last position varies fastest
+	{
+		key[position] = (unsigned char)charsets[position][index % charset_sizes[position]];
+		index /= charset_sizes[position];
+	}
+	return mask_length;
+}
+
+
+/**
+ * @brief Take up to count candidates, from the own range or else stolen from the largest one
+ *
+ * @return Number of candidates taken, starting at *first (0 when the search is over)
+ */
+static int take_work(int thread_number, uint64_t *first, int count)
+{
+	WORK_RANGE *own = &ranges[thread_number];
+	int victim = 0;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&own->mutex);
+			uint64_t available = own->end - own->next;
+			if(available > 0)
+			{
+				if(available < (uint64_t)count)
+				{
+					count = (int)available;
+				}
+				*first = own->next;
+				own->next += count;
+			}
+		pthread_mutex_unlock(&own->mutex);
+
+		if(available > 0)
+		{
+			return count;
+		}
+		if(found)
+		{
+			return 0;
+		}
+
+		// Own range empty: look for the largest remaining range
+		uint64_t largest = 0;
+		int best = -1;
+		for(victim = 0; victim < max_threads; ++victim)
+		{
+			uint64_t remaining = ranges[victim].end - ranges[victim].next;	// Racy read, only a hint
+			if((victim != thread_number) && (remaining > largest))
+			{
+				largest = remaining;
+				best = victim;
+			}
+		}
+		if(best < 0)
+		{
+			return 0;	// Nothing left anywhere
+		}
+
+		// Steal the upper half of the victim range
+		pthread_mutex_lock(&ranges[best].mutex);
+			uint64_t remaining = ranges[best].end - ranges[best].next;
+			uint64_t stolen_start = ranges[best].next + remaining/2;
+			uint64_t stolen_end = ranges[best].end;
+			if(remaining > 1)
+			{
+				ranges[best].end = stolen_start;
+			}
+		pthread_mutex_unlock(&ranges[best].mutex);
+
+		if(remaining > 1)
+		{
+			pthread_mutex_lock(&own->mutex);
+				own->next = stolen_start;
+				own->end = stolen_end;
+			pthread_mutex_unlock(&own->mutex);
+		}
+		else if(remaining == 0)
+		{
+			continue;	// Victim drained meanwhile, look again
+		}
+		else
+		{
+			sched_yield();	// A single candidate left, its owner will test it
+		}
+	}
+}
+
+
+/**
+ * @brief Search thread function
+ *
+ * @param args Thread number.
+ */
+static void *search_thread(void *args)
+{
+	int thread_number = *((int *)args);
+	BLOWFISH_CTX *ctx = (BLOWFISH_CTX *) malloc(BLOWFISH_BATCH_MAX * sizeof(BLOWFISH_CTX));
+	BLOWFISH_KERNEL encrypt = Blowfish_SelectKernel(BLOWFISH_ENGINE_TABLE, 'e', BLOWFISH_ECB, KERNEL_WIDTH_DEFAULT);
+	unsigned char key_buffers[BLOWFISH_BATCH_MAX][KEY_MAX];
+	unsigned char *keys[BLOWFISH_BATCH_MAX];
+	int key_lengths[BLOWFISH_BATCH_MAX];
+	unsigned char block[8];
+	uint64_t first = 0;
+	uint64_t local_tested = 0;
+	int count = 0, c = 0;
+
+	if(ctx == NULL)
+	{
+		perror("Failed to allocate memory, exiting");
+		exit(EXIT_FAILURE);
+	}
+	for(c = 0; c < BLOWFISH_BATCH_MAX; ++c)
+	{
+		keys[c] = key_buffers[c];
+	}
+
+	while(!found && ((count = take_work(thread_number, &first, BLOWFISH_BATCH_MAX)) > 0))
+	{
+		for(c = 0; c < count; ++c)
+		{
+			key_lengths[c] = candidate_key(first + c, keys[c]);
+		}
+
+		Blowfish_InitBatch(ctx, keys, key_lengths, count);
+
+		for(c = 0; c < count; ++c)
+		{
+			encrypt(&ctx[c], plaintext, block, 1, NULL);	// Early test on the first block
+			if(memcmp(block, ciphertext, 8) != 0)
+			{
+				continue;
+			}
+
+			long b = 1;
+			for(b = 1; b < blocks; ++b)
+			{
+				encrypt(&ctx[c], plaintext + 8*b, block, 1, NULL);
+				if(memcmp(block, ciphertext + 8*b, 8) != 0)
+				{
+					break;
+				}
+			}
+
+			if((b == blocks) && __sync_bool_compare_and_swap(&found, 0, 1))
+			{
+				// First match only: another thread may find a key at the same time (several keys can fit few blocks)
+				memcpy(found_key, keys[c], key_lengths[c]);
+				found_key[key_lengths[c]] = '\0';
+			}
+		}
+		local_tested += count;
+	}
+
+	__sync_fetch_and_add(&tested, local_tested);
+
+	// For security reasons overwrite memory before exiting
+	memset(ctx, 0, BLOWFISH_BATCH_MAX * sizeof(BLOWFISH_CTX));
+	memset(key_buffers, 0, sizeof(key_buffers));
+	free(ctx);
+	pthread_exit(NULL);
+}
+
+
+int main(int argc, char **argv)
+{
+	struct timespec start, end;
+	int i = 0;
+
+	if(argc != 5)
+	{
+		perror("Usage: blowfish-keysearch plaintext_hex ciphertext_hex max_threads (--wordlist=file | --mask=mask)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	blocks = parse_hex(argv[1], &plaintext);
+	if((blocks < 0) || (parse_hex(argv[2], &ciphertext) != blocks))
+	{
+		perror("Plaintext and ciphertext must be the same number of 16 hex digits blocks\n");
+		exit(EXIT_FAILURE);
+	}
+	blocks /= 8;
+
+	max_threads = atoi(argv[3]);
+	if(max_threads < 1)
+	{
+		perror("The number of threads must be greater than zero\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(strncmp(argv[4], "--wordlist=", 11) == 0)
+	{
+		if(load_wordlist(argv[4] + 11) != 0)
+		{
+			perror("Problem reading the wordlist\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	else if(strncmp(argv[4], "--mask=", 7) == 0)
+	{
+		if(parse_mask(argv[4] + 7) != 0)
+		{
+			perror("Wrong mask\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	else
+	{
+		perror("Missing --wordlist or --mask\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Initial split of the candidate space, one contiguous range per thread
+	ranges = (WORK_RANGE *) aligned_alloc(64, ((max_threads * sizeof(WORK_RANGE) + 63) / 64) * 64);
+	pthread_t *thread_pool = (pthread_t *) malloc(max_threads * sizeof(pthread_t));
+	int *thread_args = (int *) malloc(max_threads * sizeof(int));
+	if((ranges == NULL) || (thread_pool == NULL) || (thread_args == NULL))
+	{
+		perror("Failed to allocate memory, exiting");
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < max_threads; ++i)
+	{
+		ranges[i].next = candidates / max_threads * i;
+		ranges[i].end = (i == max_threads - 1) ? candidates : candidates / max_threads * (i + 1);
+		pthread_mutex_init(&ranges[i].mutex, NULL);
+		thread_args[i] = i;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for(i = 0; i < max_threads; ++i)
+	{
+		if(pthread_create(&thread_pool[i], NULL, search_thread, &thread_args[i]) != 0)
+		{
+			perror("Thread creation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for(i = 0; i < max_threads; ++i)
+	{
+		pthread_join(thread_pool[i], NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	if(found)
+	{
+		printf("Key found: %s\n", found_key);
+	}
+	else
+	{
+		printf("Key not found\n");
+	}
+	printf("Tested %llu of %llu candidates in %f seconds, %.0f keys/sec\n", (unsigned long long)tested, (unsigned long long)candidates, seconds, (seconds > 0) ? tested / seconds : 0.0);	// A tiny search can end within the clock resolution
+
+	memset(found_key, 0, sizeof(found_key));
+	free(thread_pool);
+	free(thread_args);
+	exit(found ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,136 @@
+/*
+loadgen.c:  Load generator for blowfish-daemon.
+
+Usage: blowfish-loadgen socket_path payload_size requests [in_flight]
+
+Keeps in_flight encryption requests of payload_size bytes outstanding until requests have completed, then prints the latency percentiles (submission to completion) and the throughput.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "client.h"
+
+
+/**
+ * @brief Current monotonic time in nanoseconds
+ */
+static int64_t now(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+
+static int compare_latency(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+
+int main(int argc, char **argv)
+{
+	CLIENT client;
+	DAEMON_COMPLETION completion;
+
+	if(argc < 4)
+	{
+		perror("Usage: blowfish-loadgen socket_path payload_size requests [in_flight]\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t payload_size = (uint32_t)atol(argv[2]);
+	long requests = atol(argv[3]);
+	uint32_t in_flight = (argc > 4) ? (uint32_t)atol(argv[4]) : 1;
+	long submitted = 0;
+	long completed = 0;
+	uint32_t slot = 0;
+
+	payload_size -= payload_size%8;
+	if((payload_size == 0) || (requests < 1) || (in_flight < 1) || (in_flight > DAEMON_MAX_SLOTS))
+	{
+		perror("Wrong arguments\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int64_t *latencies = (int64_t *) malloc(requests * sizeof(int64_t));	//! Latency of every request in nanoseconds.
+	int64_t *submit_time = (int64_t *) malloc(in_flight * sizeof(int64_t));	//! Submission time of the request in each slot.
+	if((latencies == NULL) || (submit_time == NULL))
+	{
+		perror("Failed to allocate memory, exiting");
+		exit(EXIT_FAILURE);
+	}
+
+	if(client_connect(&client, argv[1], in_flight, payload_size) != 0)
+	{
+		perror("Problem connecting to the daemon\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Sanity check: a round trip through the daemon must give back the original payload
+	for(slot = 0; slot < payload_size; ++slot)
+	{
+		client_slot(&client, 0)[slot] = (unsigned char)slot;
+	}
+	client_submit(&client, 0, 0, payload_size, 'e');
+	client_wait(&client, &completion);
+	client_submit(&client, 0, 0, payload_size, 'd');
+	client_wait(&client, &completion);
+	for(slot = 0; slot < payload_size; ++slot)
+	{
+		if(client_slot(&client, 0)[slot] != (unsigned char)slot)
+		{
+			perror("Round trip mismatch\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	int64_t start = now();
+
+	for(slot = 0; (slot < in_flight) && (submitted < requests); ++slot, ++submitted)
+	{
+		submit_time[slot] = now();
+		client_submit(&client, slot, slot, payload_size, 'e');
+	}
+
+	while(completed < requests)
+	{
+		if(client_wait(&client, &completion) != 0)
+		{
+			perror("Connection lost\n");
+			exit(EXIT_FAILURE);
+		}
+		if(completion.status != 0)
+		{
+			fprintf(stderr, "Request failed: %s\n", strerror(completion.status));
+			exit(EXIT_FAILURE);
+		}
+
+		latencies[completed++] = now() - submit_time[completion.id];
+
+		if(submitted < requests)
+		{
+			// The slot (and id) of the completed request is free again
+			submit_time[completion.id] = now();
+			client_submit(&client, completion.id, completion.id, payload_size, 'e');
+			submitted++;
+		}
+	}
+
+	double seconds = (now() - start) / 1e9;
+	qsort(latencies, requests, sizeof(int64_t), compare_latency);
+
+	printf("requests=%ld payload=%u in_flight=%u\n", requests, payload_size, in_flight);
+	printf("p50=%.1fus p99=%.1fus max=%.1fus\n", latencies[requests / 2] / 1e3, latencies[(requests * 99) / 100] / 1e3, latencies[requests - 1] / 1e3);
+	printf("%.0f requests/s, %.1f MB/s\n", requests / seconds, requests * (double)payload_size / seconds / 1e6);
+
+	client_close(&client);
+	free(latencies);
+	free(submit_time);
+	return 0;
+}
@@ -5,120 +5,253 @@
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <string.h>	// for memset()
+#include <fcntl.h>
+#include "arena.h"
 #include "blowfish.h"
+#include "chunked.h"
+#include "cpu.h"
+#include "digest.h"
+#include "profile.h"
+#include "kernel.h"
+#include "writer.h"
 #include "debug.h"
 
 #define BENCHMARK
 
+#define REKEY_SLICE (16L << 10)	//! Bytes decrypted then re-encrypted at a time when re-keying, so that both passes find the data in the L1 cache.
 
 
-char mode;					//! Mode flag for Enc/Dec.
-int max_threads;			//! Thread number to be used.
-int *thread_args;			//! Threads argument array.
-							//! Composed of one entry per thread in which the thread number is stored, the reference to the entry will be passed to the thread. Ex: {0,1,2,3,4,5,6,7} 
-							
-long int input_file_length;	//! Input file length in bytes.
-long int block_size;		//! Block size in bytes.
-							//! The input file is divided in blocks, one per thread, this is always a multiple of the Blowfish's block size (8 bytes), the remaining bytes will be handled by the main thread.
-							
-long int frame_number;		//! Number of frames per block.
-							//! Each block is subdivided in frames which will be buffered in RAM to gain betteer performances.
-							//! This is always a multiple of 8, so that the resulting frame size is aligned to the Blowfish's block size (8 bytes).
-							
-long int frame_size;		//! Frame size in bytes.
-							//! This is always a multiple of 8.
-							
-const int frame_threshold = 2000000;	//! Maximum size of a frame.
 
-FILE *input_file;	//! Input file descriptor.
-FILE *output_file;	//! Output file descriptor.
+/**
+ * Job descriptor
+ * Written by the main thread while setting up the job, read-only once the threads start: it sits on cache lines of its own (no thread writes near it) and is shared by all the threads without any coherence traffic.
+ */
+typedef struct {
+	char mode;					//! Mode flag for Enc/Dec.
+	int max_threads;			//! Thread number to be used.
+	
+	long int input_file_length;	//! Input file length in bytes.
+	long int data_length;		//! Bytes (en|de)crypted by the threads and the reminder loop.
+								//! The whole input when encrypting, the input without its last (padded) block when decrypting: that block is decrypted first, alone, to know the output length.
+	long int output_file_length;	//! Output file length in bytes, known before the threads start so that the output is allocated once and every byte is written at its final position.
+	long int block_size;		//! Block size in bytes.
+								//! The input file is divided in blocks, one per thread, this is always a multiple of the Blowfish's block size (8 bytes), the remaining bytes will be handled by the main thread.
+	long int frame_number;		//! Number of frames per block.
+								//! Each block is subdivided in frames which will be buffered in RAM to gain betteer performances.
+	long int frame_size;		//! Frame size in bytes.
+								//! This is always a multiple of WRITER_ALIGNMENT (so of the Blowfish's block size too), the last frame of a block may be shorter.
+	long int frame_threshold;	//! Maximum size of a frame, --frame-size=bytes.
+	
+	FILE *input_file;			//! Input file descriptor, read with pread() at absolute positions (no shared cursor, no lock).
+	FILE *output_file;			//! Output file descriptor.
+	WRITER writer;				//! Writer of the output file, the threads write their frames through it at absolute positions (no shared cursor).
+	WRITER_SYNC output_sync;	//! Durability of the output, --fsync to fsync() it before exiting.
+	
+	BLOWFISH_CTX *ctx;			//! Context for the Blowfish algorithm generated using the provided key.
+	BLOWFISH_ENGINE engine;		//! S-box lookup implementation, selected with --engine=(table|ct).
+	BLOWFISH_KERNEL kernel;		//! ECB kernel for the selected mode and engine, chosen once before the threads start (decryption when re-keying).
+	BLOWFISH_CTX *new_ctx;		//! Context of the new key when re-keying, NULL otherwise.
+	BLOWFISH_KERNEL new_kernel;	//! ECB encryption kernel applied with new_ctx after kernel when re-keying.
+	int private_ctx;			//! 1 if every worker works on its own copy of the context (NUMA machines), see Blowfish_thread().
+	int digest;					//! 1 to compute the plaintext digest (always when verifying, --digest otherwise).
+	int profile;				//! 1 to count the hardware events of the phases of every thread, --profile.
+} JOB;
+
 
-BLOWFISH_CTX *ctx;	//! Context for the Blowfish algorithm generated using the provided key.
+/**
+ * Per-worker state
+ * Each worker owns whole cache lines (the structures are aligned and padded to ARENA_ALIGNMENT), so the cursor updates of a worker never invalidate the lines of another one.
+ */
+typedef struct {
+	int number;					//! Thread number, which correspond also to block number.
+	pthread_t thread;			//! Thread running the worker.
+	unsigned char *buffer;		//! Frame buffer, taken from the arena.
+	WRITER_CURSOR cursor;		//! Write-back progress of the block.
+	uint64_t digest;			//! Partial digest sum of the plaintext of the block, see digest.c.
+	PROFILE profile;			//! Counters of the thread phases with --profile, see profile.c.
+} __attribute__((aligned(ARENA_ALIGNMENT))) WORKER;
 
-pthread_mutex_t read_mutex;		//! Mutex to protect frame reading
-								//! There is the need of protection even if the frames are non-overlapping because the file cursor is only one and global, so the fseek() calls would interfere with each others.
-								
-pthread_mutex_t write_mutex;	//! Mutex to protect frame writing
-								//! There is the need of protection even if the frames are non-overlapping because the file cursor is only one and global, so the fseek() calls would interfere with each others.
 
+JOB job __attribute__((aligned(ARENA_ALIGNMENT))) = {	//! The job, see JOB.
+	.frame_threshold = 2000000,
+	.output_sync = WRITER_SYNC_NONE,
+	.engine = BLOWFISH_ENGINE_DEFAULT
+};
+WORKER *workers;			//! One entry per thread, taken from the arena.
+ARENA arena;				//! Huge-page arena holding the context, the workers and the frame buffers, zeroized on release.
+
+
+static inline void compute_frame_parameters(void);
+static inline void compute_block_size(void);
+
+/**
+ * @brief Read exactly length bytes of the input at offset
+ * pread() does not move the file cursor, so the threads read their frames concurrently without any lock.
+ */
+static void read_input(unsigned char *buffer, long int length, long int offset)
+{
+	while(length > 0)
+	{
+		ssize_t result = pread(fileno(job.input_file), buffer, length, offset);
+		if(result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(result <= 0)
+		{
+			perror("Reading error\n");
+			exit(EXIT_FAILURE);
+		}
+		buffer += result;
+		offset += result;
+		length -= result;
+	}
+}
+
+
+/**
+ * @brief (En|de)crypt a buffer in place, when re-keying decrypt it with the old key and encrypt it again with the new one, one slice at a time
+ *
+ * @param ctx [in] Context of the key (old key when re-keying)
+ * @param new_ctx [in] Context of the new key, NULL if not re-keying
+ */
+static void crypt_buffer(const BLOWFISH_CTX *ctx, const BLOWFISH_CTX *new_ctx, unsigned char *buffer, long int length)
+{
+	long int slice = 0;
+	
+	if(new_ctx == NULL)
+	{
+		job.kernel(ctx, buffer, buffer, length/8, NULL);
+		return;
+	}
+	
+	for(slice = 0; slice < length; slice += REKEY_SLICE)
+	{
+		long int slice_length = (length - slice < REKEY_SLICE) ? length - slice : REKEY_SLICE;
+		job.kernel(ctx, buffer + slice, buffer + slice, slice_length/8, NULL);	// The plaintext never leaves this buffer
+		job.new_kernel(new_ctx, buffer + slice, buffer + slice, slice_length/8, NULL);
+	}
+}
+
+
+/**
+ * @brief Write out (en|de)crypted data at its final position, nothing when verifying (the plaintext never reaches the disk)
+ */
+static void write_output(WRITER_CURSOR *cursor, const unsigned char *buffer, long int length, long int offset)
+{
+	if(job.mode == 'v')
+	{
+		return;
+	}
+	if(writer_write(&job.writer, cursor, buffer, length, offset) != 0)
+	{
+		perror("Writing error\n");
+		exit(EXIT_FAILURE);
+	}
+}
 
-inline void compute_frame_parameters(void);
-inline void compute_block_size(void);
 
 /**
  * @brief Blowfish thread function
- * Each thread work on its own block, divided in frames. Frames are loaded in RAM one at a time, once loaded each frame is "(enc|dec)rypted" considering 64 bits per iteration (Blowfish's block size), then the frame is written out to the output file and the next frame is loaded.
+ * Each thread work on its own block, divided in frames. Frames are loaded in RAM one at a time, once loaded each frame is "(enc|dec)rypted" by the kernel KERNEL_WIDTH_DEFAULT Blowfish's blocks (64 bits) at a time, then the frame is written out to the output file and the next frame is loaded.
+ * The thread only reads the job descriptor and writes its own WORKER entry.
  * 
- * @param args Thread number, which correspond also to block number.
+ * @param args Worker of the thread.
  */
 void *Blowfish_thread(void *args)
 {
-	int block_number = *((int *)args);			//! Block number on which the thread will work.
-	long int base = block_size * block_number;	//! Base address of the block.
-	long int offset = 0;						//! Frame offset within the block.
-	int intra_frame_counter = 0;				//! Current Blowfish's block within the frame.
+	WORKER *worker = (WORKER *)args;						//! State of the thread.
+	long int base = job.block_size * worker->number;		//! Base address of the block.
+	long int offset = 0;									//! Frame offset within the block.
+	long int length = 0;									//! Frame length, frame_size but for the last frame of the block.
+	BLOWFISH_CTX private_ctx[2];							//! Copy of the contexts, on the stack of the thread (so on its NUMA node).
+	const BLOWFISH_CTX *ctx = job.ctx;						//! Context used by the thread.
+	const BLOWFISH_CTX *new_ctx = job.new_ctx;				//! Context of the new key used by the thread when re-keying.
+	
+	if(job.private_ctx)
+	{
+		private_ctx[0] = *job.ctx;	// S-box lookups then hit local memory instead of the node of the main thread
+		ctx = &private_ctx[0];
+		if(job.new_ctx != NULL)
+		{
+			private_ctx[1] = *job.new_ctx;
+			new_ctx = &private_ctx[1];
+		}
+	}
 	
-	uint64_t *buffer = (uint64_t *)calloc(frame_size, 1);	//! Buffer to temporary store the frame.
-	if(buffer == NULL)
+	if(job.profile)
 	{
-		perror("Failed to allocate buffer, exiting");
-		exit(EXIT_FAILURE);
+		profile_open(&worker->profile);	// Counts this thread only
 	}
 	
-	for(offset = 0; offset<block_size; offset += frame_size)
+	writer_cursor(&worker->cursor, base);
+	for(offset = 0; offset<job.block_size; offset += job.frame_size)
 	{
+		length = (job.block_size - offset < job.frame_size) ? job.block_size - offset : job.frame_size;
+		
 		///////////////////////////////////////////////
 		// Read the frame and store it into the buffer
 		///////////////////////////////////////////////
-		pthread_mutex_lock(&read_mutex);
-			fseek(input_file, base+offset, SEEK_SET);
-			fread(buffer, frame_size, 1, input_file);
-		pthread_mutex_unlock(&read_mutex);
+		read_input(worker->buffer, length, base+offset);
+		if(job.profile)
+		{
+			profile_phase(&worker->profile, PROFILE_READ, length);
+		}
 		
 		
 		
 		///////////////////////////////////////////////
 		// Work on each Blowfish's block
 		///////////////////////////////////////////////
-		for(intra_frame_counter = 0; intra_frame_counter < (frame_size/sizeof(uint64_t)); ++intra_frame_counter)
-		{
 #ifdef DEBUG
-			printf("Thread input: base=%d\toffset=%d\tintra_frame_counter=%d\tbuffer[%d]=%08llX\n", base, offset, intra_frame_counter, intra_frame_counter, buffer[intra_frame_counter]);
+		printf("Thread input: base=%d\toffset=%d\tbuffer[0]=%02X\n", base, offset, worker->buffer[0]);
 #endif
-			if(mode == 'e')
-			{
-				buffer[intra_frame_counter] = BlowfishEncryption(ctx, buffer[intra_frame_counter]);
-			}
-			else
-			{
-				buffer[intra_frame_counter] = BlowfishDecryption(ctx, buffer[intra_frame_counter]);
-			}
+		if(job.digest && (job.mode == 'e'))
+		{
+			worker->digest = digest_update(worker->digest, worker->buffer, length, base+offset);	// Plaintext before encryption
+		}
+		crypt_buffer(ctx, new_ctx, worker->buffer, length);
+		if(job.digest && (job.mode != 'e'))
+		{
+			worker->digest = digest_update(worker->digest, worker->buffer, length, base+offset);	// Plaintext after decryption
+		}
+		if(job.profile)
+		{
+			profile_phase(&worker->profile, PROFILE_COMPUTE, length);
+		}
 #ifdef DEBUG
-			printf("Thread output: base=%d\toffset=%d\tintra_frame_counter=%d\tbuffer[%d]=%08llX\n", base, offset, intra_frame_counter, intra_frame_counter, buffer[intra_frame_counter]);
+		printf("Thread output: base=%d\toffset=%d\tbuffer[0]=%02X\n", base, offset, worker->buffer[0]);
 #endif
-		}
 		
 		
 		
 		///////////////////////////////////////////////
 		// Write out the frame
 		///////////////////////////////////////////////
-		pthread_mutex_lock(&write_mutex);
-			fseek(output_file, base+offset, SEEK_SET);
-			fwrite(buffer, frame_size, 1, output_file);
-			if(ferror(output_file))
-			{
-				perror("Writing error\n");
-				exit(EXIT_FAILURE);
-			}
-		pthread_mutex_unlock(&write_mutex);
+		write_output(&worker->cursor, worker->buffer, length, base+offset);
+		if(job.mode == 'v')
+		{
+			posix_fadvise(fileno(job.input_file), base+offset, length, POSIX_FADV_DONTNEED);	// Read once: auditing a huge archive does not evict the page cache of everything else
+		}
+		if(job.profile)
+		{
+			profile_phase(&worker->profile, PROFILE_WRITE, length);
+		}
 	}
 	
-	buffer = (uint64_t *) memset(buffer, 0, frame_size);	// For security reasons overwrite memory before exiting
-	free(buffer);
-	pthread_exit(NULL);
+	if(job.profile)
+	{
+		profile_close(&worker->profile);
+	}
+	if(job.private_ctx)
+	{
+		explicit_bzero(&private_ctx, sizeof(private_ctx));	// For security reasons overwrite memory before exiting
+	}
+	pthread_exit(NULL);	// The buffer is zeroized along with the arena
+
 }
 
 
@@ -138,7 +271,16 @@ int64_t timespecDiff(struct timespec *timeA_p, struct timespec *timeB_p)
 
 
 /**
- * @brief Usage: blowfish-multithread (e|d) input_filename key output_filename max_threads
+ * @brief Usage: blowfish-multithread (e|d|i|x|r|v) input_filename key output_filename (max_threads|auto) [--engine=(table|ct)] [--fsync] [--frame-size=bytes] [--new-key=key] [--digest[=hex]] [--profile]
+ * 
+ * Modes: e encrypt, d decrypt, v verify (an e output is decrypted in memory and its padding checked, nothing is written, output_filename is ignored: pass -), r re-key (an e output is decrypted with key and encrypted again with --new-key in one pass, the plaintext never reaches the disk), i incremental encryption (chunked layout, only the chunks changed since the last run are rewritten), x decryption of the chunked layout.
+ * Threads: auto (or 0) uses one thread per CPU available to the process (affinity mask and cgroup CPU quota), fewer for small files.
+ * Options: --engine=table (S-box lookups, default) or --engine=ct (constant time, no secret-dependent memory accesses).
+ *          --new-key=key (r) key of the re-keyed output.
+ *          --fsync (e, d and r) makes the output durable before exiting, by default the write-back is left to the kernel.
+ *          --frame-size=bytes (e, d, r and v) maximum frame size, rounded up to a multiple of WRITER_ALIGNMENT (default 2000000).
+ *          --digest (e and d) prints the keyed digest of the plaintext, v always prints it. --digest=hex (e, d and v) also fails if it differs from hex.
+ *          --profile (e, d, r and v) prints the wall time, IPC and cache and branch misses per KB of the read, compute and write phases of every thread (see profile.c).
  * 
  * @param argc Argument count.
  * @param argv Argument vector.
@@ -158,51 +300,161 @@ int main(int argc, char **argv)
 			printf("%s",argv[q]);
 			printf("\n");
 		}
-		perror("Usage: blowfish-multithread (e|d) input_filename key output_filename max_threads\n");
+		perror("Usage: blowfish-multithread (e|d|i|x|r|v) input_filename key output_filename (max_threads|auto) [--engine=(table|ct)] [--fsync] [--frame-size=bytes] [--new-key=key] [--digest[=hex]] [--profile]\n");
 		exit(EXIT_FAILURE);
 	}
 	
-	if(argc != 6)
+	if(argc < 6)
 	{
 		perror("Wrong number of arguments\n");
 		exit(EXIT_FAILURE);
 	}
 	
-	mode = argv[1][0];
+	job.mode = argv[1][0];
 	char *input_filename = argv[2];
 	char *key = argv[3];
 	char *output_filename = argv[4];
-	max_threads = atoi(argv[5]);
+	job.max_threads = atoi(argv[5]);
+	char *new_key = NULL;	//! Key of the output when re-keying.
+	int check_digest = 0;	//! 1 if the plaintext must have expected_digest, --digest=hex.
+	uint64_t expected_digest = 0;
+	int auto_threads = (strcmp(argv[5], "auto") == 0) || (strcmp(argv[5], "0") == 0);	//! Thread number chosen from the CPUs, the file size and the measured throughput.
+	int cpus;	//! CPUs the process can use, read once.
+	
+	int arg = 0;
+	for(arg = 6; arg < argc; ++arg)
+	{
+		if(strcmp(argv[arg], "--engine=table") == 0)
+		{
+			job.engine = BLOWFISH_ENGINE_TABLE;
+		}
+		else if(strcmp(argv[arg], "--engine=ct") == 0)
+		{
+			job.engine = BLOWFISH_ENGINE_CONSTANT_TIME;
+		}
+		else if(strncmp(argv[arg], "--new-key=", 10) == 0)
+		{
+			new_key = argv[arg] + 10;
+		}
+		else if(strcmp(argv[arg], "--digest") == 0)
+		{
+			job.digest = 1;
+		}
+		else if(strncmp(argv[arg], "--digest=", 9) == 0)
+		{
+			if((strlen(argv[arg] + 9) != 16) || (strspn(argv[arg] + 9, "0123456789abcdefABCDEF") != 16))
+			{
+				fprintf(stderr, "The digest must be 16 hex digits, as printed by --digest: %s\n", argv[arg] + 9);
+				exit(EXIT_FAILURE);
+			}
+			job.digest = 1;
+			check_digest = 1;
+			expected_digest = strtoull(argv[arg] + 9, NULL, 16);
+		}
+		else if(strcmp(argv[arg], "--profile") == 0)
+		{
+			job.profile = 1;
+		}
+		else if(strcmp(argv[arg], "--fsync") == 0)
+		{
+			job.output_sync = WRITER_SYNC_FSYNC;
+		}
+		else if(strncmp(argv[arg], "--frame-size=", 13) == 0)
+		{
+			job.frame_threshold = atol(argv[arg] + 13);
+			if(job.frame_threshold < 1)
+			{
+				perror("The frame size must be greater than zero\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else
+		{
+			printf("%s\n", argv[arg]);
+			perror("Unknown option\n");
+			exit(EXIT_FAILURE);
+		}
+	}
 	
-	if((mode != 'e')&&(mode != 'd'))
+	if((job.mode != 'e')&&(job.mode != 'd')&&(job.mode != 'i')&&(job.mode != 'x')&&(job.mode != 'r')&&(job.mode != 'v'))
 	{
-		printf("%c\n",mode);
+		printf("%c\n",job.mode);
 		perror("Wrong mode\n");
 		exit(EXIT_FAILURE);
 	}
 	
-	if(max_threads < 1)
+	if((job.mode == 'r') != (new_key != NULL))
 	{
-		perror("The number of threads must be greater than zero\n");
+		perror("--new-key is required by, and only allowed in, the re-key mode\n");
 		exit(EXIT_FAILURE);
 	}
 	
-	
-	input_file = fopen(input_filename, "r");
-	if(input_file == NULL)
+	if(job.mode == 'v')
 	{
-		perror("Problem opening the input file\n");
+		job.digest = 1;
+	}
+	else if(job.digest && (job.mode != 'e') && (job.mode != 'd'))
+	{
+		perror("--digest is only allowed in the e, d and v modes\n");
+		exit(EXIT_FAILURE);
+	}
+	if(job.profile && ((job.mode == 'i') || (job.mode == 'x')))
+	{
+		perror("--profile is only allowed in the e, d, r and v modes\n");
 		exit(EXIT_FAILURE);
 	}
 	
-	output_file = fopen(output_filename, "w+");	// Overwrite existing file
-	if(output_file == NULL)
+	if(!auto_threads && (job.max_threads < 1))	// auto is chosen once the output is open
 	{
-		perror("Problem creating the output file\n");
+		perror("The number of threads must be greater than zero (0 or auto to choose it automatically)\n");
 		exit(EXIT_FAILURE);
 	}
+	else if(!auto_threads && (job.max_threads > (cpus = cpu_available())))
+	{
+		fprintf(stderr, "Warning: %d threads on %d available CPUs, the threads will compete for them (0 or auto to choose automatically)\n", job.max_threads, cpus);
+	}
+	
+	
+	int chunked = (job.mode == 'i') || (job.mode == 'x');	//! The chunked layout opens its own files, the output must not be truncated.
+	
+	if(!chunked)
+	{
+		job.input_file = fopen(input_filename, "r");
+		if(job.input_file == NULL)
+		{
+			perror("Problem opening the input file\n");
+			exit(EXIT_FAILURE);
+		}
+		
+		job.output_file = (job.mode == 'v') ? NULL : fopen(output_filename, "w");	// Overwrite existing file, write only: holding the read end of a /dev/stdout pipe would hide a closed reader
+		if((job.output_file == NULL) && (job.mode != 'v'))
+		{
+			perror("Problem creating the output file\n");
+			exit(EXIT_FAILURE);
+		}
+		
+		struct stat output_status, stdout_status;
+		if((job.output_file != NULL) && (fstat(fileno(job.output_file), &output_status) == 0) && (fstat(STDOUT_FILENO, &stdout_status) == 0) && (output_status.st_dev == stdout_status.st_dev) && (output_status.st_ino == stdout_status.st_ino))
+		{
+			fflush(stdout);
+			dup2(STDERR_FILENO, STDOUT_FILENO);	// The output is the standard output (/dev/stdout in a pipe): the reports go to stderr instead of into the data
+		}
+	}
+	
+	if(auto_threads)	// Chosen once the output is open: the report must not land in the data when it goes to /dev/stdout
+	{
+		struct stat input_status;
+		if(stat(input_filename, &input_status) != 0)
+		{
+			perror("Problem opening the input file\n");
+			exit(EXIT_FAILURE);
+		}
+		job.max_threads = cpu_auto_threads(input_status.st_size, job.engine);
+		printf("Threads: %d\n", job.max_threads);
+	}
 	
 
+
 #ifdef BENCHMARK
 	struct timespec start, end;
 	clock_gettime(CLOCK_MONOTONIC, &start);	// Start here to measure the execution time
@@ -222,10 +474,53 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 	
-	ctx = (BLOWFISH_CTX *) malloc(sizeof(BLOWFISH_CTX));
-	Blowfish_Init(ctx, key, key_length);	// Create Blowfish's context for the session.
+	int new_key_length = (new_key != NULL) ? strlen(new_key) : 0;	//! Length of the key of the output when re-keying.
+	
+	if((new_key != NULL) && ((new_key_length<4) || (new_key_length>56)))
+	{
+		perror("Wrong new key size (4-56 characters)\n");
+		exit(EXIT_FAILURE);
+	}
 	
-	//TODO: Test if could be usefull perform this step in a separate thread
+	//TODO: Test if could be usefull perform the context creation in a separate thread
+	
+	
+	
+	///////////////////////////////////////////////////////////////////////
+	// Chunked layout
+	///////////////////////////////////////////////////////////////////////
+	
+	if(chunked)
+	{
+		long rewritten = 0;	//! Number of chunks written out.
+		
+		if(arena_create(&arena, sizeof(BLOWFISH_CTX)) != 0)
+		{
+			perror("Failed to allocate memory, exiting");
+			exit(EXIT_FAILURE);
+		}
+		job.ctx = (BLOWFISH_CTX *) arena_alloc(&arena, sizeof(BLOWFISH_CTX));
+		(job.engine == BLOWFISH_ENGINE_CONSTANT_TIME ? Blowfish_InitCT : Blowfish_Init)(job.ctx, key, key_length);	// Create Blowfish's context for the session.
+		
+		if(job.mode == 'i')
+		{
+			rewritten = chunked_encrypt(job.ctx, job.engine, input_filename, output_filename, job.max_threads);
+		}
+		else
+		{
+			rewritten = chunked_decrypt(job.ctx, job.engine, input_filename, output_filename, job.max_threads);
+		}
+		printf("Chunks written: %ld\n", rewritten);
+		
+#ifdef BENCHMARK	
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		printf("Elapsed time: %f seconds.\n", (double)timespecDiff(&end, &start)/1000000000);
+#endif
+		
+		arena_destroy(&arena);	// For security reasons overwrite memory before exiting
+		key_length = 0;
+		exit(EXIT_SUCCESS);
+	}
 	
 	
 	
@@ -233,56 +528,142 @@ int main(int argc, char **argv)
 	// Block subdivision
 	///////////////////////////////////////////////////////////////////////
 	
-	input_file_length = 0;
+	job.input_file_length = 0;
 	
-	fseek(input_file, 0L, SEEK_END);		// Go to file end
-	input_file_length = ftell(input_file);	// Get the length
-	rewind(input_file);		// Go back to the beginning
+	fseek(job.input_file, 0L, SEEK_END);		// Go to file end
+	job.input_file_length = ftell(job.input_file);	// Get the length
+	rewind(job.input_file);		// Go back to the beginning
 	
-	if(input_file_length < 8)
+	if((job.mode != 'e') && (job.input_file_length < 8))
 	{
 		perror("Input file is too short\n");
 		exit(EXIT_FAILURE);
+	}	// When encrypting any length is fine, even 0: the padding always adds a block
+	
+	if((job.mode != 'e') && (job.input_file_length%8 != 0))
+	{
+		perror("Input file length is not a multiple of 8, it is not an encrypted file\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	job.data_length = ((job.mode == 'd') || (job.mode == 'v')) ? job.input_file_length - 8 : job.input_file_length;	// Re-keying maps every block, the padded one too, to a block
+	
+	if((job.max_threads > 1) && (job.max_threads > job.data_length / WRITER_ALIGNMENT))
+	{
+		job.max_threads = (job.data_length / WRITER_ALIGNMENT > 0) ? job.data_length / WRITER_ALIGNMENT : 1;	// Further threads would get empty blocks
 	}
 	
 	compute_block_size();
 	
-	long int reminder_size = input_file_length - (block_size * max_threads);	//! Reminder size in bytes, which in turn may be not multiple of 64 bits (8 bytes).
+	long int reminder_size = job.data_length - (job.block_size * job.max_threads);	//! Reminder size in bytes, which in turn may be not multiple of 64 bits (8 bytes).
 	long int reminder_size_aligned = reminder_size - (reminder_size%8);			//! Reminder size multiple of 64 bits, the remaining bytes will be padded.
 	int padding_size = 8 - (reminder_size%8);									//! Padding size in bytes, if the reminder size is already aligned the padding will be 64 bits (added anyway) to be consistent with the protocol.
+																				//! When decrypting it is read from the last block, see below.
 	
 	compute_frame_parameters();
 	
 #ifdef DEBUG
-		printf("Block subdivision: input_file_length=%d\tblock_size=%d\nreminder_size=%d\treminder_size_aligned=%d\tpadding_size=%d\n\n", input_file_length, block_size, reminder_size, reminder_size_aligned, padding_size);
+		printf("Block subdivision: input_file_length=%d\tblock_size=%d\nreminder_size=%d\treminder_size_aligned=%d\tpadding_size=%d\n\n", job.input_file_length, job.block_size, reminder_size, reminder_size_aligned, padding_size);
 #endif
 	
 	
 	
-	
 	///////////////////////////////////////////////////////////////////////
-	// Thread creation
+	// Memory allocation
 	///////////////////////////////////////////////////////////////////////
 	
-	pthread_t *thread_pool = (pthread_t *) malloc(max_threads * sizeof(pthread_t));	//! This array will contains all the threads that will be created.
-	thread_args = (int *) malloc(max_threads * sizeof(int));
-	pthread_mutex_init(&read_mutex, NULL);
-	pthread_mutex_init(&write_mutex, NULL);
+	/**
+	 * Context, workers, frame buffers and reminder buffer all come from one huge-page arena, each on its own cache line.
+	 * The arena is zero filled by the kernel (no calloc() double zeroing) and zeroized once on release.
+	 */
+	if(arena_create(&arena, 2*sizeof(BLOWFISH_CTX) + job.max_threads * (sizeof(WORKER) + job.frame_size + ARENA_ALIGNMENT) + reminder_size_aligned + 2*ARENA_ALIGNMENT) != 0)
+	{
+		perror("Failed to allocate memory, exiting");
+		exit(EXIT_FAILURE);
+	}
+	
+	job.ctx = (BLOWFISH_CTX *) arena_alloc(&arena, sizeof(BLOWFISH_CTX));
+	(job.engine == BLOWFISH_ENGINE_CONSTANT_TIME ? Blowfish_InitCT : Blowfish_Init)(job.ctx, key, key_length);	// Create Blowfish's context for the session.
+	
+	job.kernel = Blowfish_SelectKernel(job.engine, (job.mode == 'e') ? 'e' : 'd', BLOWFISH_ECB, KERNEL_WIDTH_DEFAULT);
+	
+	if(job.mode == 'r')
+	{
+		job.new_ctx = (BLOWFISH_CTX *) arena_alloc(&arena, sizeof(BLOWFISH_CTX));
+		(job.engine == BLOWFISH_ENGINE_CONSTANT_TIME ? Blowfish_InitCT : Blowfish_Init)(job.new_ctx, new_key, new_key_length);
+		job.new_kernel = Blowfish_SelectKernel(job.engine, 'e', BLOWFISH_ECB, KERNEL_WIDTH_DEFAULT);
+	}
+	
+	job.private_ctx = (access("/sys/devices/system/node/node1", F_OK) == 0);	// More than one NUMA node
+	
+	workers = (WORKER *) arena_alloc(&arena, job.max_threads * sizeof(WORKER));
 	
 	int i = 0;
-	for(i = 0; i < max_threads; ++i)
+	for(i = 0; i < job.max_threads; ++i)
+	{
+		workers[i].number = i;
+		workers[i].digest = 0;
+		workers[i].buffer = (unsigned char *) arena_alloc(&arena, job.frame_size);
+	}
+	unsigned char *reminder_buffer = (unsigned char *) arena_alloc(&arena, reminder_size_aligned);	//! Aligned part of the reminder, processed in one go by the main thread.
+	
+	
+	
+	///////////////////////////////////////////////////////////////////////
+	// Output length
+	///////////////////////////////////////////////////////////////////////
+	/**
+	 * The last block is the only one whose length changes (see Padding below): when decrypting it is decrypted here, before the threads start, and its last byte gives the padding length.
+	 * When re-keying the padding is kept as it is, the last block is only decrypted to check the old key before any output is written.
+	 * The output length is then known in every mode and the output is allocated in one go, the threads and the reminder loop write at the final positions and the padding is never written (no truncation afterwards, so the output does not need to be reopened by name).
+	 */
+	unsigned char last_block[8] = {0};	//! Last Blowfish's block of the input, decrypted.
+	
+	if(job.mode != 'e')
 	{
-		/**
-		 * Initialize the threads arguments vector that will be used to pass the thread number to each thread (that is also the block number on which the thread will work)
-		 * {0,1,2,3,4,5,6,7,...,max_threads-1}
-		 */
-		thread_args[i] = i;
+		read_input(last_block, 8, job.input_file_length - 8);
+		job.kernel(job.ctx, last_block, last_block, 1, NULL);
+		
+		padding_size = last_block[7];
+		for(i = 8 - padding_size; (padding_size >= 1) && (padding_size <= 8) && (i < 8); ++i)
+		{
+			if(last_block[i] != padding_size)
+			{
+				padding_size = 0;
+			}
+		}
+		if((padding_size < 1) || (padding_size > 8))
+		{
+			perror("Wrong padding, the key is wrong or the file is corrupted\n");
+			exit(EXIT_FAILURE);
+		}
+		job.output_file_length = (job.mode == 'r') ? job.input_file_length : job.input_file_length - padding_size;	// Plaintext length when verifying
+	}
+	else
+	{
+		job.output_file_length = job.input_file_length + padding_size;
 	}
 	
-	for(i = 0; i < max_threads; i++)
+	if(job.mode == 'v')
+	{
+		posix_fadvise(fileno(job.input_file), 0, 0, POSIX_FADV_SEQUENTIAL);	// One sequential read of the input, no output
+	}
+	else if(writer_open(&job.writer, job.output_file, job.output_file_length, job.output_sync) != 0)	// Reserve the whole output (contiguous extents, no ENOSPC halfway through)
+	{
+		perror("Not enough space for the output file\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	
+	
+	///////////////////////////////////////////////////////////////////////
+	// Thread creation
+	///////////////////////////////////////////////////////////////////////
+	
+	for(i = 0; i < job.max_threads; i++)
 	{
 		int result;
-		result = pthread_create(&thread_pool[i], NULL, Blowfish_thread, (void *)(&thread_args[i]));
+		result = pthread_create(&workers[i].thread, NULL, Blowfish_thread, (void *)(&workers[i]));	// Each thread gets its own worker (that holds also the block number on which the thread will work)
 		
 		if(result != 0)
 		{
@@ -296,38 +677,58 @@ int main(int argc, char **argv)
 	///////////////////////////////////////////////////////////////////////
 	// Reminder
 	///////////////////////////////////////////////////////////////////////
-	long int base_rem = block_size * max_threads;	//! Base address of the reminder.
-	uint64_t in_data_rem = 0;						//! Blwowfish's block read from input file.
-	uint64_t out_data_rem = 0;						//! Blwowfish's block written to output file.
+	long int base_rem = job.block_size * job.max_threads;	//! Base address of the reminder.
+	unsigned char in_data_rem[8] = {0};				//! Blwowfish's block read from input file.
+	unsigned char out_data_rem[8] = {0};			//! Blwowfish's block written to output file.
+	WRITER_CURSOR cursor_rem;						//! Write-back progress of the reminder.
+	uint64_t digest_sum = 0;						//! Partial digest sum of the reminder and the last block.
+	PROFILE profile_rem;							//! Counters of the main thread while on the reminder.
+	int counters = 0;								//! Events the main thread could count, 0 if the counters are unavailable.
+	
+	if(job.profile)
+	{
+		counters = profile_open(&profile_rem);
+		if(counters == 0)
+		{
+			perror("Hardware counters unavailable (perf_event_paranoid, container or VM), profiling the wall time only\n");
+		}
+	}
 	
-	for(i = 0; i<reminder_size_aligned; i += 8)
+	writer_cursor(&cursor_rem, base_rem);
+	if(reminder_size_aligned > 0)
 	{
-		pthread_mutex_lock(&read_mutex);
-			fseek(input_file, base_rem+i, SEEK_SET);
-			fread(&in_data_rem, 8, 1, input_file);
-		pthread_mutex_unlock(&read_mutex);
+		read_input(reminder_buffer, reminder_size_aligned, base_rem);
+		if(job.profile)
+		{
+			profile_phase(&profile_rem, PROFILE_READ, reminder_size_aligned);
+		}
 		
-		if(mode == 'e')
+		if(job.digest && (job.mode == 'e'))
 		{
-			out_data_rem = BlowfishEncryption(ctx, in_data_rem);
+			digest_sum = digest_update(digest_sum, reminder_buffer, reminder_size_aligned, base_rem);
 		}
-		else
+		crypt_buffer(job.ctx, job.new_ctx, reminder_buffer, reminder_size_aligned);
+		if(job.digest && (job.mode != 'e'))
 		{
-			out_data_rem = BlowfishDecryption(ctx, in_data_rem);
+			digest_sum = digest_update(digest_sum, reminder_buffer, reminder_size_aligned, base_rem);
+		}
+		if(job.profile)
+		{
+			profile_phase(&profile_rem, PROFILE_COMPUTE, reminder_size_aligned);
+		}
 #ifdef TRACE
-			printf("Reminder_dec: i=%d\tout_data_rem=%08llX\twrite at: %d\n", i, out_data_rem, base_rem+i);
+		printf("Reminder: reminder_buffer[0]=%02X\twrite at: %d\n", reminder_buffer[0], base_rem);
 #endif
-		}
 		
-		pthread_mutex_lock(&write_mutex);
-			fseek(output_file, base_rem+i, SEEK_SET);
-			fwrite(&out_data_rem, 8, 1, output_file);
-			if(ferror(output_file))
-			{
-				perror("Writing error\n");
-				exit(EXIT_FAILURE);
-			}
-		pthread_mutex_unlock(&write_mutex);
+		write_output(&cursor_rem, reminder_buffer, reminder_size_aligned, base_rem);
+		if(job.profile)
+		{
+			profile_phase(&profile_rem, PROFILE_WRITE, reminder_size_aligned);
+		}
+	}
+	if(job.profile)
+	{
+		profile_close(&profile_rem);
 	}
 	
 	
@@ -335,9 +736,9 @@ int main(int argc, char **argv)
 	// Threads Rendez-vous
 	///////////////////////////////////////////////////////////////////////
 	int j = 0;
-	for(j = 0; j < max_threads; ++j)
+	for(j = 0; j < job.max_threads; ++j)
 	{
-		pthread_join(thread_pool[j], NULL);	// Wait all the thread to finish their work before proceeding.
+		pthread_join(workers[j].thread, NULL);	// Wait all the thread to finish their work before proceeding.
 	}
 	
 	
@@ -352,55 +753,89 @@ int main(int argc, char **argv)
 	 * If the reminder size is already multiple of 8 the padding will be added anyway and will be a block of 8s: 88888888.
 	 * This is necessary to be consistent with the convention and be able to distinguish the padding from the user data and correctly decrypt the file.
 	 * If we don't add this last block of 8s, while decrypting, we have no means to know if there is a padding or not, this means that the padding is always present, its minumum length is 1 and the maximum is 8.
-	 * Given the last property of the protocol the decryption is easy, it is sufficient to read the very last byte to know the padding length (if the padding was allowed to be of zero length this would be not possible) and trim the file to the right length.
+	 * Given the last property of the protocol the decryption is easy, it is sufficient to read the very last byte to know the padding length (if the padding was allowed to be of zero length this would be not possible) and leave it out of the output.
 	 */
-	if(mode == 'e')
+	if(job.mode == 'e')
 	{
-		fseek(input_file, base_rem+i, SEEK_SET);	// Go to the end of the aligned reminder
-		fread(&in_data_rem, reminder_size-reminder_size_aligned, 1, input_file);	// Read the last bytes to be padded
+		read_input(in_data_rem, reminder_size-reminder_size_aligned, base_rem+reminder_size_aligned);	// Read the last bytes to be padded, after the aligned reminder
+		if(job.digest)
+		{
+			digest_sum = digest_update(digest_sum, in_data_rem, reminder_size-reminder_size_aligned, base_rem+reminder_size_aligned);
+		}
 		
+		memset(in_data_rem + (8 - padding_size), padding_size, padding_size);	// Write the padding after the data bytes
 #ifdef TRACE
-		printf("Padding_enc: in_data_rem=%08llX\n", in_data_rem);
+		printf("Padding_enc: padding_size=%d\tin_data_rem[7]=%02X\n", padding_size, in_data_rem[7]);
 #endif
 		
-		for(j = reminder_size-reminder_size_aligned; j < 8; ++j)
-		{
-			in_data_rem = in_data_rem & ~( (uint64_t)(0xFF) << 8*j);	// Clear the bytes to be padded with a "walking zeros" mask: 0xFFFFFFFFFFFFFF00
-#ifdef TRACE
-			printf("Padding_enc: in_data_rem=%08llX\tj+1=%d\t~( (0xFF) << 8*j)=%08llX\n", in_data_rem, j+1, ~( (uint64_t)(0xFF) << 8*j));
-#endif
-		}
+		job.kernel(job.ctx, in_data_rem, out_data_rem, 1, NULL);	// Encrypt the last padded block
 		
-		for(j = reminder_size-reminder_size_aligned; j < 8; ++j)
+		write_output(&cursor_rem, out_data_rem, 8, base_rem+reminder_size_aligned);
+	}
+	else if((job.mode == 'd') || (job.mode == 'v'))
+	{
+		// Last block already decrypted (and its padding validated) before the threads started, write out only the data bytes in front of the padding.
+		if(job.digest)
 		{
-			in_data_rem = in_data_rem | ( ((uint64_t)padding_size) << 8*j);	// Write the padding
-#ifdef TRACE
-			printf("Padding_enc: in_data_rem=%08llX\tj+1=%d\t((uint64_t)padding_size) << 8*(j+1))=%08llX\n", in_data_rem, j+1, ((uint64_t)padding_size) << 8*(j+1));
+			digest_sum = digest_update(digest_sum, last_block, 8 - padding_size, job.data_length);
+		}
+		write_output(&cursor_rem, last_block, 8 - padding_size, job.data_length);
+#ifdef DEBUG
+		printf("Padding_dec: padding_size=%d\toutput_file_length=%d\n", padding_size, job.output_file_length);
 #endif
+	}
+	
+	if((job.mode != 'v') && (writer_close(&job.writer) != 0))	// fsync() if requested with --fsync
+	{
+		perror("Synchronization error\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	
+	
+	///////////////////////////////////////////////////////////////////////
+	// Digest
+	///////////////////////////////////////////////////////////////////////
+	/**
+	 * Every thread summed the words of its frames, the main thread those of the reminder and of the last block: the sum does not depend on who summed what,
+	 * so the same plaintext gives the same digest whatever the number of threads and the frame size, when encrypting, decrypting or verifying.
+	 */
+	if(job.digest)
+	{
+		for(j = 0; j < job.max_threads; ++j)
+		{
+			digest_sum += workers[j].digest;
 		}
+		uint64_t digest = digest_final(job.ctx, job.engine, digest_sum, (job.mode == 'e') ? job.input_file_length : job.output_file_length);
+		printf("Digest: %016llx\n", (unsigned long long)digest);
 		
-		out_data_rem = BlowfishEncryption(ctx, in_data_rem);	// Encrypt the last padded block
-		
-		fseek(output_file, base_rem+i, SEEK_SET);
-		fwrite(&out_data_rem, 1, 8, output_file);
-		if(ferror(output_file))
+		if(check_digest && (expected_digest != digest))
 		{
-			perror("Writing error\n");
+			fprintf(stderr, "Digest mismatch: expected %016llx, got %016llx\n", (unsigned long long)expected_digest, (unsigned long long)digest);
 			exit(EXIT_FAILURE);
 		}
+		digest_sum = 0;
+		digest = 0;
 	}
-	else
+	
+	
+	
+	///////////////////////////////////////////////////////////////////////
+	// Profile
+	///////////////////////////////////////////////////////////////////////
+	if(job.profile)
 	{
-		// Last 8 bytes already decrypted  along with the padding which have to be trimmed, its length is written as padding data (at most 8 byte).
-		fseek(output_file, input_file_length-1, SEEK_SET);
-		fread(&out_data_rem, 1, 1, output_file);
+		char name[sizeof("thread") + 3 * sizeof(int)];	// Room for any int
+		PROFILE total = profile_rem;	// Keeps only the events every thread could count
 		
-		unsigned int trim_len = out_data_rem & (uint64_t)0xFF;	//! Number of bytes to be trimmed from the decrypted file to cut out the padding.
-		fclose(output_file);	// The truncate() function work on closed files. (There is also the couterpart ftruncate() that take the open file descriptor, but during the test it failed)
-		truncate(output_filename, input_file_length-trim_len);	// Trim the file to a specific length.
-#ifdef DEBUG
-		printf("Trimming: out_data_rem=%08lX\tinput_file_length-trim_len=%d\n", out_data_rem, input_file_length-trim_len);
-#endif
+		for(j = 0; j < job.max_threads; ++j)
+		{
+			snprintf(name, sizeof(name), "thread%d", j);
+			profile_report(name, &workers[j].profile);
+			profile_merge(&total, &workers[j].profile);
+		}
+		profile_report("main", &profile_rem);
+		profile_report("total", &total);
 	}
 	
 	
@@ -421,23 +856,21 @@ int main(int argc, char **argv)
 	// Memory free
 	///////////////////////////////////////////////////////////////////////
 	
-	free(thread_pool);
-	free(thread_args);
-	
-	pthread_mutex_destroy(&read_mutex);
-	pthread_mutex_destroy(&write_mutex);
-	
 	// For security reasons overwrite memory before exiting
-	ctx = (BLOWFISH_CTX *) memset(ctx, 0, sizeof(BLOWFISH_CTX));
-	in_data_rem = 0;
-	out_data_rem = 0;
-	input_file_length = 0;
+	arena_destroy(&arena);	// Context, workers and frame buffers
+	memset(in_data_rem, 0, sizeof(in_data_rem));
+	memset(out_data_rem, 0, sizeof(out_data_rem));
+	memset(last_block, 0, sizeof(last_block));
+	job.input_file_length = 0;
+	job.data_length = 0;
+	job.output_file_length = 0;
 	key_length = 0;
-	block_size = 0;
+	new_key_length = 0;
+	job.block_size = 0;
 	reminder_size = 0;
 	reminder_size_aligned = 0;
-	frame_number = 0;
-	frame_size = 0;
+	job.frame_number = 0;
+	job.frame_size = 0;
 	
 	fcloseall();	// Close all files
 	
@@ -452,36 +885,31 @@ int main(int argc, char **argv)
 
 /**
  * @brief Compute optimal frame number and size
+ * The block is split in the least number of frames no larger than frame_threshold (rounded up to WRITER_ALIGNMENT), so that every frame is written as one large aligned chunk.
  */
-inline void compute_frame_parameters(void)
+static inline void compute_frame_parameters(void)
 {
-	frame_size = block_size;
-	frame_number = 1;
-	
-	if(frame_size < frame_threshold)
+	job.frame_number = (job.block_size + job.frame_threshold - 1) / job.frame_threshold;
+	if(job.frame_number == 0)
 	{
-		return;	// Frame size already within the limit, no need to reduce it.
+		job.frame_size = 0;	// Empty blocks, the main thread does everything.
+		return;
 	}
 	
-	for(frame_number = 8; frame_size < frame_threshold; frame_number+=8)
-	{
-		frame_size = block_size / frame_number;	// Maintain frame_size multiple of 8 (block_size already is)
-	}
+	job.frame_size = (job.block_size + job.frame_number - 1) / job.frame_number;
+	job.frame_size += (WRITER_ALIGNMENT - job.frame_size%WRITER_ALIGNMENT) % WRITER_ALIGNMENT;	// Round up, the last frame of the block is shorter.
 }
 
 
 /**
  * @brief Compute block size to distribute the load among threads
  */
-inline void compute_block_size(void)
+static inline void compute_block_size(void)
 {
-	block_size = input_file_length / max_threads;	// Distribute equally the load to the threads.
-	if(0 != (block_size%8))
+	job.block_size = job.data_length / job.max_threads;	// Distribute equally the load to the threads.
+	if(0 != (job.block_size%WRITER_ALIGNMENT))
 	{
-		// Make the block size multiple of 64 bits, the main thread will take care of the reminder.
-		block_size -= (block_size%8);
+		// Make the block size multiple of WRITER_ALIGNMENT (so of 64 bits too) for aligned writes, the main thread will take care of the reminder.
+		job.block_size -= (job.block_size%WRITER_ALIGNMENT);
 	}
 }
-
-
-
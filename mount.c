@@ -0,0 +1,660 @@
+/*
+mount.c:  FUSE filesystem giving transparent access to chunked ciphertexts.
+
+Usage: blowfish-mount backing_directory key max_threads mountpoint [--engine=(table|ct)] [FUSE options]
+
+Every file of backing_directory having a manifest beside it (the output of blowfish-multithread i, or a file created through the mount) shows up under mountpoint as its plaintext, the manifests are hidden.
+Reads and writes go through cryptfile.c: only the touched chunks are decrypted or re-encrypted, decrypted chunks are cached and the following ones decrypted ahead on a pool of max_threads workers.
+All the handles of a file share one cache, so they always see the same data. Changes reach the disk on flush (close), fsync and when chunks are evicted.
+An open file follows its renames (and those of its directories); once unlinked it stays usable through its handles, as on any filesystem, but its manifest is gone and its changes are lost on the last close.
+*/
+
+#define FUSE_USE_VERSION 31
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "cryptfile.h"
+#include "kernel.h"
+#include "pool.h"
+
+
+#define ASIDE_SUFFIX MANIFEST_SUFFIX	//! The manifest of a file replaced by a rename waits as <path>.manifest.manifest: hidden, and no file of the mount can have that name.
+
+
+/**
+ * Open file, shared by all its handles
+ */
+typedef struct OPEN_FILE {
+	char *path;					//! Path within the mount.
+	CRYPTFILE file;				//! Ciphertext access and cache.
+	int references;				//! Open handles, 0 while the file is being closed.
+	int deleted;				//! 1 once unlinked (or replaced by a rename), never looked up again.
+	struct OPEN_FILE *next;		//! Next open file.
+} OPEN_FILE;
+
+
+/**
+ * State of the mount
+ */
+static struct {
+	const char *directory;		//! Backing directory.
+	BLOWFISH_CTX ctx;			//! Context of the key.
+	BLOWFISH_ENGINE engine;		//! S-box lookup implementation.
+	POOL pool;					//! Readahead workers.
+	OPEN_FILE *files;			//! Open files.
+	pthread_mutex_t mutex;		//! Protects files, their paths and references.
+	pthread_cond_t closed;		//! Signaled when a file being closed leaves files.
+} mount = {.engine = BLOWFISH_ENGINE_DEFAULT, .mutex = PTHREAD_MUTEX_INITIALIZER, .closed = PTHREAD_COND_INITIALIZER};
+
+
+/**
+ * @brief Path in the backing directory, with an optional suffix
+ */
+static void backing_path(char *result, size_t size, const char *path, const char *suffix)
+{
+	snprintf(result, size, "%s%s%s", mount.directory, path, suffix);
+}
+
+
+/**
+ * @brief 1 if a file name is a manifest (or a manifest being stored), hidden from the mount
+ */
+static int is_manifest(const char *name)
+{
+	size_t length = strlen(name);
+	return ((length >= strlen(MANIFEST_SUFFIX)) && (strcmp(name + length - strlen(MANIFEST_SUFFIX), MANIFEST_SUFFIX) == 0))
+	    || ((length >= strlen(MANIFEST_SUFFIX ".tmp")) && (strcmp(name + length - strlen(MANIFEST_SUFFIX ".tmp"), MANIFEST_SUFFIX ".tmp") == 0));
+}
+
+
+/**
+ * @brief Open file of a path, called with the lock
+ *
+ * A file being closed is waited for, so that its final flush is on disk before the path is used again.
+ *
+ * @return The open file, NULL if the path is not open
+ */
+static OPEN_FILE *find_open(const char *path)
+{
+	OPEN_FILE *open_file;
+
+	for(;;)
+	{
+		for(open_file = mount.files; open_file != NULL; open_file = open_file->next)
+		{
+			if(!open_file->deleted && (strcmp(open_file->path, path) == 0))
+			{
+				break;
+			}
+		}
+		if((open_file == NULL) || (open_file->references > 0))
+		{
+			return open_file;
+		}
+		pthread_cond_wait(&mount.closed, &mount.mutex);
+	}
+}
+
+
+/**
+ * @brief Find or open the shared state of a file
+ *
+ * @return The open file, NULL if it is not a chunked ciphertext
+ */
+static OPEN_FILE *acquire(const char *path, int create)
+{
+	char filename[PATH_MAX];
+	OPEN_FILE *open_file;
+
+	pthread_mutex_lock(&mount.mutex);
+		open_file = find_open(path);
+		if(open_file != NULL)
+		{
+			open_file->references++;
+			pthread_mutex_unlock(&mount.mutex);
+			return open_file;
+		}
+
+		open_file = (OPEN_FILE *) calloc(1, sizeof(OPEN_FILE));
+		backing_path(filename, sizeof(filename), path, "");
+		if((open_file == NULL) || ((open_file->path = strdup(path)) == NULL) || (cryptfile_open(&open_file->file, &mount.ctx, mount.engine, filename, create, &mount.pool, CRYPTFILE_CACHE_DEFAULT, CRYPTFILE_READAHEAD_DEFAULT) != 0))
+		{
+			if(open_file != NULL)
+			{
+				free(open_file->path);
+			}
+			free(open_file);
+			pthread_mutex_unlock(&mount.mutex);
+			return NULL;
+		}
+		open_file->references = 1;
+		open_file->next = mount.files;
+		mount.files = open_file;
+	pthread_mutex_unlock(&mount.mutex);
+
+	return open_file;
+}
+
+
+/**
+ * @brief Drop a reference, the last one closes the file
+ *
+ * The final flush runs without the lock, the file stays in the list meanwhile so that its path is not opened again before the flush is on disk.
+ *
+ * @return 0 on success, -EIO if the final flush failed
+ */
+static int release_file(OPEN_FILE *open_file)
+{
+	OPEN_FILE **link;
+	int result = 0;
+
+	pthread_mutex_lock(&mount.mutex);
+		if(--open_file->references > 0)
+		{
+			pthread_mutex_unlock(&mount.mutex);
+			return 0;
+		}
+	pthread_mutex_unlock(&mount.mutex);
+
+	result = (cryptfile_close(&open_file->file) == 0) ? 0 : -EIO;
+
+	pthread_mutex_lock(&mount.mutex);
+		for(link = &mount.files; *link != open_file; link = &(*link)->next);
+		*link = open_file->next;
+		pthread_cond_broadcast(&mount.closed);
+	pthread_mutex_unlock(&mount.mutex);
+
+	free(open_file->path);
+	free(open_file);
+	return result;
+}
+
+
+static int mount_getattr(const char *path, struct stat *status, struct fuse_file_info *fi)
+{
+	char filename[PATH_MAX];
+	OPEN_FILE *open_file;
+
+	(void)fi;
+	backing_path(filename, sizeof(filename), path, "");
+	if(lstat(filename, status) != 0)
+	{
+		return -errno;
+	}
+	if(!S_ISREG(status->st_mode))
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&mount.mutex);
+		open_file = find_open(path);
+		if(open_file != NULL)
+		{
+			status->st_size = cryptfile_length(&open_file->file);	// Changes not flushed yet (the manifest of a new file included)
+			pthread_mutex_unlock(&mount.mutex);
+			return 0;
+		}
+	pthread_mutex_unlock(&mount.mutex);
+
+	backing_path(filename, sizeof(filename), path, MANIFEST_SUFFIX);
+	if(is_manifest(path) || (access(filename, F_OK) != 0))
+	{
+		return -ENOENT;
+	}
+	return 0;	// The ciphertext has the same length of the plaintext
+}
+
+
+static int mount_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+	char filename[PATH_MAX];
+	struct dirent *entry;
+	DIR *directory;
+
+	(void)offset;
+	(void)fi;
+	(void)flags;
+	backing_path(filename, sizeof(filename), path, "");
+	directory = opendir(filename);
+	if(directory == NULL)
+	{
+		return -errno;
+	}
+
+	while((entry = readdir(directory)) != NULL)
+	{
+		if(is_manifest(entry->d_name))
+		{
+			continue;
+		}
+		if(entry->d_type == DT_REG)
+		{
+			snprintf(filename, sizeof(filename), "%s%s/%s%s", mount.directory, path, entry->d_name, MANIFEST_SUFFIX);
+			if(access(filename, F_OK) != 0)
+			{
+				continue;	// Not a chunked ciphertext
+			}
+		}
+		if(filler(buffer, entry->d_name, NULL, 0, 0) != 0)
+		{
+			break;
+		}
+	}
+
+	closedir(directory);
+	return 0;
+}
+
+
+static int mount_open(const char *path, struct fuse_file_info *fi)
+{
+	OPEN_FILE *open_file = acquire(path, 0);
+
+	if(open_file == NULL)
+	{
+		return -EIO;
+	}
+	if((fi->flags & O_TRUNC) && (cryptfile_truncate(&open_file->file, 0) != 0))
+	{
+		release_file(open_file);
+		return -EIO;
+	}
+	fi->fh = (uint64_t)(uintptr_t)open_file;
+	return 0;
+}
+
+
+static int mount_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	OPEN_FILE *open_file;
+
+	(void)mode;
+	if(is_manifest(path))
+	{
+		return -EINVAL;
+	}
+	open_file = acquire(path, 1);
+	if(open_file == NULL)
+	{
+		return -EIO;
+	}
+	fi->fh = (uint64_t)(uintptr_t)open_file;
+	return 0;
+}
+
+
+static int mount_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	OPEN_FILE *open_file = (OPEN_FILE *)(uintptr_t)fi->fh;
+	long result = cryptfile_read(&open_file->file, (unsigned char *)buffer, size, offset);
+
+	(void)path;
+	return (result < 0) ? -EIO : (int)result;
+}
+
+
+static int mount_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	OPEN_FILE *open_file = (OPEN_FILE *)(uintptr_t)fi->fh;
+	long result = cryptfile_write(&open_file->file, (const unsigned char *)buffer, size, offset);
+
+	(void)path;
+	return (result < 0) ? -EIO : (int)result;
+}
+
+
+static int mount_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	OPEN_FILE *open_file = (fi != NULL) ? (OPEN_FILE *)(uintptr_t)fi->fh : acquire(path, 0);
+	int result = 0;
+
+	if(open_file == NULL)
+	{
+		return -EIO;
+	}
+	result = (cryptfile_truncate(&open_file->file, size) == 0) ? 0 : -EIO;
+	if(fi == NULL)
+	{
+		int released = release_file(open_file);
+		result = (result != 0) ? result : released;
+	}
+	return result;
+}
+
+
+static int mount_flush(const char *path, struct fuse_file_info *fi)
+{
+	OPEN_FILE *open_file = (OPEN_FILE *)(uintptr_t)fi->fh;
+
+	(void)path;
+	return (cryptfile_flush(&open_file->file) == 0) ? 0 : -EIO;
+}
+
+
+static int mount_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void)datasync;
+	return mount_flush(path, fi);	// The flush is durable (data, then manifest)
+}
+
+
+static int mount_release(const char *path, struct fuse_file_info *fi)
+{
+	(void)path;
+	return release_file((OPEN_FILE *)(uintptr_t)fi->fh);
+}
+
+
+/**
+ * @brief Remove the manifest of a path, through its open file if any (so that no write-back stores it again), called with the lock
+ *
+ * @return 0 on success, -errno on error
+ */
+static int remove_manifest(const char *path)
+{
+	char filename[PATH_MAX];
+	OPEN_FILE *open_file = find_open(path);
+
+	if(open_file != NULL)
+	{
+		if(cryptfile_rename(&open_file->file, NULL) != 0)
+		{
+			return -errno;
+		}
+		open_file->deleted = 1;
+		return 0;
+	}
+
+	backing_path(filename, sizeof(filename), path, MANIFEST_SUFFIX);
+	return (unlink(filename) == 0) ? 0 : -errno;
+}
+
+
+static int mount_unlink(const char *path)
+{
+	char filename[PATH_MAX];
+	int result = 0;
+
+	pthread_mutex_lock(&mount.mutex);
+		result = remove_manifest(path);
+		if(result == 0)
+		{
+			backing_path(filename, sizeof(filename), path, "");
+			result = (unlink(filename) == 0) ? 0 : -errno;
+		}
+	pthread_mutex_unlock(&mount.mutex);
+
+	return result;
+}
+
+
+/**
+ * @brief Re-point the open files below a renamed directory, called with the lock
+ *
+ * Their manifests moved with the directory, only the names change.
+ */
+static void rename_below(const char *from, const char *to)
+{
+	char filename[PATH_MAX];
+	size_t length = strlen(from);
+	OPEN_FILE *open_file;
+
+	for(open_file = mount.files; open_file != NULL; open_file = open_file->next)
+	{
+		char *path = NULL;
+
+		if(open_file->deleted || (strncmp(open_file->path, from, length) != 0) || (open_file->path[length] != '/'))
+		{
+			continue;
+		}
+		path = (char *) malloc(strlen(to) + strlen(open_file->path + length) + 1);
+		if(path == NULL)
+		{
+			open_file->deleted = 1;	// Lost track of it, it can no longer be looked up
+			continue;
+		}
+		sprintf(path, "%s%s", to, open_file->path + length);
+		backing_path(filename, sizeof(filename), path, "");
+		if(cryptfile_rename(&open_file->file, filename) != 0)
+		{
+			free(path);
+			open_file->deleted = 1;
+			continue;
+		}
+		free(open_file->path);
+		open_file->path = path;
+	}
+}
+
+
+/**
+ * @brief Move the manifest of a regular file from the ciphertext name from_name to to_name (backing paths), called with the lock
+ *
+ * The manifest of an open file is moved by its CRYPTFILE, which stores it at the new name from then on.
+ */
+static int move_manifest(OPEN_FILE *open_file, const char *from_name, const char *to_name)
+{
+	char from_manifest[PATH_MAX];
+	char to_manifest[PATH_MAX];
+
+	if(open_file != NULL)
+	{
+		return (cryptfile_rename(&open_file->file, to_name) == 0) ? 0 : -errno;
+	}
+	snprintf(from_manifest, sizeof(from_manifest), "%s%s", from_name, MANIFEST_SUFFIX);
+	snprintf(to_manifest, sizeof(to_manifest), "%s%s", to_name, MANIFEST_SUFFIX);
+	return (rename(from_manifest, to_manifest) == 0) ? 0 : -errno;
+}
+
+
+static int mount_rename(const char *from, const char *to, unsigned int flags)
+{
+	char from_name[PATH_MAX];
+	char to_name[PATH_MAX];
+	char aside_name[PATH_MAX];
+	struct stat status;
+	OPEN_FILE *open_file;
+	OPEN_FILE *replaced = NULL;	//! Open file replaced by the rename.
+	int aside = 0;				//! 1 once the manifest of the replaced file is set aside.
+	char *path = NULL;
+	int result = 0;
+
+	if(flags != 0)
+	{
+		return -EINVAL;
+	}
+	if(strcmp(from, to) == 0)
+	{
+		return 0;
+	}
+	backing_path(from_name, sizeof(from_name), from, "");
+	backing_path(to_name, sizeof(to_name), to, "");
+
+	pthread_mutex_lock(&mount.mutex);
+		if((lstat(from_name, &status) != 0) || !S_ISREG(status.st_mode))
+		{
+			result = (rename(from_name, to_name) == 0) ? 0 : -errno;
+			if(result == 0)
+			{
+				rename_below(from, to);
+			}
+			pthread_mutex_unlock(&mount.mutex);
+			return result;
+		}
+
+		open_file = find_open(from);
+		if((open_file != NULL) && ((path = strdup(to)) == NULL))
+		{
+			pthread_mutex_unlock(&mount.mutex);
+			return -ENOMEM;
+		}
+
+		// A file replaced by the rename loses its manifest, as on unlink: set aside until both renames succeeded, put back otherwise
+		if((lstat(to_name, &status) == 0) && S_ISREG(status.st_mode))
+		{
+			replaced = find_open(to);
+			backing_path(aside_name, sizeof(aside_name), to, ASIDE_SUFFIX);
+			result = move_manifest(replaced, to_name, aside_name);
+			aside = (result == 0);
+			result = (result == -ENOENT) ? 0 : result;
+		}
+
+		// The manifest follows its ciphertext
+		if(result == 0)
+		{
+			result = move_manifest(open_file, from_name, to_name);
+		}
+		if((result == 0) && (rename(from_name, to_name) != 0))
+		{
+			result = -errno;
+			move_manifest(open_file, to_name, from_name);	// The ciphertext stays: so does its manifest
+		}
+
+		if(aside && (result == 0))
+		{
+			if(replaced != NULL)
+			{
+				cryptfile_rename(&replaced->file, NULL);
+				replaced->deleted = 1;
+			}
+			else
+			{
+				backing_path(aside_name, sizeof(aside_name), to, ASIDE_SUFFIX MANIFEST_SUFFIX);
+				unlink(aside_name);
+			}
+		}
+		else if(aside)
+		{
+			move_manifest(replaced, aside_name, to_name);
+		}
+
+		if((result == 0) && (open_file != NULL))
+		{
+			free(open_file->path);
+			open_file->path = path;
+			path = NULL;
+		}
+	pthread_mutex_unlock(&mount.mutex);
+
+	free(path);
+	return result;
+}
+
+
+static int mount_mkdir(const char *path, mode_t mode)
+{
+	char filename[PATH_MAX];
+
+	backing_path(filename, sizeof(filename), path, "");
+	return (mkdir(filename, mode) == 0) ? 0 : -errno;
+}
+
+
+static int mount_rmdir(const char *path)
+{
+	char filename[PATH_MAX];
+
+	backing_path(filename, sizeof(filename), path, "");
+	return (rmdir(filename) == 0) ? 0 : -errno;
+}
+
+
+static void *mount_init(struct fuse_conn_info *conn, struct fuse_config *config)
+{
+	(void)conn;
+	config->kernel_cache = 0;	// The plaintext is cached here, not in the page cache of the mount
+	config->use_ino = 0;
+	return NULL;
+}
+
+
+static const struct fuse_operations operations = {
+	.getattr = mount_getattr,
+	.readdir = mount_readdir,
+	.open = mount_open,
+	.create = mount_create,
+	.read = mount_read,
+	.write = mount_write,
+	.truncate = mount_truncate,
+	.flush = mount_flush,
+	.fsync = mount_fsync,
+	.release = mount_release,
+	.unlink = mount_unlink,
+	.rename = mount_rename,
+	.mkdir = mount_mkdir,
+	.rmdir = mount_rmdir,
+	.init = mount_init,
+};
+
+
+int main(int argc, char **argv)
+{
+	char *fuse_argv[argc];
+	int fuse_argc = 0;
+	int arg = 0;
+	int result = 0;
+
+	if(argc < 5)
+	{
+		perror("Usage: blowfish-mount backing_directory key max_threads mountpoint [--engine=(table|ct)] [FUSE options]\n");
+		exit(EXIT_FAILURE);
+	}
+
+	mount.directory = argv[1];
+	char *key = argv[2];
+	int max_threads = atoi(argv[3]);
+	int key_length = strlen(key);
+
+	fuse_argv[fuse_argc++] = argv[0];
+	fuse_argv[fuse_argc++] = argv[4];
+	for(arg = 5; arg < argc; ++arg)
+	{
+		if(strcmp(argv[arg], "--engine=table") == 0)
+		{
+			mount.engine = BLOWFISH_ENGINE_TABLE;
+		}
+		else if(strcmp(argv[arg], "--engine=ct") == 0)
+		{
+			mount.engine = BLOWFISH_ENGINE_CONSTANT_TIME;
+		}
+		else
+		{
+			fuse_argv[fuse_argc++] = argv[arg];
+		}
+	}
+
+	if((key_length<4) || (key_length>56))
+	{
+		perror("Wrong key size (4-56 characters)\n");
+		exit(EXIT_FAILURE);
+	}
+	if(max_threads < 1)
+	{
+		perror("Wrong number of threads\n");
+		exit(EXIT_FAILURE);
+	}
+
+	(mount.engine == BLOWFISH_ENGINE_CONSTANT_TIME ? Blowfish_InitCT : Blowfish_Init)(&mount.ctx, (unsigned char *)key, key_length);
+	memset(key, 0, key_length);	// Not visible in /proc/<pid>/cmdline for the life of the mount
+
+	if(pool_create(&mount.pool, max_threads) != 0)
+	{
+		perror("Thread creation error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	result = fuse_main(fuse_argc, fuse_argv, &operations, NULL);
+
+	pool_destroy(&mount.pool);
+	memset(&mount.ctx, 0, sizeof(BLOWFISH_CTX));	// For security reasons overwrite memory before exiting
+	return result;
+}
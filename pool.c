@@ -0,0 +1,139 @@
+/*
+pool.c:  Resident worker pool.
+
+Threads are created once and wait for tasks, so that submitting work costs a mutex and a condition signal instead of a pthread_create()/pthread_join() pair.
+*/
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "pool.h"
+
+
+/**
+ * @brief Worker thread function
+ * Pop tasks from the queue and run them until the pool is stopped and the queue drained.
+ *
+ * @param args The pool.
+ */
+static void *pool_thread(void *args)
+{
+	POOL *pool = (POOL *)args;
+	POOL_TASK *task;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&pool->mutex);
+			while((pool->head == NULL) && !pool->stopping)
+			{
+				pthread_cond_wait(&pool->not_empty, &pool->mutex);
+			}
+			task = pool->head;
+			if(task != NULL)
+			{
+				pool->head = task->next;
+				if(pool->head == NULL)
+				{
+					pool->tail = NULL;
+				}
+			}
+		pthread_mutex_unlock(&pool->mutex);
+
+		if(task == NULL)
+		{
+			break;	// Stopping and nothing left to do
+		}
+		task->run(task);
+	}
+
+	pthread_exit(NULL);
+}
+
+
+/**
+ * @brief Start the worker threads
+ *
+ * @param pool [out] Pool to be initialized
+ * @param thread_count [in] Number of worker threads
+ * @return 0 on success, -1 on error
+ */
+int pool_create(POOL *pool, int thread_count)
+{
+	int i = 0;
+
+	pool->threads = (pthread_t *) malloc(thread_count * sizeof(pthread_t));
+	if(pool->threads == NULL)
+	{
+		return -1;
+	}
+	pool->thread_count = 0;
+	pool->head = NULL;
+	pool->tail = NULL;
+	pool->stopping = 0;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->not_empty, NULL);
+
+	for(i = 0; i < thread_count; ++i)
+	{
+		if(pthread_create(&pool->threads[i], NULL, pool_thread, pool) != 0)
+		{
+			pool_destroy(pool);
+			return -1;
+		}
+		pool->thread_count++;
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Queue a task, it will be run by the first idle worker
+ *
+ * @param pool [in] Pool
+ * @param task [in] Task, must stay valid until its run function is called
+ */
+void pool_submit(POOL *pool, POOL_TASK *task)
+{
+	task->next = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+		if(pool->tail == NULL)
+		{
+			pool->head = task;
+		}
+		else
+		{
+			pool->tail->next = task;
+		}
+		pool->tail = task;
+	pthread_mutex_unlock(&pool->mutex);
+
+	pthread_cond_signal(&pool->not_empty);
+}
+
+
+/**
+ * @brief Run the queued tasks, then stop and join the workers
+ *
+ * @param pool [in,out] Pool to be released
+ */
+void pool_destroy(POOL *pool)
+{
+	int i = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+		pool->stopping = 1;
+	pthread_mutex_unlock(&pool->mutex);
+	pthread_cond_broadcast(&pool->not_empty);
+
+	for(i = 0; i < pool->thread_count; ++i)
+	{
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->not_empty);
+	free(pool->threads);
+	pool->threads = NULL;
+	pool->thread_count = 0;
+}
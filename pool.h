@@ -0,0 +1,39 @@
+/*
+pool.h:  Header file for pool.c
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+
+
+/**
+ * Unit of work, embedded by the caller as the first member of its own structure (no allocation on submission)
+ */
+typedef struct POOL_TASK {
+  void (*run)(struct POOL_TASK *task);	//! Work function, receives the task itself.
+  struct POOL_TASK *next;				//! Queue link, owned by the pool while the task is queued.
+} POOL_TASK;
+
+
+/**
+ * Fixed-size pool of resident worker threads fed by a FIFO queue
+ */
+typedef struct {
+  pthread_t *threads;			//! Worker threads.
+  int thread_count;				//! Number of worker threads.
+  POOL_TASK *head;				//! First queued task.
+  POOL_TASK *tail;				//! Last queued task.
+  int stopping;					//! Set by pool_destroy(), workers exit once the queue is empty.
+  pthread_mutex_t mutex;		//! Protects the queue.
+  pthread_cond_t not_empty;		//! Signaled when a task is queued or the pool is stopping.
+} POOL;
+
+
+int pool_create(POOL *pool, int thread_count);
+void pool_submit(POOL *pool, POOL_TASK *task);
+void pool_destroy(POOL *pool);
+
+
+#endif
@@ -0,0 +1,247 @@
+/*
+profile.c:  Per-thread hardware counters of the worker phases (--profile).
+
+Every worker opens its own group of perf_event counters (cycles, instructions, L1D and LLC misses, branch misses) on itself, reads the whole group with one read() at every phase boundary and charges the difference to the phase just ended: read (I/O waits included), compute (kernel and digest), write.
+The report gives for each phase the wall time, the IPC and the misses per KB processed: a low compute IPC with many L1D misses points at the S-box lookups of F(), many branch misses at the dispatch, a read or write phase longer than compute at the disk.
+In containers (perf_event_paranoid, seccomp, no PMU in the VM) the counters are often unavailable: the events that cannot be opened are reported as n/a, and if none can be opened only the wall time of the phases is reported.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "profile.h"
+
+
+/**
+ * Type and configuration of every PROFILE_EVENT
+ */
+static const struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} events[PROFILE_EVENTS] = {
+	{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{"L1D misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+	{"LLC misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+	{"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+};
+
+
+/**
+ * @brief Current monotonic time in nanoseconds
+ */
+static int64_t now(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+
+/**
+ * @brief Read the group: values in slot order, enabled and running times
+ *
+ * @return 0 on success, -1 if there is no group or the read failed
+ */
+static int read_group(const PROFILE *profile, uint64_t *values, uint64_t *enabled, uint64_t *running)
+{
+	uint64_t buffer[3 + PROFILE_EVENTS];	// nr, time_enabled, time_running, values
+	int e = 0;
+
+	if((profile->members == 0) || (read(profile->fd[PROFILE_CYCLES], buffer, sizeof(buffer)) < (ssize_t)((3 + profile->members) * sizeof(uint64_t))))
+	{
+		return -1;
+	}
+	*enabled = buffer[1];
+	*running = buffer[2];
+	for(e = 0; e < PROFILE_EVENTS; ++e)
+	{
+		values[e] = (profile->slot[e] >= 0) ? buffer[3 + profile->slot[e]] : 0;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Open the counters of the calling thread and start the first phase
+ *
+ * Must be called by the thread to be profiled.
+ *
+ * @param profile [out] Counters to be initialized
+ * @return Number of events opened, 0 if only the wall time will be reported
+ */
+int profile_open(PROFILE *profile)
+{
+	struct perf_event_attr attr;
+	int e = 0;
+
+	memset(profile, 0, sizeof(PROFILE));
+	for(e = 0; e < PROFILE_EVENTS; ++e)
+	{
+		profile->fd[e] = -1;
+		profile->slot[e] = -1;
+	}
+
+	for(e = 0; e < PROFILE_EVENTS; ++e)
+	{
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[e].type;
+		attr.config = events[e].config;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.disabled = (e == PROFILE_CYCLES);	// The leader starts the whole group once every member is in
+		attr.exclude_kernel = 1;	// Allowed with perf_event_paranoid 2, the I/O waits show in the wall time
+		attr.exclude_hv = 1;
+
+		profile->fd[e] = syscall(__NR_perf_event_open, &attr, 0, -1, (e == PROFILE_CYCLES) ? -1 : profile->fd[PROFILE_CYCLES], 0);	// This thread, any CPU
+		if(profile->fd[e] < 0)
+		{
+			profile->fd[e] = -1;
+			if(e == PROFILE_CYCLES)
+			{
+				break;	// No leader, no group: wall time only
+			}
+			continue;	// Event not supported by this PMU
+		}
+		profile->slot[e] = profile->members++;
+	}
+
+	if(profile->members > 0)
+	{
+		ioctl(profile->fd[PROFILE_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		if(read_group(profile, profile->last, &profile->last_enabled, &profile->last_running) != 0)
+		{
+			profile_close(profile);
+			for(e = 0; e < PROFILE_EVENTS; ++e)
+			{
+				profile->slot[e] = -1;	// Opened but not readable: wall time only
+			}
+		}
+	}
+	profile->last_time = now();
+	return profile->members;
+}
+
+
+/**
+ * @brief End the current phase: charge it the counts since the end of the previous one
+ *
+ * @param phase [in] Phase just ended
+ * @param bytes [in] Bytes it processed
+ */
+void profile_phase(PROFILE *profile, PROFILE_PHASE phase, long bytes)
+{
+	uint64_t values[PROFILE_EVENTS];
+	uint64_t enabled = 0, running = 0;
+	int64_t time = now();
+	int e = 0;
+
+	profile->nanoseconds[phase] += time - profile->last_time;
+	profile->bytes[phase] += bytes;
+	profile->last_time = time;
+
+	if(read_group(profile, values, &enabled, &running) != 0)
+	{
+		return;
+	}
+	double scale = (running > profile->last_running) ? (double)(enabled - profile->last_enabled) / (running - profile->last_running) : 1.0;	// The PMU was shared with other groups (multiplexing)
+	for(e = 0; e < PROFILE_EVENTS; ++e)
+	{
+		profile->totals[phase][e] += (values[e] - profile->last[e]) * scale;
+		profile->last[e] = values[e];
+	}
+	profile->last_enabled = enabled;
+	profile->last_running = running;
+}
+
+
+/**
+ * @brief Add the counts of a thread to a total (the total keeps the events available in every thread)
+ *
+ * @param total [in,out] Total, a copy of the profile of the first thread
+ */
+void profile_merge(PROFILE *total, const PROFILE *profile)
+{
+	int p = 0, e = 0;
+
+	for(e = 0; e < PROFILE_EVENTS; ++e)
+	{
+		if(profile->slot[e] < 0)
+		{
+			total->slot[e] = -1;
+		}
+	}
+	for(p = 0; p < PROFILE_PHASES; ++p)
+	{
+		for(e = 0; e < PROFILE_EVENTS; ++e)
+		{
+			total->totals[p][e] += profile->totals[p][e];
+		}
+		total->nanoseconds[p] += profile->nanoseconds[p];
+		total->bytes[p] += profile->bytes[p];
+	}
+}
+
+
+/**
+ * @brief Print a line per phase: wall time, IPC and events per KB
+ *
+ * @param name [in] Thread (or total) the counts belong to
+ */
+void profile_report(const char *name, const PROFILE *profile)
+{
+	static const char *phases[PROFILE_PHASES] = {"read", "compute", "write"};
+	int p = 0, e = 0;
+
+	for(p = 0; p < PROFILE_PHASES; ++p)
+	{
+		double kb = profile->bytes[p] / 1024.0;
+
+		printf("Profile %-8s %-8s %10.6f s", name, phases[p], profile->nanoseconds[p] / 1e9);
+		if((profile->slot[PROFILE_CYCLES] >= 0) && (profile->slot[PROFILE_INSTRUCTIONS] >= 0) && (profile->totals[p][PROFILE_CYCLES] > 0))
+		{
+			printf("  IPC %5.2f", profile->totals[p][PROFILE_INSTRUCTIONS] / profile->totals[p][PROFILE_CYCLES]);
+		}
+		else
+		{
+			printf("  IPC   n/a");
+		}
+		for(e = PROFILE_L1D_MISSES; e < PROFILE_EVENTS; ++e)
+		{
+			if((profile->slot[e] >= 0) && (kb > 0))
+			{
+				printf("  %s/KB %8.2f", events[e].name, profile->totals[p][e] / kb);
+			}
+			else
+			{
+				printf("  %s/KB      n/a", events[e].name);
+			}
+		}
+		printf("\n");
+	}
+}
+
+
+/**
+ * @brief Close the counters, the figures stay readable
+ */
+void profile_close(PROFILE *profile)
+{
+	int e = 0;
+
+	for(e = 0; e < PROFILE_EVENTS; ++e)
+	{
+		if(profile->fd[e] >= 0)
+		{
+			close(profile->fd[e]);
+			profile->fd[e] = -1;
+		}
+	}
+	profile->members = 0;	// The slots keep telling which events were counted
+}
@@ -0,0 +1,59 @@
+/*
+profile.h:  Header file for profile.c
+*/
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+
+/**
+ * Phase of a worker the counters are charged to
+ */
+typedef enum {
+  PROFILE_READ,		//! Reading the frame (I/O wait included).
+  PROFILE_COMPUTE,	//! Kernel and digest on the frame.
+  PROFILE_WRITE,	//! Handing the frame to the writer.
+  PROFILE_PHASES	//! Number of phases.
+} PROFILE_PHASE;
+
+
+/**
+ * Hardware event counted
+ */
+typedef enum {
+  PROFILE_CYCLES,			//! CPU cycles (group leader).
+  PROFILE_INSTRUCTIONS,		//! Instructions retired.
+  PROFILE_L1D_MISSES,		//! L1 data cache read misses (S-box lookups).
+  PROFILE_LLC_MISSES,		//! Last level cache misses.
+  PROFILE_BRANCH_MISSES,	//! Branch mispredictions.
+  PROFILE_EVENTS			//! Number of events.
+} PROFILE_EVENT;
+
+
+/**
+ * Counters of one thread, opened by the thread itself
+ */
+typedef struct {
+  int fd[PROFILE_EVENTS];								//! perf_event file descriptors, -1 if the event is unavailable.
+  int slot[PROFILE_EVENTS];								//! Position of the event in the group read, -1 if unavailable.
+  int members;											//! Events in the group.
+  uint64_t last[PROFILE_EVENTS];						//! Values at the end of the previous phase.
+  uint64_t last_enabled;								//! Time the group was enabled at the end of the previous phase.
+  uint64_t last_running;								//! Time the group was counting at the end of the previous phase.
+  int64_t last_time;									//! Wall clock at the end of the previous phase (ns).
+  double totals[PROFILE_PHASES][PROFILE_EVENTS];		//! Counts per phase, scaled when the PMU was multiplexed.
+  int64_t nanoseconds[PROFILE_PHASES];					//! Wall time per phase.
+  long bytes[PROFILE_PHASES];							//! Bytes processed per phase.
+} PROFILE;
+
+
+int profile_open(PROFILE *profile);
+void profile_phase(PROFILE *profile, PROFILE_PHASE phase, long bytes);
+void profile_merge(PROFILE *total, const PROFILE *profile);
+void profile_report(const char *name, const PROFILE *profile);
+void profile_close(PROFILE *profile);
+
+
+#endif
@@ -0,0 +1,404 @@
+/*
+scaling.c:  Thread scaling test of blowfish-multithread against the figures of the report.
+
+Usage: blowfish-scaling path_of_blowfish-multithread thresholds_file output_prefix [--max-size=MB] [--directory=dir] [--repeats=n]
+
+Generates synthetic inputs of the sizes of the test files of Report/Benchmarks.ods (Inferno, m0n0wall, Debian, Gentoo; the ones above max_size, 1000 MB by default, are skipped),
+encrypts each with 1, 2, 4, 8 and N threads (N the CPUs available to the process) keeping the best of repeats runs, and fits the speedup curve with Amdahl's law.
+Writes output_prefix.csv (the measurements next to the historical ones of the report, replacing the spreadsheet), output_prefix-fit.csv and output_prefix.gp (gnuplot script plotting both).
+The exit status is 1 if, on the files of at least min_size_mb and within the available CPUs, the per-core MB/s, the speedup of a doubling of the threads or the parallel efficiency fall below the thresholds.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "cpu.h"
+
+
+#define SCALING_MAX_COUNTS 6			//! 1, 2, 4, 8, N and a spare.
+#define SCALING_KEY "scaling-key"		//! Key given to the executable.
+
+
+/**
+ * Test file of the report, with its timings in seconds (0 if not measured)
+ */
+typedef struct {
+	const char *name;
+	long size;					//! Size in bytes.
+	double report[6];			//! Timings of the report for 1, 2, 4, 8, 16, 32 threads.
+} SCALING_FILE;
+
+
+static const SCALING_FILE files[] = {
+	{"Inferno", 178L << 10, {0.013, 0.01, 0.005, 0.023, 0.021, 0.018}},
+	{"m0n0wall", 23961L << 10, {1.367, 0.749, 0.444, 0.376, 0.302, 0.298}},
+	{"Debian", 635L << 20, {35.558, 19.891, 11.848, 8.734, 7.805, 7.833}},
+	{"Gentoo", 3900L << 20, {274.313, 154.679, 98.741, 70.994, 60.813, 61.51}},
+};
+
+
+/**
+ * Thresholds, see Report/scaling-thresholds.txt
+ */
+static struct {
+	double min_size_mb;
+	double min_per_core_mbs;
+	double min_doubling_speedup;
+	double min_efficiency;
+} thresholds;
+
+
+static int failures = 0;	//! Checks failed.
+
+
+/**
+ * @brief Load the thresholds, lines "name value", # starts a comment
+ */
+static void load_thresholds(const char *filename)
+{
+	char line[256];
+	char name[64];
+	double value;
+	FILE *file = fopen(filename, "r");
+
+	if(file == NULL)
+	{
+		perror("Problem opening the thresholds file\n");
+		exit(EXIT_FAILURE);
+	}
+	while(fgets(line, sizeof(line), file) != NULL)
+	{
+		if((line[0] == '#') || (sscanf(line, "%63s %lf", name, &value) != 2))
+		{
+			continue;
+		}
+		if(strcmp(name, "min_size_mb") == 0)
+		{
+			thresholds.min_size_mb = value;
+		}
+		else if(strcmp(name, "min_per_core_mbs") == 0)
+		{
+			thresholds.min_per_core_mbs = value;
+		}
+		else if(strcmp(name, "min_doubling_speedup") == 0)
+		{
+			thresholds.min_doubling_speedup = value;
+		}
+		else if(strcmp(name, "min_efficiency") == 0)
+		{
+			thresholds.min_efficiency = value;
+		}
+		else
+		{
+			fprintf(stderr, "Unknown threshold %s\n", name);
+			exit(EXIT_FAILURE);
+		}
+	}
+	fclose(file);
+}
+
+
+/**
+ * @brief Write size pseudo-random bytes (the cipher does not care about the content, the page cache does not compress it)
+ */
+static void generate_input(const char *filename, long size)
+{
+	uint64_t buffer[8192];
+	uint64_t seed = 0x0123456789ABCDEFULL;
+	FILE *file = fopen(filename, "w");
+	long written = 0;
+	unsigned int i;
+
+	if(file == NULL)
+	{
+		perror("Problem creating the input file\n");
+		exit(EXIT_FAILURE);
+	}
+	while(written < size)
+	{
+		long length = (size - written < (long)sizeof(buffer)) ? size - written : (long)sizeof(buffer);
+		for(i = 0; i < sizeof(buffer) / sizeof(buffer[0]); ++i)
+		{
+			seed ^= seed >> 12;
+			seed ^= seed << 25;
+			seed ^= seed >> 27;
+			buffer[i] = seed * 0x2545F4914F6CDD1DULL;
+		}
+		if(fwrite(buffer, length, 1, file) != 1)
+		{
+			perror("Writing error\n");
+			exit(EXIT_FAILURE);
+		}
+		written += length;
+	}
+	fclose(file);
+}
+
+
+/**
+ * @brief Best elapsed time, as printed by the executable, of repeats encryptions
+ *
+ * The executable runs with fork() and exec(), without a shell: the paths are passed as they are, spaces and quotes included.
+ */
+static double measure(const char *executable, const char *input, const char *output, int threads, int repeats)
+{
+	char thread_count[16];
+	char line[256];
+	double best = 0;
+	int r;
+
+	snprintf(thread_count, sizeof(thread_count), "%d", threads);
+	for(r = 0; r < repeats; ++r)
+	{
+		double seconds = 0;
+		int pipe_fds[2];
+		int status = 0;
+		pid_t pid;
+		FILE *pipe_file;
+
+		if((pipe(pipe_fds) != 0) || ((pid = fork()) < 0))
+		{
+			perror("Problem running the executable\n");
+			exit(EXIT_FAILURE);
+		}
+		if(pid == 0)
+		{
+			int null_fd = open("/dev/null", O_WRONLY);
+
+			dup2(pipe_fds[1], STDOUT_FILENO);
+			if(null_fd >= 0)
+			{
+				dup2(null_fd, STDERR_FILENO);
+			}
+			close(pipe_fds[0]);
+			close(pipe_fds[1]);
+			execlp(executable, executable, "e", input, SCALING_KEY, output, thread_count, (char *)NULL);
+			_exit(127);
+		}
+		close(pipe_fds[1]);
+
+		pipe_file = fdopen(pipe_fds[0], "r");
+		while((pipe_file != NULL) && (fgets(line, sizeof(line), pipe_file) != NULL))
+		{
+			sscanf(line, "Elapsed time: %lf", &seconds);
+		}
+		if(pipe_file != NULL)
+		{
+			fclose(pipe_file);
+		}
+		else
+		{
+			close(pipe_fds[0]);
+		}
+		if((waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0) || (seconds <= 0))
+		{
+			fprintf(stderr, "%s e %s %s %s %d failed\n", executable, input, SCALING_KEY, output, threads);
+			exit(EXIT_FAILURE);
+		}
+		best = ((best == 0) || (seconds < best)) ? seconds : best;
+	}
+	return best;
+}
+
+
+/**
+ * @brief Amdahl's law fit: least squares of 1/speedup = serial + (1 - serial)/threads
+ *
+ * @return Serial fraction, clamped to [0, 1]
+ */
+static double fit_serial(const int *counts, const double *seconds, int n)
+{
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	int i;
+
+	for(i = 0; i < n; ++i)
+	{
+		double x = 1.0 / counts[i];
+		double y = seconds[i] / seconds[0];	// 1/speedup
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+	if(n < 2)
+	{
+		return 0;
+	}
+	double slope = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+	double serial = (sy - slope * sx) / n;
+	return (serial < 0) ? 0 : ((serial > 1) ? 1 : serial);
+}
+
+
+/**
+ * @brief Record a failed check
+ */
+static void check(int passed, const char *file, int threads, const char *what, double value, double threshold)
+{
+	if(!passed)
+	{
+		printf("FAIL: %s %d threads: %s %.3f below %.3f\n", file, threads, what, value, threshold);
+		failures++;
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	static const int report_counts[] = {1, 2, 4, 8, 16, 32};
+	int counts[SCALING_MAX_COUNTS] = {1, 2, 4, 8};
+	int count_number = 4;
+	double seconds[SCALING_MAX_COUNTS];
+	char filename[1024];
+	char input[1024];
+	char output[1024];
+	const char *directory = "/tmp";
+	long max_size = 1000L << 20;
+	int repeats = 3;
+	int cpus = cpu_available();
+	unsigned int f;
+	int i, arg;
+
+	if(argc < 4)
+	{
+		perror("Usage: blowfish-scaling path_of_blowfish-multithread thresholds_file output_prefix [--max-size=MB] [--directory=dir] [--repeats=n]\n");
+		exit(EXIT_FAILURE);
+	}
+	for(arg = 4; arg < argc; ++arg)
+	{
+		if(strncmp(argv[arg], "--max-size=", 11) == 0)
+		{
+			max_size = atol(argv[arg] + 11) << 20;
+		}
+		else if(strncmp(argv[arg], "--directory=", 12) == 0)
+		{
+			directory = argv[arg] + 12;
+		}
+		else if(strncmp(argv[arg], "--repeats=", 10) == 0)
+		{
+			repeats = (atoi(argv[arg] + 10) > 0) ? atoi(argv[arg] + 10) : 1;
+		}
+		else
+		{
+			fprintf(stderr, "Unknown option %s\n", argv[arg]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	load_thresholds(argv[2]);
+
+	for(i = 0; (i < count_number) && (counts[i] != cpus); ++i);
+	if(i == count_number)
+	{
+		counts[count_number++] = cpus;	// N, kept sorted
+		for(i = count_number - 1; (i > 0) && (counts[i] < counts[i - 1]); --i)
+		{
+			int swap = counts[i];
+			counts[i] = counts[i - 1];
+			counts[i - 1] = swap;
+		}
+	}
+
+	snprintf(filename, sizeof(filename), "%s.csv", argv[3]);
+	FILE *csv = fopen(filename, "w");
+	snprintf(filename, sizeof(filename), "%s-fit.csv", argv[3]);
+	FILE *fit = fopen(filename, "w");
+	if((csv == NULL) || (fit == NULL))
+	{
+		perror("Problem creating the output files\n");
+		exit(EXIT_FAILURE);
+	}
+	fprintf(csv, "source,file,size_bytes,threads,seconds,mb_s,per_core_mb_s,speedup,efficiency\n");
+	fprintf(fit, "source,file,serial_fraction,max_speedup,mean_doubling_speedup\n");
+	snprintf(input, sizeof(input), "%s/blowfish-scaling-input", directory);
+	snprintf(output, sizeof(output), "%s/blowfish-scaling-output", directory);
+	printf("%d CPUs available\n", cpus);
+
+	for(f = 0; f < sizeof(files) / sizeof(files[0]); ++f)
+	{
+		const SCALING_FILE *file = &files[f];
+		double mb = (double)file->size / (1L << 20);	// MB of the report (2^20 bytes)
+		double doubling = 1;
+		int doublings = 0;
+
+		// Historical figures (4 cores, 8 hardware threads)
+		for(i = 0; i < 6; ++i)
+		{
+			int cores = (report_counts[i] < 4) ? report_counts[i] : 4;
+			fprintf(csv, "report,%s,%ld,%d,%.3f,%.1f,%.1f,%.3f,%.3f\n", file->name, file->size, report_counts[i], file->report[i], mb / file->report[i], mb / file->report[i] / cores, file->report[0] / file->report[i], file->report[0] / file->report[i] / report_counts[i]);
+		}
+		double report_serial = fit_serial(report_counts, file->report, 3);	// Up to the 4 cores
+		fprintf(fit, "report,%s,%.4f,%.1f,%.3f\n", file->name, report_serial, (report_serial > 0) ? 1 / report_serial : 0.0, pow(file->report[0] / file->report[2], 0.5));	// 1 -> 4 threads is two doublings
+
+		if(file->size > max_size)
+		{
+			printf("%-10s %8.1f MB skipped (--max-size)\n", file->name, mb);
+			continue;
+		}
+
+		generate_input(input, file->size);
+		for(i = 0; i < count_number; ++i)
+		{
+			int cores = (counts[i] < cpus) ? counts[i] : cpus;
+			double speedup, efficiency, per_core;
+
+			seconds[i] = measure(argv[1], input, output, counts[i], repeats);
+			speedup = seconds[0] / seconds[i];
+			efficiency = speedup / counts[i];
+			per_core = mb / seconds[i] / cores;
+			printf("%-10s %8.1f MB %3d threads %9.3f s %8.1f MB/s per core, speedup %.2f, efficiency %.2f\n", file->name, mb, counts[i], seconds[i], per_core, speedup, efficiency);
+			fprintf(csv, "measured,%s,%ld,%d,%.3f,%.1f,%.1f,%.3f,%.3f\n", file->name, file->size, counts[i], seconds[i], mb / seconds[i], per_core, speedup, efficiency);
+
+			if((mb < thresholds.min_size_mb) || (counts[i] > cpus))
+			{
+				continue;	// Too small to be meaningful, or threads competing for the CPUs
+			}
+			check(per_core >= thresholds.min_per_core_mbs, file->name, counts[i], "per-core MB/s", per_core, thresholds.min_per_core_mbs);
+			check(efficiency >= thresholds.min_efficiency, file->name, counts[i], "efficiency", efficiency, thresholds.min_efficiency);
+			if((i > 0) && (counts[i] == 2 * counts[i - 1]))
+			{
+				double step = seconds[i - 1] / seconds[i];
+				check(step >= thresholds.min_doubling_speedup, file->name, counts[i], "doubling speedup", step, thresholds.min_doubling_speedup);
+				doubling *= step;
+				doublings++;
+			}
+		}
+
+		int fitted = 0;
+		for(fitted = 0; (fitted < count_number) && (counts[fitted] <= cpus); ++fitted);
+		double serial = fit_serial(counts, seconds, fitted);
+		if(fitted < 2)
+		{
+			fprintf(fit, "measured,%s,,,\n", file->name);	// A single thread count within the CPUs, nothing to fit
+		}
+		else
+		{
+			fprintf(fit, "measured,%s,%.4f,%.1f,%.3f\n", file->name, serial, (serial > 0) ? 1 / serial : 0.0, doublings ? pow(doubling, 1.0 / doublings) : 0.0);
+		}
+	}
+
+	unlink(input);
+	unlink(output);
+	fclose(csv);
+	fclose(fit);
+
+	// Plots: speedup and efficiency against the threads, report and measured
+	snprintf(filename, sizeof(filename), "%s.gp", argv[3]);
+	FILE *plot = fopen(filename, "w");
+	if(plot != NULL)
+	{
+		fprintf(plot, "set datafile separator ','\nset terminal pngcairo size 900,600\nset key left top\nset logscale x 2\nset xlabel 'threads'\n");
+		fprintf(plot, "set output '%s-speedup.png'\nset ylabel 'speedup'\n", argv[3]);
+		fprintf(plot, "plot for [name in 'Inferno m0n0wall Debian Gentoo'] for [source in 'report measured'] '%s.csv' using (stringcolumn(1) eq source && stringcolumn(2) eq name ? $4 : 1/0):8 with linespoints title source.' '.name, x title 'linear' dashtype 2\n", argv[3]);
+		fprintf(plot, "set output '%s-efficiency.png'\nset ylabel 'efficiency'\nset yrange [0:1.1]\n", argv[3]);
+		fprintf(plot, "plot for [name in 'Inferno m0n0wall Debian Gentoo'] for [source in 'report measured'] '%s.csv' using (stringcolumn(1) eq source && stringcolumn(2) eq name ? $4 : 1/0):9 with linespoints title source.' '.name\n", argv[3]);
+		fclose(plot);
+	}
+
+	printf("Written %s.csv, %s-fit.csv and %s.gp (gnuplot %s.gp), %d failures\n", argv[3], argv[3], argv[3], argv[3], failures);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1554 @@
+/*
+test.c:  Test harness.
+
+Usage: blowfish-test path_of_blowfish-multithread [path_of_blowfish-daemon]
+
+   [1] Known-answer vectors of the Blowfish specification, on the scalar functions of both engines and on every ECB kernel.
+   [2] Differential tests: every kernel (engine, direction, mode of operation, width), the multi-stream CBC and the batched key schedule against the reference scalar path, on random lengths split in two calls.
+   [3] Files: the executable is run on sizes around every boundary of the block subdivision (0-17 bytes, block_size*max_threads +- k) for several thread counts, frame sizes and engines, the ciphertext is compared with the reference scalar path and the decryption with the plaintext.
+       The --profile report must have its lines for every thread, also when perf_event_open() is denied (n/a figures), and the auto thread count must follow a one-CPU affinity mask.
+   [4] Chunked layout: the ciphertext is compared with the reference counter mode built from the manifest, and the incremental runs must rewrite exactly the changed chunks.
+   [5] Re-keying: the r output must be the reference encryption of the padded plaintext under the new key, and a wrong old key must be refused.
+   [6] Random access (cryptfile.c) with a small cache and readahead: random reads, writes and truncations of an i output are mirrored on a plaintext model, the result is compared with the model and checked as in [4].
+   [7] Async requests: inline and pool requests in flight together, ECB and CTR, against the reference scalar path.
+   [8] Verification: the digest printed by e, d and v must be the reference digest of the plaintext for every thread count, v must write nothing and must refuse a corrupted ciphertext or a different digest.
+   [9] Memory buffers (buffer.c): inline and pool paths, in place or not, against the reference encryption of the padded buffer; a wrong key or length must be refused with the output untouched.
+  [10] Daemon (with its path): a client round trip against the reference, a slot out of range (EINVAL), a slot still busy (EBUSY), an undersized or unsealed ring refused at the handshake.
+
+All the data comes from a fixed-seed generator, so any failure is reproducible. The exit status is 0 only if every check passed.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include "async.h"
+#include "blowfish.h"
+#include "buffer.h"
+#include "cbc.h"
+#include "chunked.h"
+#include "client.h"
+#include "cpu.h"
+#include "cryptfile.h"
+#include "digest.h"
+#include "kernel.h"
+#include "pool.h"
+
+
+#define TEST_KEY "test-key-1234"	//! Key given to the executable.
+#define TEST_NEW_KEY "test-new-key-5678"	//! New key given to the executable when re-keying.
+#define TEST_SLOT_SIZE (8L << 20)	//! Daemon slot size, large enough for a request to still be running when the next one arrives.
+
+
+static long checks = 0;		//! Checks performed.
+static long failures = 0;	//! Checks failed.
+static uint64_t seed = 0x0123456789ABCDEFULL;	//! State of the data generator.
+static const char *executable;	//! Path of blowfish-multithread.
+static char directory[] = "/tmp/blowfish-test-XXXXXX";	//! Scratch directory of the file tests.
+
+
+/**
+ * Known-answer vectors (key, plaintext, ciphertext) of the Blowfish specification, with 8 bytes keys
+ */
+static const char *vectors[][3] = {
+	{"0000000000000000", "0000000000000000", "4EF997456198DD78"},
+	{"FFFFFFFFFFFFFFFF", "FFFFFFFFFFFFFFFF", "51866FD5B85ECB8A"},
+	{"3000000000000000", "1000000000000001", "7D856F9A613063F2"},
+	{"1111111111111111", "1111111111111111", "2466DD878B963C9D"},
+	{"0123456789ABCDEF", "1111111111111111", "61F9C3802281B096"},
+	{"1111111111111111", "0123456789ABCDEF", "7D0CC630AFDA1EC7"},
+	{"FEDCBA9876543210", "0123456789ABCDEF", "0ACEAB0FC6A0A28D"},
+	{"7CA110454A1A6E57", "01A1D6D039776742", "59C68245EB05282B"},
+	{"0131D9619DC1376E", "5CD54CA83DEF57DA", "B1B8CC0B250F09A0"},
+	{"07A1133E4A0B2686", "0248D43806F67172", "1730E5778BEA1DA4"},
+	{"3849674C2602319E", "51454B582DDF440A", "A25E7856CF2651EB"},
+	{"04B915BA43FEB5B6", "42FD443059577FA2", "353882B109CE8F1A"},
+	{"0113B970FD34F2CE", "059B5E0851CF143A", "48F4D0884C379918"},
+	{"0170F175468FB5E6", "0756D8E0774761D2", "432193B78951FC98"},
+	{"43297FAD38E373FE", "762514B829BF486A", "13F04154D69D1AE5"},
+	{"07A7137045DA2A16", "3BDD119049372802", "2EEDDA93FFD39C79"},
+	{"04689104C2FD3B2F", "26955F6835AF609A", "D887E0393C2DA6E3"},
+	{"37D06BB516CB7546", "164D5E404F275232", "5F99D04F5B163969"},
+	{"1F08260D1AC2465E", "6B056E18759F5CCA", "4A057A3B24D3977B"},
+	{"584023641ABA6176", "004BD6EF09176062", "452031C1E4FADA8E"},
+	{"025816164629B007", "480D39006EE762F2", "7555AE39F59B87BD"},
+	{"49793EBC79B3258F", "437540C8698F3CFA", "53C55F9CB49FC019"},
+	{"4FB05E1515AB73A7", "072D43A077075292", "7A8E7BFA937E89A3"},
+	{"49E95D6D4CA229BF", "02FE55778117F12A", "CF9C5D7A4986ADB5"},
+	{"018310DC409B26D6", "1D9D5C5018F728C2", "D1ABB290658BC778"},
+	{"1C587F1C13924FEF", "305532286D6F295A", "55CB3774D13EF201"},
+	{"0101010101010101", "0123456789ABCDEF", "FA34EC4847B268B2"},
+	{"1F1F1F1F0E0E0E0E", "0123456789ABCDEF", "A790795108EA3CAE"},
+	{"E0FEE0FEF1FEF1FE", "0123456789ABCDEF", "C39E072D9FAC631D"},
+	{"0000000000000000", "FFFFFFFFFFFFFFFF", "014933E0CDAFF6E4"},
+	{"FFFFFFFFFFFFFFFF", "0000000000000000", "F21E9A77B71C49BC"},
+	{"0123456789ABCDEF", "0000000000000000", "245946885754369A"},
+	{"FEDCBA9876543210", "FFFFFFFFFFFFFFFF", "6B5C5A9C5D9E0A5A"}
+};
+
+
+/**
+ * @brief Record the outcome of a check, failures are printed with their description
+ */
+static void check(int passed, const char *description)
+{
+	checks++;
+	if(!passed)
+	{
+		failures++;
+		printf("FAIL: %s\n", description);
+	}
+}
+
+
+/**
+ * @brief Next number of the data generator (xorshift64*)
+ */
+static uint64_t random64(void)
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 0x2545F4914F6CDD1DULL;
+}
+
+
+static void random_bytes(unsigned char *data, long length)
+{
+	long i;
+	for(i = 0; i < length; ++i)
+	{
+		data[i] = (unsigned char)(random64() >> 56);
+	}
+}
+
+
+static uint64_t load_be64(const unsigned char *p)
+{
+	uint64_t x = 0;
+	int i;
+	for(i = 0; i < 8; ++i)
+	{
+		x = (x << 8) | p[i];
+	}
+	return x;
+}
+
+
+static void store_be64(unsigned char *p, uint64_t x)
+{
+	int i;
+	for(i = 7; i >= 0; --i, x >>= 8)
+	{
+		p[i] = (unsigned char)x;
+	}
+}
+
+
+static uint64_t parse_hex64(const char *hex)
+{
+	return strtoull(hex, NULL, 16);
+}
+
+
+/**
+ * @brief Reference scalar path: one block at a time with the functions of blowfish.c
+ *
+ * @param direction [in] 'e' or 'd'
+ * @param mode [in] Mode of operation, with the same iv semantic of the kernels
+ */
+static void reference(BLOWFISH_CTX *ctx, char direction, BLOWFISH_MODE mode, const unsigned char *in, unsigned char *out, long blocks, uint64_t *iv)
+{
+	long i;
+
+	for(i = 0; i < blocks; ++i)
+	{
+		uint64_t x = load_be64(in + 8*i);
+		uint64_t y;
+
+		if(mode == BLOWFISH_ECB)
+		{
+			y = (direction == 'e') ? BlowfishEncryption(ctx, x) : BlowfishDecryption(ctx, x);
+		}
+		else if(mode == BLOWFISH_CTR)
+		{
+			y = x ^ BlowfishEncryption(ctx, (*iv)++);
+		}
+		else if(direction == 'e')
+		{
+			y = *iv = BlowfishEncryption(ctx, x ^ *iv);
+		}
+		else
+		{
+			y = BlowfishDecryption(ctx, x) ^ *iv;
+			*iv = x;
+		}
+		store_be64(out + 8*i, y);
+	}
+}
+
+
+/**
+ * @brief [1] Known-answer vectors
+ */
+static void test_vectors(void)
+{
+	unsigned int v;
+	int engine, width;
+	char description[128];
+
+	for(v = 0; v < sizeof(vectors) / sizeof(vectors[0]); ++v)
+	{
+		BLOWFISH_CTX ctx;
+		unsigned char key[8], plaintext[8], ciphertext[8], out[8];
+		uint64_t expected = parse_hex64(vectors[v][2]);
+
+		store_be64(key, parse_hex64(vectors[v][0]));
+		store_be64(plaintext, parse_hex64(vectors[v][1]));
+		store_be64(ciphertext, expected);
+		Blowfish_Init(&ctx, key, 8);
+
+		snprintf(description, sizeof(description), "vector %u scalar", v);
+		check(BlowfishEncryption(&ctx, load_be64(plaintext)) == expected, description);
+		check(BlowfishDecryption(&ctx, expected) == load_be64(plaintext), description);
+		check(BlowfishEncryptionCT(&ctx, load_be64(plaintext)) == expected, description);
+		check(BlowfishDecryptionCT(&ctx, expected) == load_be64(plaintext), description);
+
+		for(engine = 0; engine < 2; ++engine)
+		{
+			for(width = 1; width <= KERNEL_WIDTH_MAX; width *= 2)
+			{
+				snprintf(description, sizeof(description), "vector %u kernel engine %d width %d", v, engine, width);
+				Blowfish_SelectKernel((BLOWFISH_ENGINE)engine, 'e', BLOWFISH_ECB, width)(&ctx, plaintext, out, 1, NULL);
+				check(memcmp(out, ciphertext, 8) == 0, description);
+				Blowfish_SelectKernel((BLOWFISH_ENGINE)engine, 'd', BLOWFISH_ECB, width)(&ctx, ciphertext, out, 1, NULL);
+				check(memcmp(out, plaintext, 8) == 0, description);
+			}
+		}
+	}
+}
+
+
+/**
+ * @brief [2] Kernels, multi-stream CBC and batched key schedule against the reference scalar path
+ */
+static void test_kernels(void)
+{
+	static const char directions[] = {'e', 'd'};
+	static const char *mode_names[] = {"ecb", "ctr", "cbc"};
+	BLOWFISH_CTX ctx;
+	unsigned char key[56];
+	unsigned char *in = (unsigned char *) malloc(8 * 1024);
+	unsigned char *expected = (unsigned char *) malloc(8 * 1024);
+	unsigned char *out = (unsigned char *) malloc(8 * 1024);
+	char description[128];
+	int engine, d, mode, width, round;
+
+	random_bytes(key, sizeof(key));
+	Blowfish_Init(&ctx, key, 13);
+
+	for(engine = 0; engine < 2; ++engine)
+	for(d = 0; d < 2; ++d)
+	for(mode = BLOWFISH_ECB; mode <= BLOWFISH_CBC; ++mode)
+	for(width = 1; width <= KERNEL_WIDTH_MAX; width *= 2)
+	for(round = 0; round < 4; ++round)
+	{
+		long blocks = random64() % (engine ? 40 : 1024);	//! The constant-time engine is slow, shorter buffers.
+		long split = blocks ? random64() % (blocks + 1) : 0;	//! The kernel is called twice, the iv must carry the stream over.
+		uint64_t iv = random64();
+		uint64_t reference_iv = iv;
+		BLOWFISH_KERNEL kernel = Blowfish_SelectKernel((BLOWFISH_ENGINE)engine, directions[d], (BLOWFISH_MODE)mode, width);
+
+		random_bytes(in, 8 * blocks);
+		reference(&ctx, directions[d], (BLOWFISH_MODE)mode, in, expected, blocks, &reference_iv);
+		memcpy(out, in, 8 * blocks);
+		kernel(&ctx, out, out, split, &iv);
+		kernel(&ctx, out + 8*split, out + 8*split, blocks - split, &iv);
+
+		snprintf(description, sizeof(description), "kernel engine %d %c %s width %d blocks %ld split %ld", engine, directions[d], mode_names[mode], width, blocks, split);
+		check(memcmp(out, expected, 8 * blocks) == 0, description);
+		check((mode == BLOWFISH_ECB) || (iv == reference_iv), description);
+	}
+
+	// Multi-stream CBC: streams of different keys and lengths, every width and a few thread counts
+	for(round = 0; round < 24; ++round)
+	{
+		BLOWFISH_CTX keys[3];
+		BLOWFISH_STREAM streams[16];
+		uint64_t ivs[16];
+		int count = 1 + random64() % 16;
+		int threads = 1 + random64() % 4;
+		long offset = 0;
+		int s;
+
+		width = 1 << (random64() % 4);
+		engine = (round % 6 == 0);
+		for(s = 0; s < 3; ++s)
+		{
+			random_bytes(key, 8);
+			Blowfish_Init(&keys[s], key, 8);
+		}
+		for(s = 0; s < count; ++s)
+		{
+			long blocks = random64() % (engine ? 8 : 64);
+			random_bytes(in + offset, 8 * blocks);
+			memcpy(out + offset, in + offset, 8 * blocks);
+			ivs[s] = random64();
+			streams[s].ctx = &keys[s % 3];
+			streams[s].in = out + offset;
+			streams[s].out = out + offset;
+			streams[s].blocks = blocks;
+			streams[s].iv = ivs[s];
+			reference(&keys[s % 3], 'e', BLOWFISH_CBC, in + offset, expected + offset, blocks, &ivs[s]);
+			offset += 8 * blocks;
+		}
+		cbc_encrypt_streams((BLOWFISH_ENGINE)engine, streams, count, width, threads);
+
+		snprintf(description, sizeof(description), "cbc streams engine %d count %d width %d threads %d", engine, count, width, threads);
+		check(memcmp(out, expected, offset) == 0, description);
+		for(s = 0; s < count; ++s)
+		{
+			check(streams[s].iv == ivs[s], description);
+		}
+	}
+
+	// Batched key schedule
+	for(round = 0; round < 4; ++round)
+	{
+		BLOWFISH_CTX batch[BLOWFISH_BATCH_MAX], single;
+		unsigned char batch_keys[BLOWFISH_BATCH_MAX][56];
+		unsigned char *keys[BLOWFISH_BATCH_MAX];
+		int lengths[BLOWFISH_BATCH_MAX];
+		int count = 1 + random64() % BLOWFISH_BATCH_MAX;
+		int k;
+
+		for(k = 0; k < count; ++k)
+		{
+			lengths[k] = 4 + random64() % 53;
+			random_bytes(batch_keys[k], lengths[k]);
+			keys[k] = batch_keys[k];
+		}
+		Blowfish_InitBatch(batch, keys, lengths, count);
+		for(k = 0; k < count; ++k)
+		{
+			Blowfish_Init(&single, keys[k], lengths[k]);
+			snprintf(description, sizeof(description), "batched key schedule key %d of %d", k, count);
+			check(memcmp(&single, &batch[k], sizeof(BLOWFISH_CTX)) == 0, description);
+		}
+	}
+
+	free(in);
+	free(expected);
+	free(out);
+}
+
+
+/**
+ * @brief Write a whole file
+ */
+static void write_file(const char *filename, const unsigned char *data, long length)
+{
+	FILE *file = fopen(filename, "w");
+	if((file == NULL) || (length && (fwrite(data, length, 1, file) != 1)))
+	{
+		perror("Problem writing a test file\n");
+		exit(EXIT_FAILURE);
+	}
+	fclose(file);
+}
+
+
+/**
+ * @brief Read a whole file
+ *
+ * @return File content (to be freed), NULL if the file cannot be read
+ */
+static unsigned char *read_file(const char *filename, long *length)
+{
+	FILE *file = fopen(filename, "r");
+	unsigned char *data;
+
+	if(file == NULL)
+	{
+		return NULL;
+	}
+	fseek(file, 0L, SEEK_END);
+	*length = ftell(file);
+	rewind(file);
+	data = (unsigned char *) malloc(*length + 1);
+	if((data == NULL) || (*length && (fread(data, *length, 1, file) != 1)))
+	{
+		perror("Problem reading a test file\n");
+		exit(EXIT_FAILURE);
+	}
+	fclose(file);
+	return data;
+}
+
+
+/**
+ * @brief Run the executable
+ *
+ * @param output [out] First line printed by the executable (may be NULL)
+ * @return Exit status, -1 if it could not be run
+ */
+static int run(char mode, const char *input, const char *output_filename, int threads, const char *options, char *output, int output_size)
+{
+	char command[1024];
+	char line[256] = "";
+	FILE *pipe;
+
+	snprintf(command, sizeof(command), "%s %c %s/%s %s %s/%s %d %s 2>/dev/null", executable, mode, directory, input, TEST_KEY, directory, output_filename, threads, options);
+	pipe = popen(command, "r");
+	if(pipe == NULL)
+	{
+		return -1;
+	}
+	if(fgets(line, sizeof(line), pipe) != NULL)
+	{
+		while(fgetc(pipe) != EOF);
+	}
+	if(output != NULL)
+	{
+		snprintf(output, output_size, "%s", line);
+	}
+	return pclose(pipe);
+}
+
+
+/**
+ * @brief Encrypt a file of the given size to a pipe (the writes cannot seek), checking what comes out against the reference
+ */
+static void test_pipe(BLOWFISH_CTX *ctx, long size, int threads)
+{
+	unsigned char *plaintext = (unsigned char *) malloc(size + 8);
+	unsigned char *expected = (unsigned char *) malloc(size + 8);
+	unsigned char *data = (unsigned char *) malloc(size + 16);
+	char command[1024];
+	char path[256];
+	char description[256];
+	long padded = size - size%8 + 8;
+	long length = 0;
+	size_t result;
+	FILE *pipe;
+
+	random_bytes(plaintext, size);
+	memcpy(expected, plaintext, size);
+	memset(expected + size, (int)(padded - size), padded - size);
+	reference(ctx, 'e', BLOWFISH_ECB, expected, expected, padded / 8, NULL);
+
+	snprintf(path, sizeof(path), "%s/plain", directory);
+	write_file(path, plaintext, size);
+	snprintf(description, sizeof(description), "pipe size %ld threads %d", size, threads);
+
+	snprintf(command, sizeof(command), "%s e %s/plain %s /dev/stdout %d --frame-size=4096 2>/dev/null", executable, directory, TEST_KEY, threads);
+	pipe = popen(command, "r");
+	while((pipe != NULL) && (length < size + 16) && ((result = fread(data + length, 1, size + 16 - length, pipe)) > 0))
+	{
+		length += result;
+	}
+	check((pipe != NULL) && (pclose(pipe) == 0) && (length == padded) && (memcmp(data, expected, padded) == 0), description);
+
+	free(plaintext);
+	free(expected);
+	free(data);
+}
+
+/**
+ * @brief Encrypt to a pipe whose reader exits after a few bytes (as head -c 40): the executable must fail instead of blocking on the full pipe
+ */
+static void test_pipe_closed(int threads)
+{
+	long size = 8L << 20;	//! Far more than a pipe holds.
+	unsigned char *plaintext = (unsigned char *) malloc(size);
+	unsigned char head[40];
+	char path[256];
+	char thread_count[16];
+	int pipe_fds[2];
+	pid_t pid = -1;
+	int status = 0;
+	int waited = 0;
+
+	random_bytes(plaintext, size);
+	snprintf(path, sizeof(path), "%s/plain", directory);
+	write_file(path, plaintext, size);
+	free(plaintext);
+	snprintf(thread_count, sizeof(thread_count), "%d", threads);
+
+	if(pipe(pipe_fds) == 0)
+	{
+		pid = fork();
+		if(pid == 0)
+		{
+			int null_fd = open("/dev/null", O_WRONLY);
+			dup2(pipe_fds[1], STDOUT_FILENO);
+			dup2(null_fd, STDERR_FILENO);
+			close(pipe_fds[0]);
+			close(pipe_fds[1]);
+			execl(executable, executable, "e", path, TEST_KEY, "/dev/stdout", thread_count, (char *)NULL);
+			_exit(127);
+		}
+		close(pipe_fds[1]);
+		if(read(pipe_fds[0], head, sizeof(head)) < 0)
+		{
+			pid = -1;
+		}
+		close(pipe_fds[0]);
+	}
+
+	// At most 10 s, then the executable is considered stuck
+	while((pid > 0) && (waited < 200) && (waitpid(pid, &status, WNOHANG) == 0))
+	{
+		usleep(50000);
+		waited++;
+	}
+	if((pid > 0) && (waited == 200))
+	{
+		kill(pid, SIGKILL);
+		waitpid(pid, &status, 0);
+	}
+	check((pid > 0) && (waited < 200) && !(WIFEXITED(status) && (WEXITSTATUS(status) == 0)), "pipe closed early by the reader ends the process with a failure");
+}
+
+
+
+/**
+ * @brief Encrypt and decrypt a file of the given size with the executable, checking the ciphertext against the reference
+ */
+static void test_file(BLOWFISH_CTX *ctx, long size, int threads, const char *options)
+{
+	unsigned char *plaintext = (unsigned char *) malloc(size + 8);
+	unsigned char *expected = (unsigned char *) malloc(size + 8);
+	unsigned char *data;
+	char path[256];
+	char description[256];
+	long padded = size - size%8 + 8;	//! Ciphertext length, the padding is always present (1 to 8 bytes).
+	long length = 0;
+
+	random_bytes(plaintext, size);
+	memcpy(expected, plaintext, size);
+	memset(expected + size, (int)(padded - size), padded - size);
+	reference(ctx, 'e', BLOWFISH_ECB, expected, expected, padded / 8, NULL);
+
+	snprintf(path, sizeof(path), "%s/plain", directory);
+	write_file(path, plaintext, size);
+	snprintf(description, sizeof(description), "file size %ld threads %d %s", size, threads, options);
+
+	check(run('e', "plain", "cipher", threads, options, NULL, 0) == 0, description);
+	snprintf(path, sizeof(path), "%s/cipher", directory);
+	data = read_file(path, &length);
+	check((data != NULL) && (length == padded) && (memcmp(data, expected, padded) == 0), description);
+	free(data);
+
+	check(run('d', "cipher", "decrypted", threads, options, NULL, 0) == 0, description);
+	snprintf(path, sizeof(path), "%s/decrypted", directory);
+	data = read_file(path, &length);
+	check((data != NULL) && (length == size) && (memcmp(data, plaintext, size) == 0), description);
+	free(data);
+
+	free(plaintext);
+	free(expected);
+}
+
+
+/**
+ * @brief Make perf_event_open() fail with ENOSYS in the calling process and its children, as in a container or a VM without PMU
+ *
+ * @return 0 on success, -1 on error
+ */
+static int deny_perf_events(void)
+{
+	struct sock_filter filter[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_perf_event_open, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | ENOSYS),
+		BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
+	};
+	struct sock_fprog program = {sizeof(filter) / sizeof(filter[0]), filter};
+
+	if(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0)
+	{
+		return -1;
+	}
+	return prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program);
+}
+
+
+/**
+ * @brief Encrypt the plain file with --profile and check the report: the three phases of every thread, of the main thread and of the total
+ *
+ * @param without_counters [in] 1 to deny perf_event_open() to the executable: every figure but the wall time must then be n/a
+ */
+static void test_profile(int threads, int without_counters)
+{
+	static const char *phases[] = {"read", "compute", "write"};
+	char command[1024];
+	char output[16384] = "";
+	char description[256];
+	char prefix[64];
+	char name[16];
+	char *found;
+	int pipe_fds[2];
+	long length = 0;
+	ssize_t result;
+	pid_t pid = -1;
+	int status = -1;
+	int lines = 0;
+	int unavailable = 0;
+	int t, p;
+
+	snprintf(command, sizeof(command), "%s e %s/plain %s %s/cipher %d --profile 2>/dev/null", executable, directory, TEST_KEY, directory, threads);
+	snprintf(description, sizeof(description), "profile report threads %d%s", threads, without_counters ? " without counters" : "");
+
+	if(pipe(pipe_fds) == 0)
+	{
+		pid = fork();
+		if(pid == 0)
+		{
+			dup2(pipe_fds[1], STDOUT_FILENO);
+			close(pipe_fds[0]);
+			close(pipe_fds[1]);
+			if(without_counters && (deny_perf_events() != 0))
+			{
+				_exit(127);
+			}
+			execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+			_exit(127);
+		}
+		close(pipe_fds[1]);
+		while((result = read(pipe_fds[0], output + length, sizeof(output) - 1 - length)) > 0)
+		{
+			length += result;
+		}
+		output[length] = '\0';
+		close(pipe_fds[0]);
+	}
+	check((pid > 0) && (waitpid(pid, &status, 0) == pid) && WIFEXITED(status) && (WEXITSTATUS(status) == 0), description);
+
+	for(t = 0; t < threads + 2; ++t)
+	{
+		snprintf(name, sizeof(name), (t < threads) ? "thread%d" : ((t == threads) ? "main" : "total"), t);
+		for(p = 0; p < 3; ++p)
+		{
+			snprintf(prefix, sizeof(prefix), "Profile %-8s %-8s ", name, phases[p]);
+			lines += (strstr(output, prefix) != NULL);
+		}
+	}
+	check(lines == 3 * (threads + 2), description);
+
+	if(without_counters)
+	{
+		// IPC and the three events per KB of every line
+		for(found = strstr(output, "n/a"); found != NULL; found = strstr(found + 1, "n/a"))
+		{
+			unavailable++;
+		}
+		check(unavailable == 4 * 3 * (threads + 2), description);
+	}
+}
+
+
+/**
+ * @brief Auto thread count: one thread per CPU of the affinity mask (and of the cgroup quota), fewer for small files
+ */
+static void test_auto_threads(void)
+{
+	long size = 32L << 20;	//! Enough work for several threads at any single-thread throughput (CPU_MIN_THREAD_SECONDS each).
+	unsigned char *plaintext = (unsigned char *) malloc(size);
+	cpu_set_t original, restricted;
+	char path[256];
+	char output[256];
+	int available = cpu_available();
+	int threads = 0;
+	int restricted_threads = 0;
+	int cpu;
+
+	random_bytes(plaintext, size);
+	snprintf(path, sizeof(path), "%s/plain", directory);
+	write_file(path, plaintext, size);
+	free(plaintext);
+
+	check((run('e', "plain", "cipher", 0, "", output, sizeof(output)) == 0) && (sscanf(output, "Threads: %d", &threads) == 1) && (threads >= 1) && (threads <= available), "auto threads within the available CPUs");
+	check((available == 1) || (threads > 1), "auto threads use several CPUs on a large file");
+
+	// Restricted to the first CPU of the mask (as taskset -c), inherited by the executable
+	check(sched_getaffinity(0, sizeof(original), &original) == 0, "auto threads affinity");
+	CPU_ZERO(&restricted);
+	for(cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+	{
+		if(CPU_ISSET(cpu, &original))
+		{
+			CPU_SET(cpu, &restricted);
+			break;
+		}
+	}
+	check(sched_setaffinity(0, sizeof(restricted), &restricted) == 0, "auto threads affinity");
+	check(cpu_available() == 1, "one CPU available under a one-CPU affinity");
+	check((run('e', "plain", "cipher", 0, "", output, sizeof(output)) == 0) && (sscanf(output, "Threads: %d", &restricted_threads) == 1) && (restricted_threads == 1), "auto threads follow a one-CPU affinity");
+	sched_setaffinity(0, sizeof(original), &original);
+	check(cpu_available() == available, "auto threads affinity restored");
+}
+
+
+/**
+ * @brief [3] e and d on boundary sizes, thread counts, frame sizes and engines
+ */
+static void test_files(void)
+{
+	static const int thread_counts[] = {1, 2, 3, 4, 7, 8, 16};
+	static const int offsets[] = {-9, -8, -1, 0, 1, 7, 8, 9};
+	static const char *frame_options[] = {"--frame-size=1", "--frame-size=4096", "--frame-size=12288", "--frame-size=20000"};
+	BLOWFISH_CTX ctx;
+	unsigned char *data;
+	char path[256];
+	long size, length;
+	unsigned int t, k, f;
+
+	Blowfish_Init(&ctx, (unsigned char *)TEST_KEY, strlen(TEST_KEY));
+
+	for(t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); ++t)
+	{
+		int threads = thread_counts[t];
+
+		for(size = 0; size < 18; ++size)
+		{
+			test_file(&ctx, size, threads, "");
+		}
+		// Blocks are multiples of 4096 bytes (writer alignment), so the reminder and the padding change around multiples of 4096*max_threads (+8 bytes of padding block when decrypting)
+		for(k = 0; k < sizeof(offsets) / sizeof(offsets[0]); ++k)
+		{
+			test_file(&ctx, 4096L * threads + offsets[k], threads, "");
+			test_file(&ctx, 2 * 4096L * threads + 8 + offsets[k], threads, "");
+		}
+	}
+
+	// Several frames per block, the last one shorter
+	for(t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t += 2)
+	{
+		for(f = 0; f < sizeof(frame_options) / sizeof(frame_options[0]); ++f)
+		{
+			test_file(&ctx, 5 * 4096L * thread_counts[t] + 4096 + 13, thread_counts[t], frame_options[f]);
+		}
+	}
+
+	test_file(&ctx, 100000, 3, "--engine=ct");
+	test_file(&ctx, 20003, 2, "--engine=ct --frame-size=4096");
+	test_file(&ctx, 300000, 4, "--fsync");
+	test_file(&ctx, 300000, 3, "--profile");	// With or without hardware counters (containers), the output is the same
+	test_profile(3, 0);
+	test_profile(3, 1);
+	test_file(&ctx, 300000, 0, "");	// auto
+	test_auto_threads();
+
+	// Non-seekable output (popen() gives a pipe): the frames must come out in file order
+	test_pipe(&ctx, 7, 2);
+	test_pipe(&ctx, 5 * 4096L * 3 + 4096 + 13, 3);
+	test_pipe(&ctx, 300000, 8);
+	test_pipe(&ctx, 300000, 0);	// auto: the "Threads:" report must not end up in the data
+	test_pipe_closed(2);
+
+	// Invalid ciphertexts must be refused
+	test_file(&ctx, 1000, 2, "");
+	snprintf(path, sizeof(path), "%s/cipher", directory);
+	data = read_file(path, &length);
+	write_file(path, data, length - 3);
+	check(run('d', "cipher", "decrypted", 2, "", NULL, 0) != 0, "truncated ciphertext refused");
+	data[length - 1] ^= 0x5A;
+	write_file(path, data, length);
+	check(run('d', "cipher", "decrypted", 2, "", NULL, 0) != 0, "corrupted padding refused");
+	free(data);
+}
+
+
+/**
+ * @brief Check a chunked ciphertext against the reference counter mode built from its manifest
+ */
+static void check_chunked(BLOWFISH_CTX *ctx, const unsigned char *plaintext, long size, const char *description)
+{
+	CHUNK_MANIFEST manifest;
+	unsigned char *data;
+	unsigned char keystream[8];
+	char path[256];
+	long length = 0;
+	long i;
+	uint64_t chunk;
+
+	snprintf(path, sizeof(path), "%s/chunked%s", directory, MANIFEST_SUFFIX);
+	if(manifest_load(path, &manifest) != 0)
+	{
+		check(0, description);
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/chunked", directory);
+	data = read_file(path, &length);
+	check((data != NULL) && (length == size) && (manifest.file_length == (uint64_t)size), description);
+
+	for(chunk = 0; (data != NULL) && (length == size) && (chunk < manifest.chunk_count); ++chunk)
+	{
+		uint64_t counter = chunk_counter(&manifest, chunk, manifest.chunks[chunk].generation);
+		long start = chunk * manifest.chunk_size;
+		long end = (start + (long)manifest.chunk_size < size) ? start + (long)manifest.chunk_size : size;
+		int mismatch = 0;
+
+		for(i = start; i < end; ++i)
+		{
+			if((i - start) % 8 == 0)
+			{
+				store_be64(keystream, BlowfishEncryption(ctx, counter + (i - start) / 8));
+			}
+			mismatch |= (data[i] ^ keystream[(i - start) % 8]) != plaintext[i];
+		}
+		check(!mismatch, description);
+	}
+
+	free(data);
+	manifest_free(&manifest);
+}
+
+
+/**
+ * @brief [4] Chunked layout (i and x)
+ */
+static void test_chunked(void)
+{
+	BLOWFISH_CTX ctx;
+	long size = 2 * CHUNK_SIZE_DEFAULT + CHUNK_SIZE_DEFAULT / 2 + 5;	//! Three chunks, the last one shorter and not a multiple of 8.
+	unsigned char *plaintext = (unsigned char *) malloc(size);
+	unsigned char *data;
+	unsigned char *saved;
+	char path[256];
+	char output[256];
+	char manifest_path[256];
+	long length = 0;
+	int threads;
+
+	CHUNK_MANIFEST manifest = {0};
+	CHUNK_MANIFEST previous, current;
+
+	Blowfish_Init(&ctx, (unsigned char *)TEST_KEY, strlen(TEST_KEY));
+
+	// Counter ranges of different chunks and generations never overlap, even at the limits and with the nonce wrapping around
+	manifest.nonce = ~0ULL - 5;
+	check((chunk_counter(&manifest, 1, 7) - chunk_counter(&manifest, 0, 7) == CHUNK_SIZE_MAX / 8) && (chunk_counter(&manifest, 0, 8) - chunk_counter(&manifest, CHUNK_COUNT_MAX - 1, 7) == CHUNK_SIZE_MAX / 8) && (chunk_counter(&manifest, CHUNK_COUNT_MAX - 1, CHUNK_GENERATION_MAX) - chunk_counter(&manifest, 0, 0) == ~0ULL - CHUNK_SIZE_MAX / 8 + 1), "chunk counters disjoint");
+
+	for(threads = 1; threads <= 4; threads += 3)
+	{
+		snprintf(path, sizeof(path), "%s/chunked%s", directory, MANIFEST_SUFFIX);
+		unlink(path);
+		random_bytes(plaintext, size);
+		snprintf(path, sizeof(path), "%s/plain", directory);
+		write_file(path, plaintext, size);
+
+		check((run('i', "plain", "chunked", threads, "", output, sizeof(output)) == 0) && (strcmp(output, "Chunks written: 3\n") == 0), "chunked first run writes every chunk");
+		check_chunked(&ctx, plaintext, size, "chunked first run ciphertext");
+
+		check((run('i', "plain", "chunked", threads, "", output, sizeof(output)) == 0) && (strcmp(output, "Chunks written: 0\n") == 0), "chunked unchanged run writes nothing");
+
+		plaintext[CHUNK_SIZE_DEFAULT + 17] ^= 1;
+		write_file(path, plaintext, size);
+		check((run('i', "plain", "chunked", threads, "", output, sizeof(output)) == 0) && (strcmp(output, "Chunks written: 1\n") == 0), "chunked run rewrites the changed chunk only");
+		check_chunked(&ctx, plaintext, size, "chunked incremental ciphertext");
+
+		check(run('x', "chunked", "decrypted", threads, "", NULL, 0) == 0, "chunked decryption");
+		snprintf(path, sizeof(path), "%s/decrypted", directory);
+		data = read_file(path, &length);
+		check((data != NULL) && (length == size) && (memcmp(data, plaintext, size) == 0), "chunked decryption plaintext");
+		free(data);
+	}
+
+	// Interrupted update: the pending manifest is stored but chunk 1 still holds its previous generation
+	snprintf(manifest_path, sizeof(manifest_path), "%s/chunked%s", directory, MANIFEST_SUFFIX);
+	snprintf(path, sizeof(path), "%s/chunked", directory);
+	manifest_load(manifest_path, &previous);
+	saved = read_file(path, &length);
+
+	plaintext[CHUNK_SIZE_DEFAULT + 17] ^= 1;
+	snprintf(output, sizeof(output), "%s/plain", directory);
+	write_file(output, plaintext, size);
+	check(run('i', "plain", "chunked", 2, "", NULL, 0) == 0, "chunked update before the interruption");
+	write_file(path, saved, length);
+	if(manifest_load(manifest_path, &current) == 0)
+	{
+		current.pending = 1;
+		current.chunks[1].previous_generation = previous.chunks[1].generation;
+		current.chunks[1].previous_digest = previous.chunks[1].digest;
+		manifest_store(manifest_path, &current);
+		manifest_free(&current);
+	}
+	plaintext[CHUNK_SIZE_DEFAULT + 17] ^= 1;	// Chunk 1 is recovered in its previous version
+
+	check(run('x', "chunked", "decrypted", 2, "", NULL, 0) == 0, "chunked decryption of an interrupted update");
+	snprintf(output, sizeof(output), "%s/decrypted", directory);
+	data = read_file(output, &length);
+	check((data != NULL) && (length == size) && (memcmp(data, plaintext, size) == 0), "chunked interrupted update recovers the previous chunk");
+	free(data);
+
+	plaintext[CHUNK_SIZE_DEFAULT + 17] ^= 1;
+	check((run('i', "plain", "chunked", 2, "", output, sizeof(output)) == 0) && (strcmp(output, "Chunks written: 3\n") == 0), "chunked run after an interruption rewrites every chunk");
+	check_chunked(&ctx, plaintext, size, "chunked ciphertext after an interruption");
+
+	// A corrupted chunk is refused instead of being decrypted to garbage
+	data = read_file(path, &length);
+	data[5] ^= 1;
+	write_file(path, data, length);
+	check(run('x', "chunked", "decrypted", 2, "", NULL, 0) != 0, "chunked corrupted chunk refused");
+	free(data);
+
+	free(saved);
+	manifest_free(&previous);
+	free(plaintext);
+}
+
+
+/**
+ * @brief [5] Re-keying (r) of e outputs
+ */
+static void test_rekey(void)
+{
+	static const long sizes[] = {0, 7, 8, 3 * 4096 - 8, 3 * 4096 + 1, 100003, 300000};
+	static const int thread_counts[] = {1, 3, 8};
+	BLOWFISH_CTX ctx;
+	unsigned char *plaintext = (unsigned char *) malloc(300000 + 8);
+	unsigned char *expected = (unsigned char *) malloc(300000 + 8);
+	unsigned char *data;
+	char path[256];
+	char description[256];
+	long length = 0;
+	unsigned int s, t;
+
+	Blowfish_Init(&ctx, (unsigned char *)TEST_NEW_KEY, strlen(TEST_NEW_KEY));
+
+	for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+	{
+		long size = sizes[s];
+		long padded = size - size%8 + 8;
+
+		random_bytes(plaintext, size);
+		memcpy(expected, plaintext, size);
+		memset(expected + size, (int)(padded - size), padded - size);
+		reference(&ctx, 'e', BLOWFISH_ECB, expected, expected, padded / 8, NULL);
+
+		snprintf(path, sizeof(path), "%s/plain", directory);
+		write_file(path, plaintext, size);
+		check(run('e', "plain", "cipher", 2, "", NULL, 0) == 0, "re-key input");
+
+		for(t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); ++t)
+		{
+			snprintf(description, sizeof(description), "re-key size %ld threads %d", size, thread_counts[t]);
+			check(run('r', "cipher", "rekeyed", thread_counts[t], "--frame-size=4096 --new-key=" TEST_NEW_KEY, NULL, 0) == 0, description);
+			snprintf(path, sizeof(path), "%s/rekeyed", directory);
+			data = read_file(path, &length);
+			check((data != NULL) && (length == padded) && (memcmp(data, expected, padded) == 0), description);
+			free(data);
+		}
+	}
+
+	// The output is encrypted with the new key, so TEST_KEY is now the wrong old key
+	check(run('r', "rekeyed", "cipher", 2, "--new-key=" TEST_NEW_KEY, NULL, 0) != 0, "re-key with a wrong key refused");
+	check(run('r', "cipher", "rekeyed", 2, "", NULL, 0) != 0, "re-key without a new key refused");
+
+	free(plaintext);
+	free(expected);
+}
+
+
+/**
+ * @brief [6] Random access to a chunked ciphertext
+ */
+static void test_cryptfile(void)
+{
+	BLOWFISH_CTX ctx;
+	CRYPTFILE file;
+	POOL pool;
+	long capacity = 5 * CHUNK_SIZE_DEFAULT;	//! The file never grows beyond it, the model is zero past size.
+	long size = 3 * CHUNK_SIZE_DEFAULT + CHUNK_SIZE_DEFAULT / 2 + 5;
+	unsigned char *model = (unsigned char *) calloc(capacity, 1);
+	unsigned char *data = (unsigned char *) malloc(capacity);
+	unsigned char *saved;
+	unsigned char *update;
+	char path[256];
+	char output[256];
+	long length = 0;
+	pid_t pid;
+	int status;
+	int i;
+
+	Blowfish_Init(&ctx, (unsigned char *)TEST_KEY, strlen(TEST_KEY));
+	pool_create(&pool, 2);
+
+	snprintf(path, sizeof(path), "%s/chunked%s", directory, MANIFEST_SUFFIX);
+	unlink(path);
+	random_bytes(model, size);
+	snprintf(path, sizeof(path), "%s/plain", directory);
+	write_file(path, model, size);
+	check(run('i', "plain", "chunked", 2, "", NULL, 0) == 0, "cryptfile input");
+
+	snprintf(path, sizeof(path), "%s/chunked", directory);
+	check(cryptfile_open(&file, &ctx, BLOWFISH_ENGINE_TABLE, path, 0, &pool, 3, 1) == 0, "cryptfile open");
+	check((cryptfile_read(&file, data, capacity, 0) == size) && (memcmp(data, model, size) == 0), "cryptfile whole read");
+
+	for(i = 0; i < 200; ++i)
+	{
+		long offset = random64() % (size + 10);
+		long count = random64() % (2 * CHUNK_SIZE_DEFAULT);
+		long expected = (offset + count > size) ? ((offset < size) ? size - offset : 0) : count;
+
+		check((cryptfile_read(&file, data, count, offset) == expected) && (memcmp(data, model + offset, expected) == 0), "cryptfile random read");
+	}
+
+	for(i = 0; i < 120; ++i)
+	{
+		int operation = random64() % 10;
+
+		if(operation == 0)
+		{
+			long new_size = random64() % capacity;
+			if(new_size < size)
+			{
+				memset(model + new_size, 0, size - new_size);
+			}
+			size = new_size;
+			check(cryptfile_truncate(&file, size) == 0, "cryptfile truncate");
+		}
+		else
+		{
+			long offset = (operation == 1) ? (long)(random64() % 4) * CHUNK_SIZE_DEFAULT : (long)(random64() % (size + CHUNK_SIZE_DEFAULT / 2));	// Whole chunks, or anywhere (holes too)
+			long count = (operation == 1) ? CHUNK_SIZE_DEFAULT : (long)(random64() % (CHUNK_SIZE_DEFAULT + CHUNK_SIZE_DEFAULT / 2)) + 1;
+			if(offset >= capacity)
+			{
+				offset = capacity - 1;
+			}
+			if(offset + count > capacity)
+			{
+				count = capacity - offset;
+			}
+			random_bytes(model + offset, count);
+			if(offset + count > size)
+			{
+				size = offset + count;
+			}
+			check(cryptfile_write(&file, model + offset, count, offset) == count, "cryptfile write");
+		}
+
+		if(i % 10 == 9)
+		{
+			check((cryptfile_length(&file) == size) && (cryptfile_read(&file, data, capacity, 0) == size) && (memcmp(data, model, size) == 0), "cryptfile read after writes");
+		}
+		if(i % 40 == 39)
+		{
+			check(cryptfile_flush(&file) == 0, "cryptfile flush");
+			check_chunked(&ctx, model, size, "cryptfile flushed ciphertext");
+		}
+	}
+	check(cryptfile_close(&file) == 0, "cryptfile close");
+	check_chunked(&ctx, model, size, "cryptfile ciphertext");
+
+	check(run('x', "chunked", "decrypted", 2, "", NULL, 0) == 0, "cryptfile decryption");
+	snprintf(path, sizeof(path), "%s/decrypted", directory);
+	free(data);
+	data = read_file(path, &length);
+	check((data != NULL) && (length == size) && (memcmp(data, model, size) == 0), "cryptfile decryption plaintext");
+	free(data);
+
+	// Interrupted write-back: a child writes chunks 0 to 2 through a 2-entry cache, so chunk 0 is evicted (journaled and written), and dies without flushing
+	size = 3 * CHUNK_SIZE_DEFAULT + 5;
+	random_bytes(model, size);
+	snprintf(path, sizeof(path), "%s/plain", directory);
+	write_file(path, model, size);
+	check(run('i', "plain", "chunked", 2, "", NULL, 0) == 0, "cryptfile interrupted input");
+	snprintf(path, sizeof(path), "%s/chunked", directory);
+	saved = read_file(path, &length);
+	update = (unsigned char *) malloc(3 * CHUNK_SIZE_DEFAULT);
+	random_bytes(update, 3 * CHUNK_SIZE_DEFAULT);
+
+	pid = fork();
+	if(pid == 0)
+	{
+		if((cryptfile_open(&file, &ctx, BLOWFISH_ENGINE_TABLE, path, 0, NULL, 2, 0) != 0) || (cryptfile_write(&file, update, 3 * CHUNK_SIZE_DEFAULT, 0) != 3 * CHUNK_SIZE_DEFAULT))
+		{
+			_exit(EXIT_FAILURE);
+		}
+		_exit(EXIT_SUCCESS);
+	}
+	check((waitpid(pid, &status, 0) == pid) && WIFEXITED(status) && (WEXITSTATUS(status) == 0), "cryptfile interrupted write-back");
+
+	// Chunk 0 was rewritten, the others were not
+	check(run('x', "chunked", "decrypted", 2, "", NULL, 0) == 0, "cryptfile interrupted write-back decryption");
+	snprintf(output, sizeof(output), "%s/decrypted", directory);
+	data = read_file(output, &length);
+	check((data != NULL) && (length == size) && (memcmp(data, update, CHUNK_SIZE_DEFAULT) == 0) && (memcmp(data + CHUNK_SIZE_DEFAULT, model + CHUNK_SIZE_DEFAULT, size - CHUNK_SIZE_DEFAULT) == 0), "cryptfile interrupted write-back plaintext");
+	free(data);
+
+	// Chunk 0 still in its previous generation: the file is settled on it when opened
+	data = read_file(path, &length);
+	memcpy(data, saved, CHUNK_SIZE_DEFAULT);
+	write_file(path, data, length);
+	free(data);
+	data = (unsigned char *) malloc(capacity);
+	check(cryptfile_open(&file, &ctx, BLOWFISH_ENGINE_TABLE, path, 0, NULL, 2, 0) == 0, "cryptfile open after an interruption");
+	check((cryptfile_read(&file, data, capacity, 0) == size) && (memcmp(data, model, size) == 0), "cryptfile interrupted write-back recovered");
+	check(cryptfile_close(&file) == 0, "cryptfile close after an interruption");
+	check_chunked(&ctx, model, size, "cryptfile ciphertext after an interruption");
+
+	// A corrupted chunk fails to load
+	free(data);
+	data = read_file(path, &length);
+	data[CHUNK_SIZE_DEFAULT + 9] ^= 1;
+	write_file(path, data, length);
+	check(cryptfile_open(&file, &ctx, BLOWFISH_ENGINE_TABLE, path, 0, NULL, 2, 0) == 0, "cryptfile open corrupted");
+	check((cryptfile_read(&file, data, 10, 0) == 10) && (cryptfile_read(&file, data, 10, CHUNK_SIZE_DEFAULT) == -1) && (errno == EIO), "cryptfile corrupted chunk refused");
+	cryptfile_close(&file);
+	free(data);
+	free(update);
+	free(saved);
+
+	// Renamed while open (as the mount does): the manifest follows the ciphertext, the writes after the rename land in it
+	size = 2 * CHUNK_SIZE_DEFAULT + 7;
+	random_bytes(model, size);
+	snprintf(path, sizeof(path), "%s/plain", directory);
+	write_file(path, model, size);
+	check(run('i', "plain", "chunked", 2, "", NULL, 0) == 0, "cryptfile rename input");
+	snprintf(path, sizeof(path), "%s/chunked", directory);
+	snprintf(output, sizeof(output), "%s/renamed", directory);
+	check(cryptfile_open(&file, &ctx, BLOWFISH_ENGINE_TABLE, path, 0, NULL, 2, 0) == 0, "cryptfile open before a rename");
+	random_bytes(model, 100);
+	check(cryptfile_write(&file, model, 100, 0) == 100, "cryptfile write before a rename");
+	check((rename(path, output) == 0) && (cryptfile_rename(&file, output) == 0), "cryptfile rename");
+	random_bytes(model + CHUNK_SIZE_DEFAULT, 100);
+	check(cryptfile_write(&file, model + CHUNK_SIZE_DEFAULT, 100, CHUNK_SIZE_DEFAULT) == 100, "cryptfile write after a rename");
+	check(cryptfile_close(&file) == 0, "cryptfile close after a rename");
+	snprintf(path, sizeof(path), "%s/chunked%s", directory, MANIFEST_SUFFIX);
+	check(access(path, F_OK) != 0, "cryptfile rename moved the manifest");
+	check(run('x', "renamed", "decrypted", 2, "", NULL, 0) == 0, "cryptfile renamed decryption");
+	snprintf(path, sizeof(path), "%s/decrypted", directory);
+	data = read_file(path, &length);
+	check((data != NULL) && (length == size) && (memcmp(data, model, size) == 0), "cryptfile renamed plaintext");
+	free(data);
+
+	// Unlinked while open: the manifest is removed and never stored again, the close still succeeds
+	check(cryptfile_open(&file, &ctx, BLOWFISH_ENGINE_TABLE, output, 0, NULL, 2, 0) == 0, "cryptfile open before an unlink");
+	check((cryptfile_rename(&file, NULL) == 0) && (unlink(output) == 0), "cryptfile unlink");
+	check(cryptfile_write(&file, model, 100, CHUNK_SIZE_DEFAULT / 2) == 100, "cryptfile write after an unlink");
+	check(cryptfile_close(&file) == 0, "cryptfile close after an unlink");
+	snprintf(path, sizeof(path), "%s/renamed%s", directory, MANIFEST_SUFFIX);
+	check((access(path, F_OK) != 0) && (access(output, F_OK) != 0), "cryptfile unlink left nothing");
+
+	// New file, without readahead
+	snprintf(path, sizeof(path), "%s/chunked%s", directory, MANIFEST_SUFFIX);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/chunked", directory);
+	unlink(path);
+	check(cryptfile_open(&file, &ctx, BLOWFISH_ENGINE_TABLE, path, 0, NULL, 2, 0) != 0, "cryptfile missing file refused");
+	check(cryptfile_open(&file, &ctx, BLOWFISH_ENGINE_TABLE, path, 1, NULL, 2, 0) == 0, "cryptfile create");
+	size = CHUNK_SIZE_DEFAULT + 100;
+	random_bytes(model, size);
+	check(cryptfile_write(&file, model + 3, size - 3, 3) == size - 3, "cryptfile write new file");
+	memset(model, 0, 3);
+	check(cryptfile_close(&file) == 0, "cryptfile close new file");
+	check_chunked(&ctx, model, size, "cryptfile new file ciphertext");
+
+	pool_destroy(&pool);
+	free(model);
+}
+
+
+/**
+ * @brief [7] Async requests
+ */
+static void test_async(void)
+{
+	enum { REQUESTS = 12, MAX_BLOCKS = 8192 };
+	static const char directions[] = {'e', 'd'};
+	BLOWFISH_CTX ctx;
+	POOL pool;
+	ASYNC async;
+	ASYNC_REQUEST requests[REQUESTS];
+	unsigned char *data = (unsigned char *) malloc(REQUESTS * MAX_BLOCKS * 8);
+	unsigned char *expected = (unsigned char *) malloc(REQUESTS * MAX_BLOCKS * 8);
+	struct pollfd event;
+	int queued = 0;
+	int completed = 0;
+	int round, r;
+
+	Blowfish_Init(&ctx, (unsigned char *)TEST_KEY, strlen(TEST_KEY));
+	check((pool_create(&pool, 3) == 0) && (async_create(&async, &pool, BLOWFISH_ENGINE_TABLE, 0) == -1) && (errno == EINVAL), "async zero threshold refused");
+	check(async_create(&async, &pool, BLOWFISH_ENGINE_TABLE, 4096) == 0, "async create");
+	event.fd = async.event_fd;
+	event.events = POLLIN;
+
+	for(round = 0; round < 20; ++round)
+	{
+		for(r = 0; r < REQUESTS; ++r)
+		{
+			ASYNC_REQUEST *request = &requests[r];
+			unsigned char *buffer = data + r * MAX_BLOCKS * 8;
+			uint64_t counter;
+
+			request->ctx = &ctx;
+			request->in = buffer;
+			request->out = buffer;
+			request->blocks = (r % 3 == 0) ? (long)(random64() % 512) : (long)(random64() % MAX_BLOCKS) + 1;	// Some inline, most on the pool
+			request->direction = directions[random64() % 2];
+			request->mode = (random64() % 2) ? BLOWFISH_ECB : BLOWFISH_CTR;
+			request->counter = counter = random64();
+			request->user = (void *)(uintptr_t)r;
+
+			random_bytes(buffer, request->blocks * 8);
+			reference(&ctx, request->direction, request->mode, buffer, expected + r * MAX_BLOCKS * 8, request->blocks, &counter);
+
+			if(async_submit(&async, request) == 0)
+			{
+				queued++;
+			}
+			else
+			{
+				completed++;
+				check(memcmp(buffer, expected + r * MAX_BLOCKS * 8, request->blocks * 8) == 0, "async inline request");
+			}
+		}
+
+		while(completed < (round + 1) * REQUESTS)
+		{
+			ASYNC_REQUEST *request = async_complete(&async);
+			if(request == NULL)
+			{
+				check(poll(&event, 1, 10000) == 1, "async completion signaled");
+				continue;
+			}
+			r = (int)(uintptr_t)request->user;
+			completed++;
+			check(memcmp(data + r * MAX_BLOCKS * 8, expected + r * MAX_BLOCKS * 8, request->blocks * 8) == 0, "async pool request");
+		}
+	}
+	check((queued > 0) && (async_complete(&async) == NULL), "async queue drained");
+
+	async_destroy(&async);
+	pool_destroy(&pool);
+	free(data);
+	free(expected);
+}
+
+
+/**
+ * @brief [8] Verify mode and plaintext digest
+ */
+static void test_verify(void)
+{
+	static const long sizes[] = {0, 7, 8, 3 * 4096 + 1, 100003};
+	static const int thread_counts[] = {1, 3, 8};
+	BLOWFISH_CTX ctx;
+	unsigned char *plaintext = (unsigned char *) malloc(100003);
+	unsigned char *data;
+	char path[256];
+	char description[256];
+	char expected[64];
+	char options[128];
+	char line[256];
+	long length = 0;
+	unsigned int s, t;
+
+	(BLOWFISH_ENGINE_DEFAULT == BLOWFISH_ENGINE_CONSTANT_TIME ? Blowfish_InitCT : Blowfish_Init)(&ctx, (unsigned char *)TEST_KEY, strlen(TEST_KEY));
+
+	for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+	{
+		long size = sizes[s];
+
+		random_bytes(plaintext, size);
+		snprintf(expected, sizeof(expected), "Digest: %016llx\n", (unsigned long long)digest_final(&ctx, BLOWFISH_ENGINE_DEFAULT, digest_update(0, plaintext, size, 0), size));
+		snprintf(options, sizeof(options), "--frame-size=4096 --digest=%.16s", expected + 8);
+		snprintf(path, sizeof(path), "%s/plain", directory);
+		write_file(path, plaintext, size);
+
+		for(t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); ++t)
+		{
+			snprintf(description, sizeof(description), "digest size %ld threads %d", size, thread_counts[t]);
+			check((run('e', "plain", "cipher", thread_counts[t], "--frame-size=4096 --digest", line, sizeof(line)) == 0) && (strcmp(line, expected) == 0), description);
+			check((run('d', "cipher", "decrypted", thread_counts[t], "--digest", line, sizeof(line)) == 0) && (strcmp(line, expected) == 0), description);
+
+			snprintf(path, sizeof(path), "%s/verified", directory);
+			unlink(path);
+			check((run('v', "cipher", "verified", thread_counts[t], options, line, sizeof(line)) == 0) && (strcmp(line, expected) == 0), description);
+			check(access(path, F_OK) != 0, "verify writes nothing");
+		}
+	}
+
+	// Corrupt a block in the middle: the padding is still valid, only the digest can tell
+	check((run('v', "cipher", "verified", 2, "--digest=0000000000000000", line, sizeof(line)) != 0) && (strncmp(line, "Digest: ", 8) == 0), "verify with a different digest refused");
+	check((run('v', "cipher", "verified", 2, "--digest=0", line, sizeof(line)) != 0) && (line[0] == '\0'), "short digest refused before running");
+	check((run('v', "cipher", "verified", 2, "--digest=0123456789abcdeg", line, sizeof(line)) != 0) && (line[0] == '\0'), "non-hex digest refused before running");
+	snprintf(path, sizeof(path), "%s/cipher", directory);
+	data = read_file(path, &length);
+	data[length / 2] ^= 0x01;
+	write_file(path, data, length);
+	free(data);
+	check(run('v', "cipher", "verified", 2, options, NULL, 0) != 0, "verify of a corrupted ciphertext refused");
+	check(run('i', "plain", "verified", 2, "--digest", NULL, 0) != 0, "digest outside e, d and v refused");
+
+	free(plaintext);
+}
+
+
+/**
+ * @brief [9] Memory buffers
+ */
+static void test_buffer(void)
+{
+	static const long sizes[] = {0, 1, 7, 8, 9, 4095, 4096, 4097, 5 * 4096 + 3, 100003, 1L << 20};
+	BLOWFISH_CTX ctx, wrong_ctx;
+	POOL pool;
+	long max = (1L << 20) + 8;
+	unsigned char *plaintext = (unsigned char *) malloc(max);
+	unsigned char *expected = (unsigned char *) malloc(max);
+	unsigned char *data = (unsigned char *) malloc(max);
+	char description[256];
+	unsigned int s;
+	int path;
+
+	Blowfish_Init(&ctx, (unsigned char *)TEST_KEY, strlen(TEST_KEY));
+	Blowfish_Init(&wrong_ctx, (unsigned char *)TEST_NEW_KEY, strlen(TEST_NEW_KEY));
+	pool_create(&pool, 3);
+
+	for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+	{
+		long size = sizes[s];
+		long padded = BUFFER_PADDED_LENGTH(size);
+
+		random_bytes(plaintext, size);
+		memcpy(expected, plaintext, size);
+		memset(expected + size, (int)(padded - size), padded - size);
+		reference(&ctx, 'e', BLOWFISH_ECB, expected, expected, padded / 8, NULL);
+
+		for(path = 0; path < 3; ++path)	// Inline, pool, pool in place
+		{
+			POOL *p = (path == 0) ? NULL : &pool;
+
+			snprintf(description, sizeof(description), "buffer size %ld path %d", size, path);
+			memcpy(data, plaintext, size);
+			check(buffer_crypt(&ctx, BLOWFISH_ENGINE_TABLE, 'e', (path == 2) ? data : plaintext, data, size, p, 4096) == padded, description);
+			check(memcmp(data, expected, padded) == 0, description);
+
+			check(buffer_crypt(&ctx, BLOWFISH_ENGINE_TABLE, 'd', data, data, padded, p, 4096) == size, description);
+			check(memcmp(data, plaintext, size) == 0, description);
+		}
+
+		memcpy(data, expected, padded);
+		check(buffer_crypt(&wrong_ctx, BLOWFISH_ENGINE_TABLE, 'd', expected, data, padded, &pool, 4096) == -1, "buffer with a wrong key refused");
+		check(memcmp(data, expected, padded) == 0, "buffer refused untouched");
+	}
+	check(buffer_crypt(&ctx, BLOWFISH_ENGINE_TABLE, 'd', expected, data, 12, &pool, 4096) == -1, "buffer of a wrong length refused");
+	check((buffer_crypt(&ctx, BLOWFISH_ENGINE_TABLE, 'e', plaintext, data, 100000, &pool, 0) == -1) && (errno == EINVAL), "buffer zero threshold refused");
+
+	pool_destroy(&pool);
+	free(plaintext);
+	free(expected);
+	free(data);
+}
+
+
+/**
+ * @brief Send a hello with the given ring to the daemon, as client_connect() does but without its checks
+ *
+ * @return Status answered by the daemon, -1 if the connection failed
+ */
+static int send_hello(const char *socket_path, int memory_fd, uint32_t slots, uint32_t slot_size)
+{
+	DAEMON_HELLO hello = {DAEMON_MAGIC, slots, slot_size, 0};
+	DAEMON_COMPLETION answer;
+	struct sockaddr_un address;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {&hello, sizeof(hello)};
+	struct msghdr message;
+	struct cmsghdr *cmsg;
+	int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	int status = -1;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+	memset(&message, 0, sizeof(message));
+	memset(control, 0, sizeof(control));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&message);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &memory_fd, sizeof(int));
+
+	if((socket_fd >= 0) && (connect(socket_fd, (struct sockaddr *)&address, sizeof(address)) == 0) && (sendmsg(socket_fd, &message, MSG_NOSIGNAL) == sizeof(hello)) && (recv(socket_fd, &answer, sizeof(answer), MSG_WAITALL) == sizeof(answer)))
+	{
+		status = answer.status;
+	}
+	if(socket_fd >= 0)
+	{
+		close(socket_fd);
+	}
+	return status;
+}
+
+
+/**
+ * @brief [10] Daemon and client library
+ */
+static void test_daemon(const char *daemon)
+{
+	BLOWFISH_CTX ctx;
+	CLIENT client;
+	CLIENT greedy;
+	DAEMON_COMPLETION completion;
+	struct pollfd readable;
+	struct timeval timeout = {10, 0};
+	unsigned char expected[4096];
+	char socket_path[256];
+	int attempt = 0;
+	int busy = 0;
+	int passed = 1;
+	int memory_fd;
+	int r;
+
+	Blowfish_Init(&ctx, (unsigned char *)TEST_KEY, strlen(TEST_KEY));
+	snprintf(socket_path, sizeof(socket_path), "%s/daemon.socket", directory);
+
+	pid_t pid = fork();
+	if(pid == 0)
+	{
+		freopen("/dev/null", "w", stdout);
+		execl(daemon, daemon, socket_path, TEST_KEY, "2", (char *)NULL);
+		_exit(127);
+	}
+	for(attempt = 0; (attempt < 500) && (client_connect(&client, socket_path, 4, TEST_SLOT_SIZE) != 0); ++attempt)
+	{
+		usleep(10000);	// Until the daemon listens
+	}
+	check((pid > 0) && (attempt < 500), "daemon connect");
+	if((pid <= 0) || (attempt == 500))
+	{
+		if(pid > 0)
+		{
+			kill(pid, SIGTERM);
+			waitpid(pid, NULL, 0);
+		}
+		return;
+	}
+
+	random_bytes(client_slot(&client, 1), sizeof(expected));
+	reference(&ctx, 'e', BLOWFISH_ECB, client_slot(&client, 1), expected, sizeof(expected) / 8, NULL);
+	check((client_submit(&client, 1, 1, sizeof(expected), 'e') == 0) && (client_wait(&client, &completion) == 0) && (completion.id == 1) && (completion.status == 0) && (memcmp(client_slot(&client, 1), expected, sizeof(expected)) == 0), "daemon request");
+
+	check((client_submit(&client, 2, 4, sizeof(expected), 'e') == 0) && (client_wait(&client, &completion) == 0) && (completion.id == 2) && (completion.status == EINVAL), "daemon slot out of range refused");
+
+	// Two requests on the same slot back to back: the second arrives while the first is still running (retried in the unlikely case it was already done)
+	for(attempt = 0; (attempt < 10) && !busy; ++attempt)
+	{
+		passed &= (client_submit(&client, 3, 0, TEST_SLOT_SIZE, 'e') == 0) && (client_submit(&client, 4, 0, TEST_SLOT_SIZE, 'e') == 0);
+		for(r = 0; r < 2; ++r)
+		{
+			passed &= (client_wait(&client, &completion) == 0);
+			if((completion.id == 4) && (completion.status == EBUSY))
+			{
+				busy = 1;
+			}
+			else
+			{
+				passed &= (completion.status == 0);
+			}
+		}
+	}
+	check(passed && busy, "daemon busy slot refused");
+	client_close(&client);
+
+	// A client that never reads its completions (far more than its socket buffer holds) must not hold the workers: another client is still served
+	passed = (client_connect(&greedy, socket_path, DAEMON_MAX_SLOTS, 8) == 0) && (setsockopt(greedy.socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == 0);	// Fails instead of hanging if the daemon stops reading
+	for(r = 0; passed && (r < DAEMON_MAX_SLOTS); ++r)
+	{
+		passed &= (client_submit(&greedy, r, r, 8, 'e') == 0);
+	}
+	passed &= (client_connect(&client, socket_path, 4, 4096) == 0) && (client_submit(&client, 5, 0, 4096, 'e') == 0);
+	readable.fd = client.socket_fd;
+	readable.events = POLLIN;
+	check(passed && (poll(&readable, 1, 10000) == 1) && (client_wait(&client, &completion) == 0) && (completion.id == 5) && (completion.status == 0), "daemon serves beside a client not reading");
+	client_close(&client);
+	client_close(&greedy);
+
+	// The daemon would get SIGBUS on a ring shorter than announced, or one the client could shrink later
+	memory_fd = memfd_create("test-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	check((memory_fd >= 0) && (ftruncate(memory_fd, 4096) == 0) && (fcntl(memory_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) == 0) && (send_hello(socket_path, memory_fd, 4, 4096) == EINVAL), "daemon undersized ring refused");
+	close(memory_fd);
+	memory_fd = memfd_create("test-ring", MFD_CLOEXEC);
+	check((memory_fd >= 0) && (ftruncate(memory_fd, 4 * 4096) == 0) && (send_hello(socket_path, memory_fd, 4, 4096) == EINVAL), "daemon unsealed ring refused");
+	close(memory_fd);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+
+/**
+ * @brief Remove the scratch directory
+ */
+static void cleanup(void)
+{
+	static const char *files[] = {"plain", "cipher", "decrypted", "chunked", "chunked" MANIFEST_SUFFIX, "rekeyed", "verified", "daemon.socket"};
+	char path[256];
+	unsigned int f;
+
+	for(f = 0; f < sizeof(files) / sizeof(files[0]); ++f)
+	{
+		snprintf(path, sizeof(path), "%s/%s", directory, files[f]);
+		unlink(path);
+	}
+	rmdir(directory);
+}
+
+
+int main(int argc, char **argv)
+{
+	if(argc < 2)
+	{
+		perror("Usage: blowfish-test path_of_blowfish-multithread [path_of_blowfish-daemon]\n");
+		exit(EXIT_FAILURE);
+	}
+	executable = argv[1];
+
+	if(mkdtemp(directory) == NULL)
+	{
+		perror("Problem creating the test directory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	test_vectors();
+	test_kernels();
+	test_files();
+	test_chunked();
+	test_rekey();
+	test_cryptfile();
+	test_async();
+	test_verify();
+	test_buffer();
+	if(argc > 2)
+	{
+		test_daemon(argv[2]);
+	}
+	cleanup();
+
+	printf("%ld checks, %ld failures\n", checks, failures);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,235 @@
+/*
+test_async.cpp:  Test of the C++20 coroutine interface (async.hpp).
+
+Usage: blowfish-test-async
+
+Coroutines co_await encrypt_async() then decrypt_async() in place, ECB and CTR, on sizes below the inline threshold (done without
+suspending) and above it (suspended until the event loop resumes them), many of them in flight together. The ciphertext is compared
+with the reference scalar path and the decryption with the plaintext; buffers that do not fit and CBC must be refused with EINVAL.
+
+All the data comes from a fixed-seed generator, so any failure is reproducible. The exit status is 0 only if every check passed.
+*/
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <coroutine>
+#include <exception>
+#include <vector>
+#include <poll.h>
+#include "async.hpp"
+
+
+#define TEST_KEY "test-key-1234"		//! Key of the requests.
+#define TEST_THRESHOLD 4096				//! Inline threshold in bytes.
+
+
+static long checks = 0;		//! Checks performed.
+static long failures = 0;	//! Checks failed.
+static uint64_t seed = 0x0123456789ABCDEFULL;	//! State of the data generator.
+
+
+/**
+ * Coroutine started on the call, kept until destroyed so that done() can be read
+ */
+struct TASK {
+	struct promise_type {
+		TASK get_return_object() { return TASK{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	std::coroutine_handle<promise_type> handle;	//! Destroyed by the test once done.
+};
+
+
+/**
+ * @brief Record the outcome of a check, failures are printed with their description
+ */
+static void check(int passed, const char *description)
+{
+	checks++;
+	if(!passed)
+	{
+		failures++;
+		printf("FAIL: %s\n", description);
+	}
+}
+
+
+/**
+ * @brief Next number of the data generator (xorshift64*)
+ */
+static uint64_t random64(void)
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 0x2545F4914F6CDD1DULL;
+}
+
+
+static void random_bytes(unsigned char *data, long length)
+{
+	long i;
+	for(i = 0; i < length; ++i)
+	{
+		data[i] = (unsigned char)(random64() >> 56);
+	}
+}
+
+
+static uint64_t load_be64(const unsigned char *p)
+{
+	uint64_t x = 0;
+	int i;
+	for(i = 0; i < 8; ++i)
+	{
+		x = (x << 8) | p[i];
+	}
+	return x;
+}
+
+
+static void store_be64(unsigned char *p, uint64_t x)
+{
+	int i;
+	for(i = 7; i >= 0; --i, x >>= 8)
+	{
+		p[i] = (unsigned char)x;
+	}
+}
+
+
+/**
+ * @brief Reference scalar encryption, one block at a time with the functions of blowfish.c (ECB or CTR from counter)
+ */
+static void reference(BLOWFISH_CTX *ctx, BLOWFISH_MODE mode, const unsigned char *in, unsigned char *out, long blocks, uint64_t counter)
+{
+	long i;
+
+	for(i = 0; i < blocks; ++i)
+	{
+		uint64_t x = load_be64(in + 8*i);
+		store_be64(out + 8*i, (mode == BLOWFISH_ECB) ? BlowfishEncryption(ctx, x) : x ^ BlowfishEncryption(ctx, counter + i));
+	}
+}
+
+
+/**
+ * @brief Encrypt a random buffer then decrypt it in place, checking both against the reference
+ */
+static TASK round_trip(ASYNC *async, BLOWFISH_CTX *ctx, long blocks, BLOWFISH_MODE mode)
+{
+	std::vector<unsigned char> plaintext(blocks * 8);
+	std::vector<unsigned char> expected(blocks * 8);
+	std::vector<unsigned char> data(blocks * 8);
+	uint64_t counter = random64();
+	int status;
+
+	random_bytes(plaintext.data(), blocks * 8);
+	reference(ctx, mode, plaintext.data(), expected.data(), blocks, counter);
+
+	status = co_await encrypt_async(async, ctx, plaintext, data, mode, counter);
+	check((status == 0) && (data == expected), "async coroutine encryption");
+
+	status = co_await decrypt_async(async, ctx, data, data, mode, counter);
+	check((status == 0) && (data == plaintext), "async coroutine decryption in place");
+}
+
+
+/**
+ * @brief Buffers that do not fit and CBC are refused without suspending
+ */
+static TASK refused(ASYNC *async, BLOWFISH_CTX *ctx)
+{
+	std::vector<unsigned char> in(64);
+	std::vector<unsigned char> out(64);
+
+	check(co_await encrypt_async(async, ctx, std::span<const unsigned char>(in).first(13), out) == EINVAL, "async coroutine partial block refused");
+	check(co_await encrypt_async(async, ctx, in, std::span<unsigned char>(out).first(56)) == EINVAL, "async coroutine short output refused");
+	check(co_await decrypt_async(async, ctx, in, out, BLOWFISH_CBC) == EINVAL, "async coroutine CBC refused");
+}
+
+
+int main(void)
+{
+	enum { TASKS = 24 };
+	static const BLOWFISH_MODE modes[] = {BLOWFISH_ECB, BLOWFISH_CTR};
+	BLOWFISH_CTX ctx;
+	POOL pool;
+	ASYNC async;
+	std::vector<TASK> tasks;
+	struct pollfd event;
+	int pending = 0;
+	int t;
+
+	Blowfish_Init(&ctx, (unsigned char *)TEST_KEY, strlen(TEST_KEY));
+	if((pool_create(&pool, 3) != 0) || (async_create(&async, &pool, BLOWFISH_ENGINE_TABLE, TEST_THRESHOLD) != 0))
+	{
+		perror("Problem creating the pool\n");
+		exit(EXIT_FAILURE);
+	}
+	event.fd = async.event_fd;
+	event.events = POLLIN;
+
+	// Below the threshold both requests are done inline: the coroutine has ended when the call returns
+	for(t = 0; t < 8; ++t)
+	{
+		TASK task = round_trip(&async, &ctx, (long)(random64() % (TEST_THRESHOLD / 8)), modes[t % 2]);
+		check(task.handle.done(), "async coroutine inline request without suspension");
+		task.handle.destroy();
+	}
+
+	TASK task = refused(&async, &ctx);
+	check(task.handle.done(), "async coroutine refused request without suspension");
+	task.handle.destroy();
+
+	// Above it they go to the pool, inline ones mixed in: the loop resumes them as they complete
+	for(t = 0; t < TASKS; ++t)
+	{
+		long blocks = (t % 4 == 0) ? (long)(random64() % (TEST_THRESHOLD / 8)) : TEST_THRESHOLD / 8 + (long)(random64() % 16384);
+
+		tasks.push_back(round_trip(&async, &ctx, blocks, modes[random64() % 2]));
+		if(t % 4 != 0)
+		{
+			check(!tasks.back().handle.done(), "async coroutine pool request suspended");
+		}
+	}
+
+	for(;;)
+	{
+		pending = 0;
+		for(t = 0; t < TASKS; ++t)
+		{
+			pending += !tasks[t].handle.done();
+		}
+		if(pending == 0)
+		{
+			break;
+		}
+		if(poll(&event, 1, 10000) != 1)
+		{
+			check(0, "async coroutine completion signaled");
+			break;
+		}
+		async_resume(&async);
+	}
+
+	for(t = 0; t < TASKS; ++t)
+	{
+		if(tasks[t].handle.done())
+		{
+			tasks[t].handle.destroy();
+		}
+	}
+	async_destroy(&async);
+	pool_destroy(&pool);
+
+	printf("%ld checks, %ld failures\n", checks, failures);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
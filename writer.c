@@ -0,0 +1,152 @@
+/*
+writer.c:  Output writer.
+
+The final length of the output is known before any thread starts, so the whole file is allocated at once with fallocate(): the filesystem can hand out large contiguous extents, instead of growing the file out of order as each thread writes further on.
+Threads then write large page-aligned frames at their final positions with pwrite() (no shared file cursor to lock), and each thread keeps the write-back of its own region going with sync_file_range(): every frame is queued for write-back as soon as it is written, and a thread that is more than WRITER_WINDOW bytes ahead of the disk waits for the older part of its region.
+Dirty pages therefore stay bounded and are written while the (en|de)cryption goes on, rather than all at exit or whenever the kernel hits its dirty limits.
+An output that cannot seek (a pipe, a socket, a terminal) is written with write() in file order instead: a thread waits for the bytes in front of its frame to be written before writing it, so the threads still (en|de)crypt in parallel but only one frame ahead of the output.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "writer.h"
+
+
+/**
+ * @brief Prepare an output of known length
+ *
+ * @param writer [out] Writer
+ * @param output_file [in] Output file, already opened (and truncated)
+ * @param length [in] Final length in bytes
+ * @param sync [in] Durability on close
+ * @return 0 on success, -1 if the space could not be allocated (errno is set)
+ */
+int writer_open(WRITER *writer, FILE *output_file, long length, WRITER_SYNC sync)
+{
+	struct stat status;
+	int known = 0;
+
+	writer->fd = fileno(output_file);
+	writer->length = length;
+	writer->sync = sync;
+	known = (fstat(writer->fd, &status) == 0);
+	writer->regular = known && S_ISREG(status.st_mode);
+	writer->sequential = !known || !(S_ISREG(status.st_mode) || S_ISBLK(status.st_mode));	// pwrite() would fail with ESPIPE
+	writer->next = 0;
+	if(writer->sequential)
+	{
+		pthread_mutex_init(&writer->mutex, NULL);
+		pthread_cond_init(&writer->turn, NULL);
+	}
+
+	if(writer->regular && (length > 0) && (fallocate(writer->fd, 0, 0, length) != 0))
+	{
+		if((errno == ENOSPC) || (errno == EFBIG))
+		{
+			return -1;
+		}
+		// The filesystem cannot allocate in advance (EOPNOTSUPP), the writes extend the file as usual
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Start a cursor at the beginning of a thread's region
+ */
+void writer_cursor(WRITER_CURSOR *cursor, long offset)
+{
+	cursor->synced = offset;
+	cursor->written = offset;
+}
+
+
+/**
+ * @brief Write at an absolute position and keep the write-back of the cursor region going
+ *
+ * @param writer [in] Writer
+ * @param cursor [in,out] Region of the calling thread, offset must follow the previous write of the cursor
+ * @param buffer [in] Data
+ * @param length [in] Data length in bytes
+ * @param offset [in] Position in the output
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int writer_write(WRITER *writer, WRITER_CURSOR *cursor, const unsigned char *buffer, long length, long offset)
+{
+	long start = offset;
+
+	if(writer->sequential)
+	{
+		pthread_mutex_lock(&writer->mutex);
+			while(writer->next != offset)
+			{
+				pthread_cond_wait(&writer->turn, &writer->mutex);	// The frames in front of this one are not written yet
+			}
+		pthread_mutex_unlock(&writer->mutex);
+	}
+
+	while(length > 0)
+	{
+		ssize_t result = writer->sequential ? write(writer->fd, buffer, length) : pwrite(writer->fd, buffer, length, offset);
+		if(result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(result <= 0)
+		{
+			return -1;	// A sequential output is left blocked, the caller exits
+		}
+		buffer += result;
+		offset += result;
+		length -= result;
+	}
+	cursor->written = offset;
+
+	if(writer->sequential)
+	{
+		pthread_mutex_lock(&writer->mutex);
+			writer->next = offset;
+			pthread_cond_broadcast(&writer->turn);
+		pthread_mutex_unlock(&writer->mutex);
+	}
+
+	if(writer->regular)
+	{
+		// Hints only, errors are not fatal: the data is in the page cache anyway
+		sync_file_range(writer->fd, start, offset - start, SYNC_FILE_RANGE_WRITE);
+		if(cursor->written - cursor->synced > WRITER_WINDOW)
+		{
+			long end = cursor->written - WRITER_WINDOW / 2;	//! Wait for the older half of the window, the newer one keeps being written in the background.
+			sync_file_range(writer->fd, cursor->synced, end - cursor->synced, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+			cursor->synced = end;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Make the output durable if requested
+ *
+ * sync_file_range() only moves data pages, fsync() is what also writes the metadata (file length, extents) and flushes the device cache.
+ *
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int writer_close(WRITER *writer)
+{
+	if(writer->sequential)
+	{
+		pthread_mutex_destroy(&writer->mutex);
+		pthread_cond_destroy(&writer->turn);
+		writer->sequential = 0;
+	}
+	if((writer->sync == WRITER_SYNC_FSYNC) && (fsync(writer->fd) != 0) && (errno != EINVAL))
+	{
+		return -1;	// EINVAL: the output (e.g. a pipe) cannot be synchronized
+	}
+	return 0;
+}
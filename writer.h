@@ -0,0 +1,55 @@
+/*
+writer.h:  Header file for writer.c
+*/
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+
+#define WRITER_ALIGNMENT 4096			//! Writes start on page (and filesystem block) boundaries, except the last ones of the file.
+#define WRITER_WINDOW (8L << 20)		//! Dirty bytes a cursor may leave behind before waiting for their write-back.
+
+
+/**
+ * Durability of the output when the writer is closed
+ */
+typedef enum {
+  WRITER_SYNC_NONE,		//! Leave the write-back to the kernel (the data is safe once it reaches the disk on its own).
+  WRITER_SYNC_FSYNC		//! fsync() the output, the data and the file length are on disk when writer_close() returns.
+} WRITER_SYNC;
+
+
+/**
+ * Output file of known final length, written at absolute positions by several threads
+ */
+typedef struct {
+  int fd;					//! Output file descriptor.
+  long length;				//! Final length in bytes.
+  int regular;				//! 1 if the output is a regular file (allocation and write-back control apply), 0 otherwise.
+  int sequential;			//! 1 if the output cannot seek (pipe, socket, terminal): the writes are issued in file order.
+  long next;				//! Sequential output: position of the next byte to be written.
+  pthread_mutex_t mutex;	//! Sequential output: protects next.
+  pthread_cond_t turn;		//! Sequential output: signaled when next moves.
+  WRITER_SYNC sync;			//! Durability on close.
+} WRITER;
+
+
+/**
+ * Sequential region written by one thread, tracks the part whose write-back has not been waited for yet
+ */
+typedef struct {
+  long synced;				//! Start of the bytes not yet waited for.
+  long written;				//! End of the bytes written so far.
+} WRITER_CURSOR;
+
+
+int writer_open(WRITER *writer, FILE *output_file, long length, WRITER_SYNC sync);
+void writer_cursor(WRITER_CURSOR *cursor, long offset);
+int writer_write(WRITER *writer, WRITER_CURSOR *cursor, const unsigned char *buffer, long length, long offset);
+int writer_close(WRITER *writer);
+
+
+#endif